@@ -111,8 +111,8 @@ CSP_DEFAULT_ROUTE   = CSP_ID_HOST_MAX + 1
 # CSP Flags
 CSP_FRES1			= 0x80 # Reserved for future use
 CSP_FRES2			= 0x40 # Reserved for future use
-CSP_FRES3			= 0x20 # Reserved for future use
-CSP_FRES4			= 0x10 # Reserved for future use
+CSP_FMCAST			= 0x20 # Destination is a multicast group
+CSP_FAEAD			= 0x10 # Use ChaCha20-Poly1305 authenticated encryption
 CSP_FHMAC			= 0x08 # Use HMAC verification/generation
 CSP_FXTEA			= 0x04 # Use XTEA encryption/decryption
 CSP_FRDP			= 0x02 # Use RDP protocol
@@ -221,6 +221,10 @@ csp_transaction = libcsp.csp_transaction
 csp_transaction.argtypes = [ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint, ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_int]
 csp_transaction.restype = ctypes.c_int
 
+csp_transaction2 = libcsp.csp_transaction2
+csp_transaction2.argtypes = [ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint, ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_int, ctypes.c_uint32]
+csp_transaction2.restype = ctypes.c_int
+
 csp_transaction_persistent = libcsp.csp_transaction_persistent
 csp_transaction_persistent.argtypes = [ctypes.POINTER(csp_conn_t), ctypes.c_uint, ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_int]
 csp_transaction_persistent.restype = ctypes.c_int
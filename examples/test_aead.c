@@ -0,0 +1,219 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* ChaCha20-Poly1305 known-answer tests from RFC 8439, and of the AEAD packet
+ * format. Exits with 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <csp/csp.h>
+
+#ifdef CSP_USE_AEAD
+#include "crypto/csp_chacha20.h"
+#include "crypto/csp_poly1305.h"
+#include "crypto/csp_aead.h"
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+static void load32(uint32_t * words, const uint8_t * bytes, int count) {
+	for (int i = 0; i < count; i++)
+		words[i] = bytes[4 * i] | (bytes[4 * i + 1] << 8) | (bytes[4 * i + 2] << 16) | ((uint32_t) bytes[4 * i + 3] << 24);
+}
+
+/* RFC 8439 2.3.2 */
+static void test_chacha20(void) {
+
+	static const uint8_t nonce_bytes[12] = {0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00};
+	static const uint8_t expect[64] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e};
+	uint8_t key_bytes[32], stream[CSP_CHACHA20_BLOCKSIZE];
+	uint32_t key[8], nonce[3];
+
+	for (int i = 0; i < 32; i++)
+		key_bytes[i] = i;
+	load32(key, key_bytes, 8);
+	load32(nonce, nonce_bytes, 3);
+
+	csp_chacha20_block(stream, key, 1, nonce);
+	check(memcmp(stream, expect, sizeof(expect)) == 0, "ChaCha20 block function");
+
+}
+
+/* RFC 8439 2.5.2 */
+static void test_poly1305(void) {
+
+	static const uint8_t key[32] = {
+		0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+		0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b};
+	static const uint8_t expect[16] = {
+		0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6, 0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9};
+	const char * msg = "Cryptographic Forum Research Group";
+	csp_poly1305_state st;
+	uint8_t tag[CSP_POLY1305_TAG_LENGTH];
+
+	/* In two parts, to cover buffering of a partial block */
+	csp_poly1305_init(&st, key);
+	csp_poly1305_update(&st, (const uint8_t *) msg, 5);
+	csp_poly1305_update(&st, (const uint8_t *) msg + 5, strlen(msg) - 5);
+	csp_poly1305_finish(&st, tag);
+	check(memcmp(tag, expect, sizeof(expect)) == 0, "Poly1305 tag");
+
+}
+
+/* RFC 8439 2.8.2, built from the primitives the way csp_aead_encrypt does */
+static void test_construction(void) {
+
+	static const char plain[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+	static const uint8_t aad[12] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+	static const uint8_t nonce_bytes[12] = {0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+	static const uint8_t cipher[114] = {
+		0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+		0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+		0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+		0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+		0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+		0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+		0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+		0x61, 0x16};
+	static const uint8_t expect_tag[16] = {
+		0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+	uint8_t key_bytes[32], data[114], block[CSP_CHACHA20_BLOCKSIZE], lengths[16] = {0}, tag[16];
+	uint32_t key[8], nonce[3];
+	csp_poly1305_state st;
+	unsigned int offset, i;
+
+	for (i = 0; i < 32; i++)
+		key_bytes[i] = 0x80 + i;
+	load32(key, key_bytes, 8);
+	load32(nonce, nonce_bytes, 3);
+	memcpy(data, plain, sizeof(data));
+
+	csp_chacha20_block(block, key, 0, nonce);
+	csp_poly1305_init(&st, block);
+	csp_poly1305_update(&st, aad, sizeof(aad));
+	csp_poly1305_pad(&st);
+
+	for (offset = 0; offset < sizeof(data); offset += CSP_CHACHA20_BLOCKSIZE) {
+		csp_chacha20_block(block, key, 1 + offset / CSP_CHACHA20_BLOCKSIZE, nonce);
+		for (i = offset; i < sizeof(data) && i < offset + CSP_CHACHA20_BLOCKSIZE; i++)
+			data[i] ^= block[i - offset];
+	}
+	csp_poly1305_update(&st, data, sizeof(data));
+	csp_poly1305_pad(&st);
+
+	lengths[0] = sizeof(aad);
+	lengths[8] = sizeof(data);
+	csp_poly1305_update(&st, lengths, sizeof(lengths));
+	csp_poly1305_finish(&st, tag);
+
+	check(memcmp(data, cipher, sizeof(cipher)) == 0, "AEAD cipher text");
+	check(memcmp(tag, expect_tag, sizeof(expect_tag)) == 0, "AEAD tag");
+
+}
+
+/* Packets from node 1 to node 2, with the key derived from "aead-key" */
+static void test_packet(void) {
+
+	static const uint8_t secured[94] = {
+		0xa7, 0x27, 0x89, 0xcf, 0xea, 0x95, 0x7b, 0x7e, 0x08, 0xf4, 0x77, 0xc3, 0xc5, 0x8a, 0x83, 0x08,
+		0x08, 0x2b, 0x25, 0x12, 0x42, 0x55, 0xe6, 0x4f, 0xc9, 0xc4, 0x17, 0x71, 0x88, 0x22, 0x89, 0x7a,
+		0x27, 0x9e, 0xce, 0x57, 0x2d, 0x01, 0x70, 0x7b, 0x3f, 0xc4, 0xd9, 0xdf, 0xf6, 0x96, 0x67, 0x4e,
+		0x80, 0xe7, 0x16, 0xc0, 0x55, 0x45, 0xa2, 0xa3, 0x1d, 0x65, 0x61, 0x1e, 0x93, 0x47, 0xd8, 0x14,
+		0xb1, 0x6d, 0xd9, 0xd9, 0xe9, 0x47, 0x06, 0xab, 0x7d, 0x1f, 0xa8, 0x44, 0x92, 0x03, 0x4a, 0xe2,
+		0x32, 0x1a, 0x1d, 0xb8, 0xc3, 0x47, 0xef, 0xbe, 0xad, 0xde, 0x01, 0x00, 0x00, 0x00};
+	csp_id_t id = {.ext = 0};
+	id.pri = 2;
+	id.src = 1;
+	id.dst = 2;
+	id.dport = 10;
+	id.sport = 20;
+	id.flags = CSP_FAEAD;
+
+	csp_packet_t * packet = csp_buffer_get(256);
+	csp_packet_t * copy = csp_buffer_get(256);
+	for (int i = 0; i < 70; i++)
+		packet->data[i] = i * 5;
+	packet->length = 70;
+	memcpy(copy->data, packet->data, 70);
+
+	csp_aead_set_key("aead-key", 8);
+	check(csp_aead_encrypt(packet, id) != 0, "refuse to encrypt without salt");
+
+	csp_aead_set_salt(0xdeadbeef);
+	check(csp_aead_encrypt(packet, id) == 0 && packet->length == sizeof(secured)
+			&& memcmp(packet->data, secured, sizeof(secured)) == 0, "encrypt packet");
+
+	check(csp_aead_decrypt(packet, id) == 0 && packet->length == 70
+			&& memcmp(packet->data, copy->data, 70) == 0, "decrypt packet");
+
+	/* Anything changed in the header, data, tag or nonce is rejected */
+	csp_id_t other = id;
+	other.dport = 11;
+	int rejected = 1;
+	for (int i = -1; i < (int) sizeof(secured); i++) {
+		memcpy(packet->data, secured, sizeof(secured));
+		packet->length = sizeof(secured);
+		if (i >= 0)
+			packet->data[i] ^= 0x40;
+		if (csp_aead_decrypt(packet, i < 0 ? other : id) == 0)
+			rejected = 0;
+	}
+	check(rejected, "reject modified packets");
+
+	/* A peer key is used for its node only */
+	csp_aead_set_peer_key(1, "other-key", 9);
+	memcpy(packet->data, secured, sizeof(secured));
+	packet->length = sizeof(secured);
+	check(csp_aead_decrypt(packet, id) != 0, "peer key");
+
+	csp_buffer_free(packet);
+	csp_buffer_free(copy);
+
+}
+
+int main(void) {
+
+	csp_buffer_init(4, 256 + CSP_BUFFER_PACKET_OVERHEAD);
+	csp_aead_init();
+
+	test_chacha20();
+	test_poly1305();
+	test_construction();
+	test_packet();
+
+	return failed ? 1 : 0;
+
+}
+#else
+int main(void) {
+	printf("SKIP: CSP was built without AEAD\r\n");
+	return 0;
+}
+#endif
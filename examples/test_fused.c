@@ -0,0 +1,157 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Known-answer test of single pass HMAC, CRC32 and XTEA, and check that it
+ * gives the same packets as the separate functions. Exits with 0 when all
+ * tests pass. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+
+#include "csp_security.h"
+
+#ifdef CSP_SECURITY_FUSED
+#include "csp_crc32.h"
+#include "crypto/csp_hmac.h"
+#include "crypto/csp_xtea.h"
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+/* Secure a packet the way csp_send_direct does without the single pass */
+static void append_separate(csp_packet_t * packet, uint8_t flags, uint8_t node) {
+#ifdef CSP_USE_HMAC
+	if (flags & CSP_FHMAC)
+		csp_hmac_append(packet, node);
+#endif
+#ifdef CSP_USE_CRC32
+	if (flags & CSP_FCRC32)
+		csp_crc32_append(packet);
+#endif
+#ifdef CSP_USE_XTEA
+	if (flags & CSP_FXTEA) {
+		uint32_t nonce = (uint32_t)rand();
+		uint32_t nonce_n = csp_hton32(nonce);
+		memcpy(&packet->data[packet->length], &nonce_n, sizeof(nonce_n));
+		uint32_t iv[2] = {nonce, 1};
+		csp_xtea_encrypt(packet->data, packet->length, iv, node);
+		packet->length += sizeof(nonce_n);
+	}
+#endif
+}
+
+static void fill(csp_packet_t * packet, uint16_t length) {
+	packet->length = length;
+	for (int i = 0; i < length; i++)
+		packet->data[i] = i * 3;
+}
+
+int main(void) {
+
+	csp_buffer_init(4, 256 + CSP_BUFFER_PACKET_OVERHEAD);
+#ifdef CSP_USE_CRC32
+	csp_crc32_gentab();
+#endif
+#ifdef CSP_USE_HMAC
+	csp_hmac_set_key("hmac-key", 8);
+#endif
+#ifdef CSP_USE_XTEA
+	csp_xtea_set_key("xtea-key", 8);
+#endif
+
+	csp_packet_t * fused = csp_buffer_get(256);
+	csp_packet_t * separate = csp_buffer_get(256);
+
+#if defined(CSP_USE_HMAC) && defined(CSP_USE_CRC32) && defined(CSP_USE_XTEA)
+	/* 70 bytes with HMAC, CRC32 and XTEA, nonce 0x11223344 */
+	static const uint8_t secured[82] = {
+		0x6a, 0xa8, 0xc0, 0x19, 0xed, 0xd1, 0x20, 0x57, 0x72, 0xb0, 0xd8, 0x31, 0xc5, 0xf9, 0x18, 0x6f,
+		0x2f, 0xdd, 0xc1, 0x64, 0xb3, 0xe7, 0x77, 0xdd, 0x1e, 0x2d, 0x85, 0x99, 0xb5, 0xc9, 0x78, 0x2e,
+		0x23, 0xa2, 0x24, 0xbd, 0x80, 0x6d, 0xde, 0xe9, 0x00, 0xda, 0x1f, 0xd0, 0xfa, 0xc3, 0x8d, 0xb8,
+		0x97, 0xe6, 0xb4, 0xc2, 0xb7, 0xaa, 0x34, 0xfe, 0x1d, 0x3d, 0x65, 0x9e, 0x45, 0x6f, 0xd0, 0xfc,
+		0x09, 0x59, 0xad, 0x1e, 0xa3, 0xfd, 0x86, 0x61, 0xbe, 0x79, 0x75, 0x17, 0x6d, 0xd2, 0x11, 0x22,
+		0x33, 0x44};
+	const uint8_t all = CSP_FHMAC | CSP_FCRC32 | CSP_FXTEA;
+
+	memcpy(fused->data, secured, sizeof(secured));
+	fused->length = sizeof(secured);
+	fill(separate, 70);
+	check(csp_security_verify(fused, all, 1) == CSP_ERR_NONE && fused->length == 70
+			&& memcmp(fused->data, separate->data, 70) == 0, "verify known packet");
+
+	memcpy(fused->data, secured, sizeof(secured));
+	fused->length = sizeof(secured);
+	fused->data[40] ^= 0x01;
+	check(csp_security_verify(fused, all, 1) != CSP_ERR_NONE, "reject modified packet");
+#endif
+
+	/* Every combination the single pass handles, at lengths around the chunk size */
+	static const uint8_t flags[] = {
+		CSP_FHMAC | CSP_FCRC32, CSP_FHMAC | CSP_FXTEA, CSP_FCRC32 | CSP_FXTEA,
+		CSP_FHMAC | CSP_FCRC32 | CSP_FXTEA};
+	static const uint16_t lengths[] = {0, 1, 31, 32, 33, 64, 70, 200};
+	int same = 1, verified = 1;
+
+	for (unsigned int f = 0; f < sizeof(flags); f++) {
+		if (!csp_security_fused(flags[f]))
+			continue;
+		for (unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+			fill(fused, lengths[l]);
+			fill(separate, lengths[l]);
+
+			/* Both draw the same nonce */
+			srand(l + 1);
+			csp_security_append(fused, flags[f], 2);
+			srand(l + 1);
+			append_separate(separate, flags[f], 2);
+
+			if (fused->length != separate->length || memcmp(fused->data, separate->data, fused->length) != 0)
+				same = 0;
+
+			fill(separate, lengths[l]);
+			if (csp_security_verify(fused, flags[f], 2) != CSP_ERR_NONE || fused->length != lengths[l]
+					|| memcmp(fused->data, separate->data, lengths[l]) != 0)
+				verified = 0;
+		}
+	}
+	check(same, "same output as separate functions");
+	check(verified, "verify and strip");
+
+	csp_buffer_free(fused);
+	csp_buffer_free(separate);
+
+	return failed ? 1 : 0;
+
+}
+#else
+int main(void) {
+	printf("SKIP: CSP was built with less than two of HMAC, CRC32 and XTEA\r\n");
+	return 0;
+}
+#endif
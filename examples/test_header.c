@@ -0,0 +1,102 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Known-answer test of encoding and decoding the CSP header on the wire, in
+ * the 32-bit format and, with CSP_EXT_HEADER, the 40-bit format. Exits with
+ * 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+static csp_id_t make_id(uint8_t pri, uint8_t src, uint8_t dst, uint8_t dport, uint8_t sport, uint8_t flags) {
+	csp_id_t id = {.ext = 0};
+	id.pri = pri;
+	id.src = src;
+	id.dst = dst;
+	id.dport = dport;
+	id.sport = sport;
+	id.flags = flags;
+	return id;
+}
+
+/* Encode with the 32-bit header and compare, then decode and compare */
+static int legacy_matches(csp_id_t id, const uint8_t wire[4], csp_id_t decoded) {
+	uint8_t buf[CSP_HEADER_LENGTH];
+	if (csp_id_encode(id, buf, 0) != CSP_LEGACY_HEADER_LENGTH || memcmp(buf, wire, 4) != 0)
+		return 0;
+	return csp_id_decode(buf, 0).ext == decoded.ext;
+}
+
+int main(void) {
+
+	/* Priority 2, 5 to 15, ports 10 and 33, flags 0x0a */
+	static const uint8_t legacy[4] = {0x8a, 0xf2, 0xa1, 0x0a};
+	csp_id_t id = make_id(2, 5, 15, 10, 33, 0x0a);
+	check(legacy_matches(id, legacy, id), "32-bit header");
+
+	/* Broadcast is the highest address of the 32-bit header */
+	static const uint8_t broadcast[4] = {0xcb, 0xf0, 0x0c, 0x00};
+	id = make_id(3, 5, CSP_BROADCAST_ADDR, 0, 12, 0);
+	check(legacy_matches(id, broadcast, id), "32-bit broadcast");
+	check(csp_id_length(0) == 4, "32-bit header length");
+
+#ifdef CSP_EXT_HEADER
+	uint8_t buf[CSP_HEADER_LENGTH];
+
+	/* Priority 2, 100 to 17, ports 200 and 33, flags 0x0a */
+	static const uint8_t ext[5] = {0xb2, 0x11, 0xc8, 0x21, 0x0a};
+	id = make_id(2, 100, 17, 200, 33, 0x0a);
+	check(csp_id_encode(id, buf, 1) == 5 && memcmp(buf, ext, sizeof(ext)) == 0, "40-bit header encode");
+	check(csp_id_decode(ext, 1).ext == id.ext, "40-bit header decode");
+	check(csp_id_length(1) == 5, "40-bit header length");
+
+	/* Every field at its highest value survives both directions */
+	id = make_id(CSP_ID_PRIO_MAX, CSP_ID_HOST_MAX - 1, CSP_ID_HOST_MAX, CSP_ID_PORT_MAX, CSP_ID_PORT_MAX, CSP_ID_FLAGS_MAX);
+	csp_id_encode(id, buf, 1);
+	check(csp_id_decode(buf, 1).ext == id.ext, "40-bit header limits");
+
+	/* Addresses and ports beyond the 32-bit header are refused on it */
+	check(!csp_id_fits(make_id(2, 32, 15, 10, 33, 0), 0) && !csp_id_fits(make_id(2, 5, 40, 10, 33, 0), 0)
+			&& !csp_id_fits(make_id(2, 5, 15, 64, 33, 0), 0) && !csp_id_fits(make_id(2, 5, 15, 10, 64, 0), 0),
+			"fit in 32-bit header");
+	check(csp_id_encode(make_id(2, 100, 15, 10, 33, 0), buf, 0) == CSP_ERR_INVAL, "refuse 32-bit header");
+
+	/* Node 31 is not broadcast with the extended header, so it cannot be
+	 * reached over the 32-bit header, unlike multicast group 31 */
+	check(!csp_id_fits(make_id(2, 5, 31, 10, 33, 0), 0), "node 31 does not fit");
+	id = make_id(2, 5, 31, 10, 33, CSP_FMCAST);
+	static const uint8_t group[4] = {0x8b, 0xf2, 0xa1, 0x20};
+	check(legacy_matches(id, group, id), "multicast group 31");
+#endif
+
+	return failed ? 1 : 0;
+
+}
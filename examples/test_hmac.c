@@ -0,0 +1,115 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Known-answer test of the HMAC trailer, and of csp_hmac_verify_batch against
+ * csp_hmac_verify. Exits with 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <csp/csp.h>
+
+#ifdef CSP_USE_HMAC
+#include "crypto/csp_hmac.h"
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+static csp_packet_t * packet_new(uint8_t src, uint16_t length) {
+	csp_packet_t * packet = csp_buffer_get(256);
+	packet->id.src = src;
+	packet->length = length;
+	for (int i = 0; i < length; i++)
+		packet->data[i] = i * 7 + length;
+	return packet;
+}
+
+int main(void) {
+
+	csp_buffer_init(20, 256 + CSP_BUFFER_PACKET_OVERHEAD);
+
+	/* HMAC-SHA1 keyed with the first 16 bytes of SHA1 of the key, truncated */
+	static const uint8_t jefe[] = {0x4b, 0x20, 0xd8, 0x09};
+	static const uint8_t peer[] = {0x54, 0x3c, 0x29, 0x92};
+
+	csp_hmac_set_key("Jefe", 4);
+	csp_hmac_set_peer_key(3, "peer", 4);
+
+	csp_packet_t * packet = csp_buffer_get(256);
+	memcpy(packet->data, "what do ya want for nothing?", 28);
+	packet->length = 28;
+	csp_hmac_append(packet, 1);
+	check(packet->length == 32 && memcmp(&packet->data[28], jefe, 4) == 0, "default key");
+	csp_buffer_free(packet);
+
+	packet = packet_new(3, 200);
+	csp_hmac_append(packet, 3);
+	check(memcmp(&packet->data[200], peer, 4) == 0, "peer key");
+	csp_buffer_free(packet);
+
+	/* Batch of more packets than lanes, with lengths around the SHA1 block
+	 * boundaries, both keys, and some corrupted packets */
+	static const uint16_t lengths[] = {0, 1, 55, 56, 63, 64, 119, 120, 200, 251, 28};
+	const unsigned int count = sizeof(lengths) / sizeof(lengths[0]);
+	csp_packet_t * packets[sizeof(lengths) / sizeof(lengths[0])];
+	int results[sizeof(lengths) / sizeof(lengths[0])];
+	int expect[sizeof(lengths) / sizeof(lengths[0])];
+
+	for (unsigned int i = 0; i < count; i++) {
+		uint8_t src = (i % 3 == 0) ? 3 : 1;
+		packets[i] = packet_new(src, lengths[i]);
+		csp_hmac_append(packets[i], src);
+		if (i % 4 == 1)
+			packets[i]->data[packets[i]->length / 2]++;
+
+		/* Reference result from a copy */
+		packet = csp_buffer_get(256);
+		memcpy(packet, packets[i], sizeof(*packet) + packets[i]->length);
+		expect[i] = csp_hmac_verify(packet, src);
+		csp_buffer_free(packet);
+		results[i] = 1;
+	}
+
+	csp_hmac_verify_batch(packets, results, count);
+
+	int same = 1;
+	for (unsigned int i = 0; i < count; i++) {
+		if (results[i] != expect[i])
+			same = 0;
+		if (results[i] == 0 && packets[i]->length != lengths[i])
+			same = 0;
+		csp_buffer_free(packets[i]);
+	}
+	check(same, "batch matches single packet verification");
+
+	return failed ? 1 : 0;
+
+}
+#else
+int main(void) {
+	printf("SKIP: CSP was built without HMAC\r\n");
+	return 0;
+}
+#endif
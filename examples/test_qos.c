@@ -0,0 +1,128 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Behaviour test of the priority queue: strict priority for critical
+ * traffic and byte based deficit round robin for the other classes.
+ * Exits with 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <csp/csp.h>
+
+#ifdef CSP_USE_QOS
+#include "csp_qos.h"
+
+#define PER_CLASS	60
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+static csp_packet_t * item_packet(const void * item) {
+	return *(csp_packet_t * const *) item;
+}
+
+static void enqueue(csp_qos_queue_t * queue, uint8_t prio, uint16_t length, int count) {
+	for (int i = 0; i < count; i++) {
+		csp_packet_t * packet = csp_buffer_get(length);
+		packet->length = length;
+		packet->id.pri = prio;
+		csp_qos_enqueue(queue, prio, &packet, 0, NULL);
+	}
+}
+
+/* Dequeue count packets, and count them per class */
+static void dequeue(csp_qos_queue_t * queue, int count, int served[CSP_ROUTE_FIFOS]) {
+	memset(served, 0, CSP_ROUTE_FIFOS * sizeof(served[0]));
+	for (int i = 0; i < count; i++) {
+		csp_packet_t * packet;
+		if (csp_qos_dequeue(queue, &packet, 0) != CSP_ERR_NONE)
+			break;
+		served[packet->id.pri]++;
+		csp_buffer_free(packet);
+	}
+}
+
+/* Take whatever is left */
+static void drain(csp_qos_queue_t * queue) {
+	csp_packet_t * packet;
+	while (csp_qos_dequeue(queue, &packet, 0) == CSP_ERR_NONE)
+		csp_buffer_free(packet);
+}
+
+int main(void) {
+
+	csp_qos_queue_t queue;
+	int served[CSP_ROUTE_FIFOS];
+
+	csp_buffer_init(4 * PER_CLASS, 64 + CSP_BUFFER_PACKET_OVERHEAD);
+	const uint16_t full = csp_buffer_size();
+
+	csp_qos_queue_init(&queue, PER_CLASS, sizeof(csp_packet_t *), item_packet, 0);
+
+	/* Critical traffic queued last is still served first */
+	enqueue(&queue, CSP_PRIO_LOW, full, PER_CLASS);
+	enqueue(&queue, CSP_PRIO_NORM, full, PER_CLASS);
+	enqueue(&queue, CSP_PRIO_HIGH, full, PER_CLASS);
+	enqueue(&queue, CSP_PRIO_CRITICAL, full, 3);
+	dequeue(&queue, 3, served);
+	check(served[CSP_PRIO_CRITICAL] == 3, "strict priority for critical");
+
+	/* Full buffers share by the default weights of 4, 2 and 1 */
+	dequeue(&queue, 7 * 6, served);
+	check(served[CSP_PRIO_HIGH] == 24 && served[CSP_PRIO_NORM] == 12 && served[CSP_PRIO_LOW] == 6, "weights 4:2:1");
+	drain(&queue);
+
+	/* Shares are in bytes, so a class of small packets sends more of them */
+	enqueue(&queue, CSP_PRIO_HIGH, full, PER_CLASS);
+	enqueue(&queue, CSP_PRIO_LOW, full / 4, PER_CLASS);
+	dequeue(&queue, 8 * 5, served);
+	check(served[CSP_PRIO_HIGH] == 20 && served[CSP_PRIO_LOW] == 20, "byte based shares");
+	drain(&queue);
+
+	/* Weights can be changed, and a class without traffic leaves its share to the others */
+	csp_qos_set_weight(CSP_PRIO_HIGH, 1);
+	csp_qos_set_weight(CSP_PRIO_LOW, 3);
+	enqueue(&queue, CSP_PRIO_HIGH, full, PER_CLASS);
+	enqueue(&queue, CSP_PRIO_LOW, full, PER_CLASS);
+	dequeue(&queue, 4 * 10, served);
+	check(served[CSP_PRIO_HIGH] == 10 && served[CSP_PRIO_LOW] == 30 && served[CSP_PRIO_NORM] == 0, "set weights");
+	drain(&queue);
+
+	check(csp_qos_set_weight(CSP_PRIO_CRITICAL, 1) == CSP_ERR_INVAL && csp_qos_set_weight(CSP_PRIO_LOW, 0) == CSP_ERR_INVAL,
+			"reject invalid weights");
+
+	csp_qos_queue_free(&queue);
+	check(csp_buffer_remaining() == 4 * PER_CLASS, "all buffers returned");
+
+	return failed ? 1 : 0;
+
+}
+#else
+int main(void) {
+	printf("SKIP: CSP was built without QoS\r\n");
+	return 0;
+}
+#endif
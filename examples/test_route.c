@@ -0,0 +1,124 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Behaviour test of route lookup: the most specific of several netmask
+ * routes, and weighted next hops. Exits with 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+#include "arch/csp_queue.h"
+#include "csp_route.h"
+
+#define FLOWS	1000
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+static int tx_drop(csp_packet_t * packet, __attribute__ ((unused)) uint32_t timeout) {
+	csp_buffer_free(packet);
+	return 1;
+}
+
+static csp_iface_t if_a = {.name = "A", .nexthop = tx_drop};
+static csp_iface_t if_b = {.name = "B", .nexthop = tx_drop};
+static csp_iface_t if_c = {.name = "C", .nexthop = tx_drop};
+
+/* Connection from node 1 to node dst, numbered by flow */
+static csp_id_t flow_id(uint8_t dst, int flow) {
+	csp_id_t id = {.ext = 0};
+	id.src = 1;
+	id.dst = dst;
+	id.sport = flow % 64;
+	id.dport = 1 + (flow / 64) % 32;
+	id.flags = flow & CSP_FRDP;
+	return id;
+}
+
+int main(void) {
+
+	uint8_t mac;
+
+	csp_buffer_init(10, 300);
+	csp_init(1);
+
+	/* Nested ranges 8-11 and 8-9, and the single node 9. Anything else
+	 * takes the default route set by csp_init. */
+	csp_route_add(8, CSP_ID_HOST_SIZE - 2, &if_a, CSP_NODE_MAC, 1);
+	csp_route_add(8, CSP_ID_HOST_SIZE - 1, &if_b, CSP_NODE_MAC, 1);
+	csp_route_add(9, CSP_ID_HOST_SIZE, &if_c, 3, 1);
+	check(csp_route_if(9, &mac) == &if_c && mac == 3, "host route");
+	check(csp_route_if(8, NULL) == &if_b, "most specific range");
+	check(csp_route_if(10, NULL) == &if_a && csp_route_if(11, NULL) == &if_a, "wider range");
+	check(csp_route_if(12, NULL) == &csp_if_lo && csp_route_if(7, NULL) == &csp_if_lo, "default route");
+
+	csp_route_remove(8, CSP_ID_HOST_SIZE - 1, NULL);
+	check(csp_route_if(8, NULL) == &if_a && csp_route_if(9, NULL) == &if_c, "remove range");
+	check(csp_route_remove(8, CSP_ID_HOST_SIZE - 1, NULL) == CSP_ERR_INVAL, "remove missing route");
+	check(csp_route_add(8, CSP_ID_HOST_SIZE + 1, &if_a, CSP_NODE_MAC, 1) == CSP_ERR_INVAL
+			&& csp_route_add(8, CSP_ID_HOST_SIZE, &if_a, CSP_NODE_MAC, 0) == CSP_ERR_INVAL, "reject invalid routes");
+
+	/* Two next hops weighted 3:1. Connections are spread by weight, and each
+	 * connection always takes the same next hop. */
+	csp_route_add(20, CSP_ID_HOST_SIZE, &if_a, 5, 3);
+	csp_route_add(20, CSP_ID_HOST_SIZE, &if_b, 6, 1);
+	int count_a = 0, count_b = 0, stable = 1, macs = 1;
+	for (int flow = 0; flow < FLOWS; flow++) {
+		csp_iface_t * ifc = csp_route_if_flow(flow_id(20, flow), &mac);
+		if (ifc == &if_a)
+			count_a++;
+		if (ifc == &if_b)
+			count_b++;
+		if ((ifc == &if_a && mac != 5) || (ifc == &if_b && mac != 6))
+			macs = 0;
+		if (csp_route_if_flow(flow_id(20, flow), NULL) != ifc)
+			stable = 0;
+	}
+	printf("Next hops: %d A, %d B\r\n", count_a, count_b);
+	check(count_a + count_b == FLOWS && count_a > FLOWS * 6 / 10 && count_a < FLOWS * 9 / 10, "weighted next hops");
+	check(macs, "MAC address of each next hop");
+	check(stable, "same next hop per connection");
+
+	/* Updating a weight rebalances, and removing a next hop leaves the other */
+	csp_route_add(20, CSP_ID_HOST_SIZE, &if_a, 5, 1);
+	count_a = 0;
+	for (int flow = 0; flow < FLOWS; flow++)
+		if (csp_route_if_flow(flow_id(20, flow), NULL) == &if_a)
+			count_a++;
+	check(count_a > FLOWS * 3 / 10 && count_a < FLOWS * 7 / 10, "update weight");
+
+	csp_route_remove(20, CSP_ID_HOST_SIZE, &if_b);
+	count_a = 0;
+	for (int flow = 0; flow < FLOWS; flow++)
+		if (csp_route_if_flow(flow_id(20, flow), NULL) == &if_a)
+			count_a++;
+	check(count_a == FLOWS, "remove next hop");
+
+	return failed ? 1 : 0;
+
+}
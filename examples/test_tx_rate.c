@@ -0,0 +1,120 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Behaviour test of interface output shaping with a token bucket.
+ * Exits with 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <csp/csp.h>
+
+#include "arch/csp_thread.h"
+#include "arch/csp_time.h"
+
+#define COUNT	60
+#define LENGTH	96
+
+static int failed = 0;
+static volatile int sent = 0;
+static uint32_t sent_at[COUNT];
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+/* Record when each packet leaves the transmit task */
+static int tx_record(csp_packet_t * packet, __attribute__ ((unused)) uint32_t timeout) {
+	if (sent < COUNT)
+		sent_at[sent] = csp_get_ms();
+	sent++;
+	csp_buffer_free(packet);
+	return 1;
+}
+
+static csp_iface_t csp_if_rec = {
+	.name = "REC",
+	.nexthop = tx_record,
+};
+
+static csp_iface_t csp_if_direct = {
+	.name = "DIRECT",
+	.nexthop = tx_record,
+};
+
+/* Queue COUNT packets at once, and wait for them to be sent */
+static uint32_t send_all(void) {
+	sent = 0;
+	uint32_t start = csp_get_ms();
+	for (int i = 0; i < COUNT; i++) {
+		csp_packet_t * packet = csp_buffer_get(LENGTH);
+		packet->length = LENGTH;
+		if (csp_sendto(CSP_PRIO_NORM, 2, 10, 10, CSP_O_NONE, packet, 0) != CSP_ERR_NONE)
+			csp_buffer_free(packet);
+	}
+	while (sent < COUNT && csp_get_ms() - start < 5000)
+		csp_sleep_ms(1);
+	return start;
+}
+
+/* Packets sent within ms of start */
+static int sent_within(uint32_t start, uint32_t ms) {
+	int count = 0;
+	for (int i = 0; i < COUNT; i++)
+		if (sent_at[i] - start <= ms)
+			count++;
+	return count;
+}
+
+int main(void) {
+
+	csp_buffer_init(COUNT + 10, 256);
+	csp_init(1);
+	csp_route_set(2, &csp_if_rec, CSP_NODE_MAC);
+	csp_route_start_tx_task(&csp_if_rec, COUNT, 1000, 0);
+
+	/* Without a rate, packets go out as fast as they come */
+	uint32_t start = send_all();
+	check(sent == COUNT && sent_within(start, 100) == COUNT, "unshaped");
+
+	/* 20000 bytes per second, and a burst of ten packets */
+	const uint32_t bytes = LENGTH + CSP_HEADER_LENGTH;
+	const uint32_t rate = 20000, burst = 10 * bytes;
+	csp_route_set_tx_rate(&csp_if_rec, rate, burst);
+
+	start = send_all();
+	uint32_t expect = (COUNT * bytes - burst) * 1000 / rate;
+	uint32_t took = sent_at[COUNT - 1] - start;
+	printf("Sent %d packets in %"PRIu32" ms, expected %"PRIu32" ms\r\n", sent, took, expect);
+	check(sent == COUNT, "shaped packets sent");
+	/* The bucket holds ten packets, and may go into debt by one more. The
+	 * next packet is due 5 ms later. */
+	check(sent_within(start, 3) >= 10 && sent_within(start, 3) <= 11, "burst");
+	check(took >= expect - expect / 10 && took <= expect * 2, "rate");
+
+	/* Shaping needs a transmit task */
+	check(csp_route_set_tx_rate(&csp_if_direct, rate, burst) == CSP_ERR_INVAL, "no transmit task");
+
+	return failed ? 1 : 0;
+
+}
@@ -0,0 +1,87 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Known-answer test of XTEA counter mode, and of decrypting chunk by chunk.
+ * Exits with 0 when all tests pass. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <csp/csp.h>
+
+#ifdef CSP_USE_XTEA
+#include "crypto/csp_xtea.h"
+
+static int failed = 0;
+
+static void check(int ok, const char * what) {
+	printf("%s: %s\r\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		failed++;
+}
+
+int main(void) {
+
+	/* XTEA keyed with the first 16 bytes of SHA1 of the key. Counter blocks are
+	 * the nonce and the counter, big endian, and the first two blocks share a
+	 * counter. Spans more than one chunk and ends with a partial block. */
+	static const uint8_t cipher[45] = {
+		0xfc, 0xd5, 0xbd, 0x56, 0xa8, 0x1e, 0xfd, 0xb3, 0xf4, 0xdd, 0xb5, 0x5e, 0xa0, 0x16, 0xf5, 0xbb,
+		0x6b, 0x28, 0x53, 0x5c, 0x5e, 0x81, 0x61, 0xeb, 0xc2, 0x39, 0xe3, 0xe8, 0xe7, 0x66, 0x3a, 0xcd,
+		0x9e, 0x23, 0x55, 0xdf, 0x87, 0xde, 0x83, 0x40, 0x2d, 0x21, 0x7f, 0x01, 0xb8};
+	uint8_t plain[45], data[45];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(plain); i++)
+		plain[i] = i;
+
+	csp_xtea_set_key("xtea-key", 8);
+
+	uint32_t iv[2] = {0x01020304, 0x10};
+	memcpy(data, plain, sizeof(data));
+	csp_xtea_encrypt(data, sizeof(data), iv, 1);
+	check(memcmp(data, cipher, sizeof(cipher)) == 0, "encrypt");
+	check(iv[0] == 0x01020304 && iv[1] == 0x10 + 6, "counter advanced by blocks");
+
+	/* Chunks are independent, so they may be decrypted in any order */
+	const uint32_t nonce[2] = {0x01020304, 0x10};
+	csp_xtea_crypt_chunk(&data[CSP_XTEA_CHUNK_LENGTH], CSP_XTEA_CHUNK_LENGTH, sizeof(data) - CSP_XTEA_CHUNK_LENGTH, nonce, 1);
+	csp_xtea_crypt_chunk(data, 0, CSP_XTEA_CHUNK_LENGTH, nonce, 1);
+	check(memcmp(data, plain, sizeof(plain)) == 0, "decrypt by chunk");
+
+	/* A peer key is used for its node only */
+	csp_xtea_set_peer_key(2, "other-key", 9);
+	iv[1] = 0x10;
+	memcpy(data, plain, sizeof(data));
+	csp_xtea_encrypt(data, sizeof(data), iv, 2);
+	check(memcmp(data, cipher, sizeof(cipher)) != 0, "peer key");
+	iv[1] = 0x10;
+	csp_xtea_decrypt(data, sizeof(data), iv, 2);
+	check(memcmp(data, plain, sizeof(plain)) == 0, "decrypt with peer key");
+
+	return failed ? 1 : 0;
+
+}
+#else
+int main(void) {
+	printf("SKIP: CSP was built without XTEA\r\n");
+	return 0;
+}
+#endif
@@ -59,6 +59,8 @@ enum csp_reserved_ports_e {
 	CSP_REBOOT		  	= 4,
 	CSP_BUF_FREE		= 5,
 	CSP_UPTIME			= 6,
+	CSP_TRANSFER		= 7,
+	CSP_DV				= 8,
 	CSP_ANY			 	= (CSP_MAX_BIND_PORT + 1),
 	CSP_PROMISC		 	= (CSP_MAX_BIND_PORT + 2)
 };
@@ -84,16 +86,36 @@ typedef enum {
 
 /** Size of bit-fields in CSP header */
 #define CSP_ID_PRIO_SIZE		2
+#ifdef CSP_EXT_HEADER
+#define CSP_ID_HOST_SIZE		7
+#define CSP_ID_PORT_SIZE		8
+#else
 #define CSP_ID_HOST_SIZE		5
 #define CSP_ID_PORT_SIZE		6
+#endif
 #define CSP_ID_FLAGS_SIZE		8
 
 #define CSP_HEADER_BITS			(CSP_ID_PRIO_SIZE + 2 * CSP_ID_HOST_SIZE + 2 * CSP_ID_PORT_SIZE + CSP_ID_FLAGS_SIZE)
 #define CSP_HEADER_LENGTH		(CSP_HEADER_BITS/8)
 
+/** Size of the 32-bit header, used on interfaces without extended headers */
+#define CSP_LEGACY_HOST_SIZE	5
+#define CSP_LEGACY_PORT_SIZE	6
+#define CSP_LEGACY_HEADER_LENGTH	4
+#define CSP_LEGACY_HOST_MAX		((1 << (CSP_LEGACY_HOST_SIZE)) - 1)
+#define CSP_LEGACY_PORT_MAX		((1 << (CSP_LEGACY_PORT_SIZE)) - 1)
+
+#ifdef CSP_EXT_HEADER
+#if CSP_HEADER_BITS != 40 && __GNUC__
+#error "Extended header length must be 40 bits"
+#endif
+typedef uint64_t csp_id_ext_t;
+#else
 #if CSP_HEADER_BITS != 32 && __GNUC__
 #error "Header length must be 32 bits"
 #endif
+typedef uint32_t csp_id_ext_t;
+#endif
 
 /** Highest number to be entered in field */
 #define CSP_ID_PRIO_MAX			((1 << (CSP_ID_PRIO_SIZE)) - 1)
@@ -101,21 +123,28 @@ typedef enum {
 #define CSP_ID_PORT_MAX			((1 << (CSP_ID_PORT_SIZE)) - 1)
 #define CSP_ID_FLAGS_MAX		((1 << (CSP_ID_FLAGS_SIZE)) - 1)
 
+#if CSP_MAX_BIND_PORT >= CSP_ID_PORT_MAX - 1
+#error "CSP_MAX_BIND_PORT must leave room for CSP_ANY and ephemeral ports"
+#endif
+
 /** Identifier field masks */
-#define CSP_ID_PRIO_MASK		((uint32_t) CSP_ID_PRIO_MAX 	<< (CSP_ID_FLAGS_SIZE + 2 * CSP_ID_PORT_SIZE + 2 * CSP_ID_HOST_SIZE))
-#define CSP_ID_SRC_MASK	 		((uint32_t) CSP_ID_HOST_MAX 	<< (CSP_ID_FLAGS_SIZE + 2 * CSP_ID_PORT_SIZE + 1 * CSP_ID_HOST_SIZE))
-#define CSP_ID_DST_MASK	 		((uint32_t) CSP_ID_HOST_MAX 	<< (CSP_ID_FLAGS_SIZE + 2 * CSP_ID_PORT_SIZE))
-#define CSP_ID_DPORT_MASK   	((uint32_t) CSP_ID_PORT_MAX 	<< (CSP_ID_FLAGS_SIZE + 1 * CSP_ID_PORT_SIZE))
-#define CSP_ID_SPORT_MASK   	((uint32_t) CSP_ID_PORT_MAX 	<< (CSP_ID_FLAGS_SIZE))
-#define CSP_ID_FLAGS_MASK		((uint32_t) CSP_ID_FLAGS_MAX 	<< (0))
+#define CSP_ID_PRIO_MASK		((csp_id_ext_t) CSP_ID_PRIO_MAX 	<< (CSP_ID_FLAGS_SIZE + 2 * CSP_ID_PORT_SIZE + 2 * CSP_ID_HOST_SIZE))
+#define CSP_ID_SRC_MASK	 		((csp_id_ext_t) CSP_ID_HOST_MAX 	<< (CSP_ID_FLAGS_SIZE + 2 * CSP_ID_PORT_SIZE + 1 * CSP_ID_HOST_SIZE))
+#define CSP_ID_DST_MASK	 		((csp_id_ext_t) CSP_ID_HOST_MAX 	<< (CSP_ID_FLAGS_SIZE + 2 * CSP_ID_PORT_SIZE))
+#define CSP_ID_DPORT_MASK   	((csp_id_ext_t) CSP_ID_PORT_MAX 	<< (CSP_ID_FLAGS_SIZE + 1 * CSP_ID_PORT_SIZE))
+#define CSP_ID_SPORT_MASK   	((csp_id_ext_t) CSP_ID_PORT_MAX 	<< (CSP_ID_FLAGS_SIZE))
+#define CSP_ID_FLAGS_MASK		((csp_id_ext_t) CSP_ID_FLAGS_MAX 	<< (0))
 
 #define CSP_ID_CONN_MASK		(CSP_ID_SRC_MASK | CSP_ID_DST_MASK | CSP_ID_DPORT_MASK | CSP_ID_SPORT_MASK)
 
 /** @brief This union defines a CSP identifier and allows access to the individual fields or the entire identifier */
 typedef union {
-	uint32_t ext;
+	csp_id_ext_t ext;
 	struct __attribute__((__packed__)) {
 #if defined(CSP_BIG_ENDIAN) && !defined(CSP_LITTLE_ENDIAN)
+#ifdef CSP_EXT_HEADER
+		unsigned int reserved : 64 - CSP_HEADER_BITS;
+#endif
 		unsigned int pri : CSP_ID_PRIO_SIZE;
 		unsigned int src : CSP_ID_HOST_SIZE;
 		unsigned int dst : CSP_ID_HOST_SIZE;
@@ -129,6 +158,9 @@ typedef union {
 		unsigned int dst : CSP_ID_HOST_SIZE;
 		unsigned int src : CSP_ID_HOST_SIZE;
 		unsigned int pri : CSP_ID_PRIO_SIZE;
+#ifdef CSP_EXT_HEADER
+		unsigned int reserved : 64 - CSP_HEADER_BITS;
+#endif
 #else
 		#error "Must define one of CSP_BIG_ENDIAN or CSP_LITTLE_ENDIAN in csp_platform.h"
 #endif
@@ -144,8 +176,8 @@ typedef union {
 /** CSP Flags */
 #define CSP_FRES1			0x80 				// Reserved for future use
 #define CSP_FRES2			0x40 				// Reserved for future use
-#define CSP_FRES3			0x20 				// Reserved for future use
-#define CSP_FRES4			0x10 				// Reserved for future use
+#define CSP_FMCAST			0x20 				// Destination is a multicast group
+#define CSP_FAEAD			0x10 				// Use ChaCha20-Poly1305 authenticated encryption
 #define CSP_FHMAC 			0x08 				// Use HMAC verification
 #define CSP_FXTEA 			0x04 				// Use XTEA encryption
 #define CSP_FRDP			0x02 				// Use RDP protocol
@@ -162,6 +194,9 @@ typedef union {
 #define CSP_SO_CRC32REQ		0x0040				// Require CRC32
 #define CSP_SO_CRC32PROHIB	0x0080				// Prohibit CRC32
 #define CSP_SO_CONN_LESS	0x0100				// Enable Connection Less mode
+#define CSP_SO_AEADREQ		0x0200				// Require AEAD
+#define CSP_SO_AEADPROHIB	0x0400				// Prohibit AEAD
+#define CSP_SO_REUSEPORT	0x0800				// Share the port with other sockets
 
 /** CSP Connect options */
 #define CSP_O_NONE  		CSP_SO_NONE			// No connection options
@@ -173,6 +208,8 @@ typedef union {
 #define CSP_O_NOXTEA		CSP_SO_XTEAPROHIB	// Disable XTEA
 #define CSP_O_CRC32			CSP_SO_CRC32REQ		// Enable CRC32
 #define CSP_O_NOCRC32		CSP_SO_CRC32PROHIB	// Disable CRC32
+#define CSP_O_AEAD			CSP_SO_AEADREQ		// Enable AEAD
+#define CSP_O_NOAEAD		CSP_SO_AEADPROHIB	// Disable AEAD
 
 /**
  * CSP PACKET STRUCTURE
@@ -201,6 +238,7 @@ typedef struct csp_iface_s {
 	uint8_t promisc;			/**< Promiscuous mode enabled */
 	uint16_t mtu;				/**< Maximum Transmission Unit of interface */
 	uint8_t split_horizon_off;	/**< Disable the route-loop prevention on if */
+	uint8_t tx_shared;			/**< Nexthop does not modify packets, so it may be given shared buffers */
 	uint32_t tx;				/**< Successfully transmitted packets */
 	uint32_t rx;				/**< Successfully received packets */
 	uint32_t tx_error;			/**< Transmit errors */
@@ -210,6 +248,8 @@ typedef struct csp_iface_s {
 	uint32_t frame;				/**< Frame format errors */
 	uint32_t txbytes;			/**< Transmitted bytes */
 	uint32_t rxbytes;			/**< Received bytes */
+	uint8_t ext_header;			/**< Link carries the extended header, see csp_id_encode() */
+	void * tx_queue;			/**< Transmit queue, NULL to transmit from the sending task */
 	struct csp_iface_s * next;	/**< Next interface */
 } csp_iface_t;
 
@@ -308,6 +348,24 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout);
  */
 int csp_transaction(uint8_t prio, uint8_t dest, uint8_t port, uint32_t timeout, void * outbuf, int outlen, void * inbuf, int inlen);
 
+/**
+ * Perform an entire request/reply transaction with connection options
+ * RDP connections are kept open after a successful transaction, and reused by the
+ * next transaction with the same priority, destination, port and options. Idle
+ * connections are closed after CSP_CONN_IDLE_TIMEOUT ms.
+ * @param prio CSP Prio
+ * @param dest CSP Dest
+ * @param port CSP Port
+ * @param timeout timeout in ms
+ * @param outbuf pointer to outgoing data buffer
+ * @param outlen length of request to send
+ * @param inbuf pointer to incoming data buffer
+ * @param inlen length of expected reply, -1 for unknown size (note inbuf MUST be large enough)
+ * @param opts Connection options, as for csp_connect
+ * @return Return 1 or reply size if successful, 0 if error or incoming length does not match or -1 if timeout was reached
+ */
+int csp_transaction2(uint8_t prio, uint8_t dest, uint8_t port, uint32_t timeout, void * outbuf, int outlen, void * inbuf, int inlen, uint32_t opts);
+
 /**
  * Use an existing connection to perform a transaction,
  * This is only possible if the next packet is on the same port and destination!
@@ -357,6 +415,34 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
  */
 csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t timeout, uint32_t opts);
 
+/**
+ * Write a byte stream to an RDP connection
+ * The data is split into segments that fit the buffers and the MTU of the outgoing
+ * interface, and sent back to back, so up to a full RDP window is in flight. The
+ * data can be read from any memory, such as a memory mapped file, and is copied
+ * once into the packet buffers.
+ * @param conn pointer to RDP connection
+ * @param data pointer to data
+ * @param length number of bytes to write
+ * @param timeout timeout in ms for each segment to enter the window
+ * @return number of bytes written, which is less than length if the connection was
+ * reset, timed out or ran out of buffers, or an error code if the arguments are invalid
+ */
+int csp_stream_write(csp_conn_t * conn, const void * data, uint32_t length, uint32_t timeout);
+
+/**
+ * Read a byte stream from an RDP connection
+ * Segments are reassembled in order, and a segment that is only partially read is kept
+ * for the next call.
+ * @param conn pointer to RDP connection
+ * @param data pointer to buffer
+ * @param length number of bytes to read
+ * @param timeout timeout in ms to wait for each segment
+ * @return number of bytes read, which is less than length if the connection was reset
+ * or timed out, or an error code if the arguments are invalid
+ */
+int csp_stream_read(csp_conn_t * conn, void * data, uint32_t length, uint32_t timeout);
+
 /** csp_close
  * Closes a given connection and frees buffers used.
  * @param conn pointer to connection structure
@@ -404,6 +490,10 @@ int csp_listen(csp_socket_t * socket, size_t conn_queue_length);
 
 /**
  * Bind port to socket
+ * Sockets created with CSP_SO_REUSEPORT and the same options can be bound to
+ * the same port, for example one per worker task. New connections and
+ * connection-less packets are then handed to the sockets in turn. Such a
+ * socket can only be bound to one port. Closing a socket releases its ports.
  * @param socket Socket to bind port to
  * @param port Port number to bind
  * @return 0 on success, -1 on error.
@@ -415,9 +505,35 @@ int csp_bind(csp_socket_t * socket, uint8_t port);
  * This function maintains the routing table,
  * To set default route use nodeid CSP_DEFAULT_ROUTE
  * To clear a value pass a NULL value
+ * Routes may be changed while the router is running. Each change takes
+ * effect at once for all packets routed after it.
  */
 int csp_route_set(uint8_t node, csp_iface_t * ifc, uint8_t nexthop_mac_addr);
 
+/**
+ * Add a next hop for a range of addresses
+ * Nodes match a route if their netmask most significant address bits equal
+ * those of node, and the most specific matching route is used. A route with
+ * several next hops spreads connections over them in proportion to their
+ * weights. Adding an existing next hop updates its weight.
+ * @param node Address in the range
+ * @param netmask Number of significant address bits, CSP_ID_HOST_SIZE for a single node, 0 for all nodes
+ * @param ifc Interface of the next hop
+ * @param nexthop_mac_addr MAC layer address of the next hop, CSP_NODE_MAC to use the destination address
+ * @param weight Relative share of connections, at least 1
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL on invalid arguments, CSP_ERR_NOMEM if the table is full
+ */
+int csp_route_add(uint8_t node, uint8_t netmask, csp_iface_t * ifc, uint8_t nexthop_mac_addr, uint8_t weight);
+
+/**
+ * Remove next hops of a range of addresses
+ * @param node Address in the range
+ * @param netmask Number of significant address bits
+ * @param ifc Remove next hops through this interface, or NULL to remove the whole route
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if there is no such route
+ */
+int csp_route_remove(uint8_t node, uint8_t netmask, csp_iface_t * ifc);
+
 /**
  * Start the router task.
  * @param task_stack_size The number of portStackType to allocate. This only affects FreeRTOS systems.
@@ -425,6 +541,45 @@ int csp_route_set(uint8_t node, csp_iface_t * ifc, uint8_t nexthop_mac_addr);
  */
 int csp_route_start_task(unsigned int task_stack_size, unsigned int priority);
 
+/**
+ * Start a transmit task for an interface.
+ * Packets to the interface are then queued by priority and passed to the
+ * nexthop function by the task, so senders and the router do not wait for
+ * a slow link. Packets are dropped when the queue is full.
+ * Transit packets routed to the interface are queued directly from the
+ * receiving interface, without passing through the router task.
+ * @param ifc Interface to start the task for
+ * @param queue_length Number of packets to queue for each priority
+ * @param task_stack_size The number of portStackType to allocate. This only affects FreeRTOS systems.
+ * @param priority The OS task priority of the transmit task
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOMEM if out of memory, CSP_ERR_ALREADY if already started
+ */
+int csp_route_start_tx_task(csp_iface_t * ifc, unsigned int queue_length, unsigned int task_stack_size, unsigned int priority);
+
+/**
+ * Shape the output of an interface with a token bucket.
+ * The transmit task of the interface holds packets back, so no more than
+ * burst bytes are sent back to back, and rate bytes per second on average.
+ * Bytes are counted as packet data plus the CSP header, so leave room for
+ * any framing added by the driver. The interface must have a transmit task.
+ * @param ifc Interface to shape
+ * @param rate Bytes per second, or 0 to disable shaping
+ * @param burst Bucket size in bytes, or 0 for one packet of MTU size
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if the interface has no transmit task
+ */
+int csp_route_set_tx_rate(csp_iface_t * ifc, uint32_t rate, uint32_t burst);
+
+/**
+ * Set the scheduling weight of a priority class.
+ * With CSP_USE_QOS, CSP_PRIO_CRITICAL is always served first, and the
+ * remaining classes share the router by deficit round robin in proportion
+ * to their weights. The defaults are 4, 2 and 1 for HIGH, NORM and LOW.
+ * @param prio priority class, CSP_PRIO_HIGH to CSP_PRIO_LOW
+ * @param weight relative share, at least 1
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL on invalid arguments, CSP_ERR_NOTSUP without QoS
+ */
+int csp_qos_set_weight(uint8_t prio, uint8_t weight);
+
 /**
  * Enable promiscuous mode packet queue
  * This function is used to enable promiscuous mode for the router.
@@ -519,6 +674,10 @@ void csp_uptime(uint8_t node, uint32_t timeout);
 
 /**
  * Set RDP options
+ * The window size is limited to CSP_RDP_MAX_WINDOW, and the smaller of the two
+ * peers' windows is used. Peers without receive window advertisement are also
+ * limited to half the connection RX queue length. A full window can arrive
+ * at once, so large windows also need a router queue to match.
  * @param window_size Window size
  * @param conn_timeout_ms Connection timeout in ms
  * @param packet_timeout_ms Packet timeout in ms
@@ -559,6 +718,64 @@ int csp_xtea_set_key(char * key, uint32_t keylen);
  */
 int csp_hmac_set_key(char * key, uint32_t keylen);
 
+/**
+ * Set XTEA key used with a single peer.
+ * Packets to and from the node are encrypted with this key instead of
+ * the key set by csp_xtea_set_key. The key is expanded once, here, and may
+ * be replaced while packets are being encrypted.
+ * @param node Address of peer
+ * @param key Pointer to key array, or NULL to use the default key again
+ * @param keylen Length of key
+ * @return 0 if key was successfully set, -1 otherwise
+ */
+int csp_xtea_set_peer_key(uint8_t node, char * key, uint32_t keylen);
+
+/**
+ * Set HMAC key used with a single peer.
+ * Packets to and from the node are authenticated with this key instead of
+ * the key set by csp_hmac_set_key. The key is expanded once, here, and may
+ * be replaced while packets are being authenticated.
+ * @param node Address of peer
+ * @param key Pointer to key array, or NULL to use the default key again
+ * @param keylen Length of key
+ * @return 0 if key was successfully set, -1 otherwise
+ */
+int csp_hmac_set_peer_key(uint8_t node, char * key, uint32_t keylen);
+
+/**
+ * Set AEAD (ChaCha20-Poly1305) key
+ * AEAD packets are only sent once a nonce salt is set, see csp_aead_set_salt.
+ * @param key Pointer to key array
+ * @param keylen Length of key
+ * @return 0 if key was successfully set, -1 otherwise
+ */
+int csp_aead_set_key(char * key, uint32_t keylen);
+
+/**
+ * Set AEAD nonce salt
+ * Each packet is encrypted with a nonce of the node address, this salt and a
+ * counter that restarts when the salt is set. A nonce used twice under a key
+ * breaks the encryption, so the salt must never repeat, also across restarts:
+ * use a boot counter kept in non-volatile memory, or a value from a hardware
+ * random number generator. AEAD packets are refused until the salt is set,
+ * and again after 2^32 - 1 packets, until a new salt is set.
+ * @param salt Salt unique to this boot
+ * @return 0 if salt was successfully set, -1 otherwise
+ */
+int csp_aead_set_salt(uint32_t salt);
+
+/**
+ * Set AEAD key used with a single peer.
+ * Packets to and from the node are encrypted with this key instead of
+ * the key set by csp_aead_set_key, and may be replaced while packets are
+ * being encrypted.
+ * @param node Address of peer
+ * @param key Pointer to key array, or NULL to use the default key again
+ * @param keylen Length of key
+ * @return 0 if key was successfully set, -1 otherwise
+ */
+int csp_aead_set_peer_key(uint8_t node, char * key, uint32_t keylen);
+
 /** Debug levels */
 typedef enum {
 	CSP_INFO		= 0,
@@ -615,6 +832,11 @@ void csp_route_print_interfaces(void);
  */
 void csp_route_print_table(void);
 
+/**
+ * Print router input drops per priority class
+ */
+void csp_route_print_qos(void);
+
 /**
  * Print connection table
  */
@@ -635,6 +857,7 @@ void csp_debug_hook_set(csp_debug_hook_func_t f);
 #define csp_debug_toggle_level(...) do {} while (0)
 #define csp_route_print_interfaces(...) do {} while (0)
 #define csp_route_print_table(...) do {} while (0)
+#define csp_route_print_qos(...) do {} while (0)
 #define csp_conn_print_table(...) do {} while (0)
 #define csp_buffer_print_table(...) do {} while (0)
 #define csp_debug_hook_set(...) do {} while (0)
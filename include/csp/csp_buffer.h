@@ -56,11 +56,29 @@ void * csp_buffer_get(size_t size);
 void * csp_buffer_get_isr(size_t buf_size);
 
 /**
- * Free a buffer after use. This call is both interrupt and thread safe.
+ * Free a buffer after use. This releases one reference to the buffer, and
+ * the buffer is returned to the pool when the last reference is released.
+ * This call is both interrupt and thread safe.
  * @param packet pointer to memory area, must be acquired by csp_buffer_get().
  */
 void csp_buffer_free(void * packet);
 
+/**
+ * Take an extra reference to a buffer. The buffer is not returned to the
+ * pool until every reference has been released with csp_buffer_free().
+ * A buffer with more than one reference is shared and must not be modified.
+ * This call is both interrupt and thread safe.
+ * @param buffer pointer to memory area, must be acquired by csp_buffer_get().
+ */
+void csp_buffer_refc_inc(void * buffer);
+
+/**
+ * Return the number of references currently held to a buffer.
+ * @param buffer pointer to memory area, must be acquired by csp_buffer_get().
+ * @return reference count, 0 if the buffer is free.
+ */
+int csp_buffer_refc(void * buffer);
+
 /**
  * Clone an existing packet and increase/decrease cloned packet size.
  * @param buffer Existing buffer to clone.
@@ -73,6 +91,12 @@ void * csp_buffer_clone(void * buffer);
  */
 int csp_buffer_remaining(void);
 
+/**
+ * Return the number of data bytes that fit in one buffer element.
+ * @return data size of a buffer
+ */
+int csp_buffer_size(void);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
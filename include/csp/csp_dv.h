@@ -0,0 +1,123 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_DV_H_
+#define _CSP_DV_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <csp/csp.h>
+
+/**
+ * DISTANCE VECTOR ROUTING
+ * The routing daemon broadcasts its cost to every node it can reach on the
+ * CSP_DV port of each of its interfaces, every CSP_DV_INTERVAL ms and soon
+ * after a route changes. From the adverts of its neighbours, it sets a host
+ * route to each reachable node through the neighbour with the lowest cost.
+ * Routes with a shorter netmask, such as the default route, are left alone and
+ * still apply to nodes the daemon does not know of. A neighbour not heard
+ * from in CSP_DV_TIMEOUT ms is dropped, along with the routes through it.
+ * Host routes set with csp_route_add or csp_route_set are never replaced or
+ * removed by the daemon.
+ *
+ * Adverts are trusted: any node on an interface running the daemon can
+ * attract traffic by advertising low costs. On links that are not trusted,
+ * authenticate adverts with csp_dv_set_opts(CSP_SO_HMACREQ), with the same
+ * HMAC key on every node running the daemon.
+ *
+ * The cost of a link is 1, plus up to CSP_DV_COST_MAX - 1 more in proportion
+ * to the rate of transmit, receive and authentication errors and drops on its
+ * interface, smoothed over the last few intervals.
+ */
+
+#define CSP_DV_VERSION			1
+
+/** Cost of an unreachable node */
+#define CSP_DV_INFINITY			64
+
+/** Cost of a link on which every packet fails */
+#define CSP_DV_COST_MAX			16
+
+/** Time in ms between adverts */
+#define CSP_DV_INTERVAL			1000
+
+/** Time in ms without adverts before a neighbour is dropped */
+#define CSP_DV_TIMEOUT			3500
+
+struct csp_dv_advert {
+	uint8_t version;
+	uint8_t cost[CSP_ID_HOST_MAX + 1];	/**< Cost to each node, CSP_DV_INFINITY if unreachable */
+} __attribute__ ((packed));
+
+/**
+ * Run the routing protocol on an interface
+ * @param ifc interface to exchange adverts on
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOMEM if too many interfaces were added
+ */
+int csp_dv_add_interface(csp_iface_t * ifc);
+
+/**
+ * Start the routing daemon task
+ * @param task_stack_size The number of portStackType to allocate. This only affects FreeRTOS systems.
+ * @param priority The OS task priority of the daemon
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_dv_start(unsigned int task_stack_size, unsigned int priority);
+
+/**
+ * Set the security options of adverts
+ * With CSP_SO_HMACREQ, adverts are sent with HMAC and adverts without a valid
+ * HMAC are discarded. Without it, adverts with HMAC are still verified.
+ * @param opts 0 or CSP_SO_HMACREQ
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL for other options, CSP_ERR_NOTSUP without HMAC support
+ */
+int csp_dv_set_opts(uint32_t opts);
+
+/**
+ * Get the security options of adverts. This is called by the router.
+ * @return options set by csp_dv_set_opts
+ */
+uint32_t csp_dv_get_opts(void);
+
+/**
+ * Handle an advert received on the CSP_DV port. This is called by the router.
+ * @param ifc interface the advert was received on
+ * @param packet pointer to packet, consumed on success
+ * @return CSP_ERR_NONE if the packet was consumed, an error code if the daemon is not running
+ */
+int csp_dv_input(csp_iface_t * ifc, csp_packet_t * packet);
+
+#ifdef CSP_DEBUG
+/**
+ * Print neighbours, link costs and learnt routes
+ */
+void csp_dv_print_table(void);
+#else
+#define csp_dv_print_table(...) do {} while (0)
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_DV_H_
@@ -54,6 +54,58 @@ void csp_new_packet(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYP
  */
 uint8_t csp_route_get_nexthop_mac(uint8_t node);
 
+/**
+ * Get MAC layer address of the next hop of a packet.
+ * If there are several next hops to the destination, this is the one
+ * the packet was routed to.
+ * @param id CSP header of the packet, in host byte order
+ * @return MAC layer address
+ */
+uint8_t csp_route_get_nexthop_mac_id(csp_id_t id);
+
+/**
+ * EXTENDED HEADER
+ * With CSP_EXT_HEADER, the header holds 7-bit hosts and 8-bit ports, and is
+ * 40 bits on the wire. Interfaces with ext_header set carry it, other
+ * interfaces keep the 32-bit header, so links to nodes without extended
+ * headers continue to work. The router drops packets to an interface with the
+ * 32-bit header if their addresses do not fit in it.
+ * Without CSP_EXT_HEADER, every interface carries the 32-bit header.
+ */
+
+/** Length of the header on the wire of an interface */
+#ifdef CSP_EXT_HEADER
+#define csp_id_length(ext_header)	((ext_header) ? CSP_HEADER_LENGTH : CSP_LEGACY_HEADER_LENGTH)
+#else
+#define csp_id_length(ext_header)	CSP_LEGACY_HEADER_LENGTH
+#endif
+
+/**
+ * Check if a header can be sent on an interface
+ * @param id CSP header in host byte order
+ * @param ext_header ext_header field of the interface
+ * @return 1 if the addresses fit in the header of the interface, 0 otherwise
+ */
+int csp_id_fits(csp_id_t id, uint8_t ext_header);
+
+/**
+ * Write the header of a packet as sent on an interface, in network byte order
+ * @param id CSP header in host byte order
+ * @param buf Output buffer with room for CSP_HEADER_LENGTH bytes
+ * @param ext_header ext_header field of the interface
+ * @return Number of bytes written, CSP_ERR_INVAL if the header does not fit
+ */
+int csp_id_encode(csp_id_t id, uint8_t * buf, uint8_t ext_header);
+
+/**
+ * Read the header of a packet received on an interface, which is
+ * csp_id_length(ext_header) bytes long
+ * @param buf Header in network byte order
+ * @param ext_header ext_header field of the interface
+ * @return CSP header in host byte order
+ */
+csp_id_t csp_id_decode(const uint8_t * buf, uint8_t ext_header);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,130 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_MCAST_H_
+#define _CSP_MCAST_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <csp/csp.h>
+
+/**
+ * MULTICAST GROUPS
+ * A packet with the CSP_FMCAST flag is addressed to the group in its
+ * destination field instead of a node. The router replicates it once to each
+ * interface with group members behind it, and delivers it to each local
+ * connection-less socket that joined the group. Copies share the packet
+ * buffer by reference count, except on interfaces that modify packets on
+ * transmit, so a received multicast packet must not be modified.
+ *
+ * Multicast packets are accepted only from the interface of the route to
+ * their source, so loops in the group tree do not multiply them. They carry
+ * no security options, as a shared buffer cannot be verified in place.
+ *
+ * Each driver maps a group to a link destination: CAN sends to the
+ * broadcast address, I2C to the general call address 0, and point-to-point
+ * links such as KISS need no address. An interface driver that addresses
+ * frames by the destination node must handle CSP_FMCAST before it can
+ * carry a group. The loopback interface cannot be added to a group.
+ */
+
+/** Number of multicast groups, addressed 0 to CSP_MCAST_GROUPS - 1 */
+#define CSP_MCAST_GROUPS		32
+
+/**
+ * Deliver packets of a group to a connection-less socket, from any port
+ * @param socket socket created with CSP_SO_CONN_LESS and no required security options
+ * @param group group address
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL on invalid arguments, CSP_ERR_NOMEM if the table is full
+ */
+int csp_mcast_join(csp_socket_t * socket, uint8_t group);
+
+/**
+ * Stop delivering packets of a group to a socket
+ * @param socket socket
+ * @param group group address
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if the socket is not a member
+ */
+int csp_mcast_leave(csp_socket_t * socket, uint8_t group);
+
+/**
+ * Forward packets of a group on an interface with members behind it
+ * @param group group address
+ * @param ifc interface
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL on invalid arguments or the loopback interface, CSP_ERR_NOMEM if the table is full
+ */
+int csp_mcast_add_iface(uint8_t group, csp_iface_t * ifc);
+
+/**
+ * Stop forwarding packets of a group on an interface
+ * @param group group address
+ * @param ifc interface
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if the interface does not forward the group
+ */
+int csp_mcast_remove_iface(uint8_t group, csp_iface_t * ifc);
+
+/**
+ * Leave every group joined by a socket. This is called by csp_close.
+ * @param socket socket
+ */
+void csp_mcast_leave_all(csp_socket_t * socket);
+
+/**
+ * Send a packet to a group
+ * @param prio CSP_PRIO_x
+ * @param group group address
+ * @param dport destination port
+ * @param src_port source port
+ * @param packet pointer to packet
+ * @param timeout timeout used by interfaces with blocking send
+ * @return -1 if error (you must free packet), 0 if OK (you must discard pointer)
+ */
+int csp_mcast_sendto(uint8_t prio, uint8_t group, uint8_t dport, uint8_t src_port, csp_packet_t * packet, uint32_t timeout);
+
+/**
+ * Replicate a multicast packet to the members of its group. This is called by the router.
+ * @param packet pointer to packet, which is consumed
+ * @param ifc interface the packet was received on
+ */
+void csp_mcast_input(csp_packet_t * packet, csp_iface_t * ifc);
+
+/**
+ * Initialise the membership table. This is called by csp_init.
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_mcast_init(void);
+
+#ifdef CSP_DEBUG
+/**
+ * Print group members
+ */
+void csp_mcast_print_table(void);
+#else
+#define csp_mcast_print_table(...) do {} while (0)
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_MCAST_H_
@@ -0,0 +1,133 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 Gomspace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_TRANSFER_H_
+#define _CSP_TRANSFER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <csp/csp.h>
+
+/**
+ * OBJECT TRANSFER SERVICE
+ * An object is split into fixed size chunks, which are sent over several RDP
+ * connections to the CSP_TRANSFER port in parallel. The receiver keeps a bitmap
+ * of the chunks it has stored, so an interrupted transfer is resumed by sending
+ * the same object again. Each chunk carries a CRC32 of its data.
+ */
+
+#define CSP_TRANSFER_BEGIN		1
+#define CSP_TRANSFER_CHUNK		2
+#define CSP_TRANSFER_STATUS		3
+
+#define CSP_TRANSFER_OK			0
+#define CSP_TRANSFER_REFUSED	1
+#define CSP_TRANSFER_UNKNOWN	2
+
+/** Maximum number of parallel connections used by csp_transfer_send */
+#define CSP_TRANSFER_MAX_CONNS	8
+
+/** Maximum number of chunks in an object, which bounds the bitmap of the receiver */
+#ifndef CSP_TRANSFER_MAX_CHUNKS
+#define CSP_TRANSFER_MAX_CHUNKS	65536
+#endif
+
+struct csp_transfer_begin {
+	uint8_t type;
+	uint8_t status;				/**< Set in the reply */
+	uint16_t chunk_size;
+	uint32_t id;
+	uint32_t size;
+} __attribute__ ((packed));
+
+struct csp_transfer_chunk {
+	uint8_t type;
+	uint32_t id;
+	uint32_t index;
+	uint32_t crc;				/**< CRC32 of the chunk data */
+	uint8_t data[];
+} __attribute__ ((packed));
+
+struct csp_transfer_status {
+	uint8_t type;
+	uint8_t status;				/**< Set in the reply */
+	uint32_t id;
+	uint32_t first;				/**< First chunk in bitmap, a multiple of 8 */
+	uint16_t count;				/**< Number of chunks in bitmap, set in the reply */
+	uint8_t bitmap[];			/**< One bit per chunk, least significant bit first */
+} __attribute__ ((packed));
+
+/** Callbacks used by the receiver to store objects */
+typedef struct {
+	/** Called when a new object is offered, return 0 to accept it */
+	int (*begin)(uint32_t id, uint32_t size);
+	/** Store a chunk of an object, return 0 on success */
+	int (*write)(uint32_t id, uint32_t offset, const uint8_t * data, uint32_t length);
+	/** Called once, when every chunk of an object has been stored */
+	void (*complete)(uint32_t id, uint32_t size);
+} csp_transfer_handler_t;
+
+/**
+ * Set the storage callbacks of the receiver. Transfers are refused until this is set.
+ * To receive over several connections in parallel, serve the CSP_TRANSFER port from
+ * as many tasks as the sender uses connections.
+ * @param handler pointer to callbacks, which must remain valid
+ */
+void csp_transfer_set_handler(const csp_transfer_handler_t * handler);
+
+/**
+ * Handle a packet received on the CSP_TRANSFER port.
+ * This is called by csp_service_handler. The packet is consumed.
+ * @param conn pointer to connection
+ * @param packet pointer to packet
+ */
+void csp_transfer_handler(csp_conn_t * conn, csp_packet_t * packet);
+
+/**
+ * Send an object to a node
+ * Chunks that the receiver already has are skipped, so calling this again after
+ * an interruption resumes the transfer.
+ * @param node destination node
+ * @param id object identifier
+ * @param data pointer to object
+ * @param size object size in bytes, at most CSP_TRANSFER_MAX_CHUNKS chunks
+ * @param chunk_size chunk size in bytes, or 0 for the largest that fits a packet
+ * @param connections number of parallel RDP connections, at most CSP_TRANSFER_MAX_CONNS
+ * @param opts additional connection options, such as CSP_O_CRC32
+ * @param timeout timeout in ms for each request and chunk
+ * @return CSP_ERR_NONE when the receiver has stored every chunk, otherwise an error code
+ */
+int csp_transfer_send(uint8_t node, uint32_t id, const void * data, uint32_t size,
+		uint16_t chunk_size, int connections, uint32_t opts, uint32_t timeout);
+
+/**
+ * Initialise the receiver state. This is called by csp_init.
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_transfer_init(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_TRANSFER_H_
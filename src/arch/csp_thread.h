@@ -73,6 +73,12 @@ int csp_thread_create(csp_thread_return_t (* routine)(void *), const signed char
 int csp_thread_create(csp_thread_return_t (* routine)(void *)__attribute__((stdcall)), const signed char * const thread_name, unsigned short stack_depth, void * parameters, unsigned int priority, csp_thread_handle_t * handle);
 #endif
 
+/**
+ * Suspend the calling task
+ * @param time_ms time to sleep in ms
+ */
+void csp_sleep_ms(uint32_t time_ms);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
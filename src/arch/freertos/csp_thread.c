@@ -33,3 +33,7 @@ int csp_thread_create(csp_thread_return_t (* routine)(void *), const signed char
 	else
 		return ret;
 }
+
+void csp_sleep_ms(uint32_t time_ms) {
+	vTaskDelay(time_ms / portTICK_RATE_MS);
+}
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
 /* CSP includes */
 #include <csp/csp.h>
@@ -29,3 +30,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 int csp_thread_create(csp_thread_return_t (* routine)(void *), const signed char * const thread_name, unsigned short stack_depth, void * parameters, unsigned int priority, csp_thread_handle_t * handle) {
 	return pthread_create(handle, NULL, routine, parameters);
 }
+
+void csp_sleep_ms(uint32_t time_ms) {
+	struct timespec req;
+	req.tv_sec = time_ms / 1000;
+	req.tv_nsec = (time_ms % 1000) * 1000000;
+	nanosleep(&req, NULL);
+}
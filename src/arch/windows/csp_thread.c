@@ -9,3 +9,7 @@ int csp_thread_create(csp_thread_return_t (* routine)(void *)__attribute__((stdc
     *handle = taskHandle;
     return 0;
 }
+
+void csp_sleep_ms(uint32_t time_ms) {
+    Sleep(time_ms);
+}
@@ -0,0 +1,301 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* ChaCha20-Poly1305 authenticated encryption as specified in RFC 8439 */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_interface.h>
+
+#include "../arch/csp_malloc.h"
+#include "../arch/csp_semaphore.h"
+
+#include "csp_sha1.h"
+#include "csp_chacha20.h"
+#include "csp_poly1305.h"
+#include "csp_aead.h"
+#include "csp_key.h"
+
+#ifdef CSP_USE_AEAD
+
+#define LOAD32L(x, y) do { (x) = ((uint32_t)((y)[3] & 0xff) << 24) | \
+								 ((uint32_t)((y)[2] & 0xff) << 16) | \
+								 ((uint32_t)((y)[1] & 0xff) << 8)  | \
+								 ((uint32_t)((y)[0] & 0xff) << 0); } while (0)
+
+#define STORE32L(x, y) do { (y)[3] = (uint8_t)(((x) >> 24) & 0xff); \
+							(y)[2] = (uint8_t)(((x) >> 16) & 0xff); \
+							(y)[1] = (uint8_t)(((x) >> 8) & 0xff); \
+							(y)[0] = (uint8_t)(((x) >> 0) & 0xff); } while (0)
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+/* ChaCha20 key as little endian words */
+typedef struct {
+	uint32_t key[8];
+} aead_key_state;
+
+/* Default and per peer AEAD keys, the zero key until a key is set */
+static csp_key_table_t csp_aead_keys;
+static const aead_key_state csp_aead_zero_key;
+
+/* Nonce of the last packet sent. A nonce must never repeat under a key, so
+ * packets carry a counter after a salt set by the application once per boot.
+ * Nothing is encrypted before the salt is set, or after the counter has used
+ * up the salt. Every node includes its own address in the nonce, so peers
+ * sharing a key never collide. */
+static uint32_t csp_aead_salt;
+static uint32_t csp_aead_counter;
+static int csp_aead_salt_valid = 0;
+static csp_mutex_t csp_aead_lock;
+
+/* Pin the key of a peer, release it with csp_key_put */
+static const aead_key_state * csp_aead_key_get(uint8_t node, int * slot) {
+
+	return csp_key_get(&csp_aead_keys, node, &csp_aead_zero_key, slot);
+
+}
+
+static int csp_aead_key_set(int slot, char * key, uint32_t keylen) {
+
+	aead_key_state * expanded;
+	uint8_t hash[2 * SHA1_DIGESTSIZE];
+	csp_sha1_state md;
+	uint8_t i;
+	int j;
+
+	if (key == NULL) {
+		csp_key_set(&csp_aead_keys, slot, NULL);
+		return 0;
+	}
+
+	expanded = csp_malloc(sizeof(*expanded));
+	if (expanded == NULL)
+		return -1;
+
+	/* Use SHA1 as KDF, with a block counter for the 32 byte key */
+	for (i = 0; i < 2; i++) {
+		csp_sha1_init(&md);
+		csp_sha1_process(&md, (uint8_t *)key, keylen);
+		csp_sha1_process(&md, &i, sizeof(i));
+		csp_sha1_done(&md, &hash[i * SHA1_DIGESTSIZE]);
+	}
+
+	for (j = 0; j < 8; j++)
+		LOAD32L(expanded->key[j], &hash[4 * j]);
+
+	csp_key_set(&csp_aead_keys, slot, expanded);
+
+	return 0;
+
+}
+
+int csp_aead_init(void) {
+
+	if (csp_mutex_create(&csp_aead_lock) != CSP_MUTEX_OK)
+		return CSP_ERR_NOMEM;
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_aead_set_key(char * key, uint32_t keylen) {
+
+	return csp_aead_key_set(CSP_KEY_DEFAULT, key, keylen);
+
+}
+
+int csp_aead_set_salt(uint32_t salt) {
+
+	if (csp_mutex_lock(&csp_aead_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return -1;
+
+	csp_aead_salt = salt;
+	csp_aead_counter = 0;
+	csp_aead_salt_valid = 1;
+
+	csp_mutex_unlock(&csp_aead_lock);
+
+	return 0;
+
+}
+
+int csp_aead_set_peer_key(uint8_t node, char * key, uint32_t keylen) {
+
+	if (node > CSP_ID_HOST_MAX)
+		return -1;
+
+	return csp_aead_key_set(node, key, keylen);
+
+}
+
+/* Set up the nonce and Poly1305 key, and authenticate the header.
+ * Returns the length of the authenticated header */
+static uint32_t csp_aead_start(csp_poly1305_state * mac, uint32_t nonce[3], const uint32_t key[8], csp_id_t id, const uint8_t * wire) {
+
+	uint8_t block[CSP_CHACHA20_BLOCKSIZE];
+
+	/* The 32-bit header when the addresses fit, so both header modes agree */
+	uint8_t header[CSP_HEADER_LENGTH];
+	int headerlen = csp_id_encode(id, header, !csp_id_fits(id, 0));
+
+	/* Nonce is the sending node followed by the salt and counter from the wire */
+	nonce[0] = id.src;
+	LOAD32L(nonce[1], &wire[0]);
+	LOAD32L(nonce[2], &wire[4]);
+
+	/* One time Poly1305 key from block 0 */
+	csp_chacha20_block(block, key, 0, nonce);
+	csp_poly1305_init(mac, block);
+	memset(block, 0, sizeof(block));
+
+	/* Associated data */
+	csp_poly1305_update(mac, header, headerlen);
+	csp_poly1305_pad(mac);
+
+	return headerlen;
+
+}
+
+/* Authenticate the lengths and compute the tag */
+static void csp_aead_finish(csp_poly1305_state * mac, uint32_t headerlen, uint32_t length, uint8_t * tag) {
+
+	uint8_t lengths[16] = {0};
+
+	csp_poly1305_pad(mac);
+	STORE32L(headerlen, &lengths[0]);
+	STORE32L(length, &lengths[8]);
+	csp_poly1305_update(mac, lengths, sizeof(lengths));
+	csp_poly1305_finish(mac, tag);
+
+}
+
+/* XOR one chunk with key stream block counter */
+static void csp_aead_crypt_chunk(uint8_t * data, uint32_t length, const uint32_t key[8], uint32_t counter, const uint32_t nonce[3]) {
+
+	uint8_t stream[CSP_CHACHA20_BLOCKSIZE];
+	uint32_t d, s, i = 0;
+
+	csp_chacha20_block(stream, key, counter, nonce);
+
+	for (; i + sizeof(d) <= length; i += sizeof(d)) {
+		memcpy(&d, &data[i], sizeof(d));
+		memcpy(&s, &stream[i], sizeof(s));
+		d ^= s;
+		memcpy(&data[i], &d, sizeof(d));
+	}
+	for (; i < length; i++)
+		data[i] ^= stream[i];
+
+}
+
+int csp_aead_encrypt(csp_packet_t * packet, csp_id_t id) {
+
+	csp_poly1305_state mac;
+	uint32_t nonce[3], offset, chunk, salt, counter, headerlen;
+	uint8_t wire[CSP_AEAD_NONCE_LENGTH];
+	const aead_key_state * key;
+	int slot;
+
+	if (packet->length + CSP_AEAD_OVERHEAD > (uint32_t) csp_buffer_size())
+		return -1;
+
+	/* Take the next nonce */
+	if (csp_mutex_lock(&csp_aead_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return -1;
+	if (!csp_aead_salt_valid || ++csp_aead_counter == 0) {
+		csp_aead_salt_valid = 0;
+		csp_mutex_unlock(&csp_aead_lock);
+		csp_debug(CSP_WARN, "No AEAD nonce salt, call csp_aead_set_salt\r\n");
+		return -1;
+	}
+	salt = csp_aead_salt;
+	counter = csp_aead_counter;
+	csp_mutex_unlock(&csp_aead_lock);
+
+	STORE32L(salt, &wire[0]);
+	STORE32L(counter, &wire[4]);
+
+	key = csp_aead_key_get(id.dst, &slot);
+	headerlen = csp_aead_start(&mac, nonce, key->key, id, wire);
+
+	/* Encrypt each chunk and authenticate the cipher text, in one pass */
+	for (offset = 0; offset < packet->length; offset += chunk) {
+		chunk = MIN(CSP_CHACHA20_BLOCKSIZE, packet->length - offset);
+		csp_aead_crypt_chunk(&packet->data[offset], chunk, key->key, 1 + offset / CSP_CHACHA20_BLOCKSIZE, nonce);
+		csp_poly1305_update(&mac, &packet->data[offset], chunk);
+	}
+
+	/* Append tag and nonce */
+	csp_aead_finish(&mac, headerlen, packet->length, &packet->data[packet->length]);
+	csp_key_put(&csp_aead_keys, slot);
+	packet->length += CSP_AEAD_TAG_LENGTH;
+	memcpy(&packet->data[packet->length], wire, CSP_AEAD_NONCE_LENGTH);
+	packet->length += CSP_AEAD_NONCE_LENGTH;
+
+	return 0;
+
+}
+
+int csp_aead_decrypt(csp_packet_t * packet, csp_id_t id) {
+
+	csp_poly1305_state mac;
+	uint32_t nonce[3], offset, chunk, length, headerlen;
+	uint8_t tag[CSP_AEAD_TAG_LENGTH];
+	uint8_t diff = 0;
+	unsigned int i;
+	const aead_key_state * key;
+	int slot;
+
+	if (packet->length < CSP_AEAD_OVERHEAD)
+		return -1;
+
+	length = packet->length - CSP_AEAD_OVERHEAD;
+	key = csp_aead_key_get(id.src, &slot);
+	headerlen = csp_aead_start(&mac, nonce, key->key, id, &packet->data[length + CSP_AEAD_TAG_LENGTH]);
+
+	/* Authenticate each chunk of cipher text and decrypt it, in one pass.
+	 * The data is garbage if verification fails, so the packet must be dropped. */
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = MIN(CSP_CHACHA20_BLOCKSIZE, length - offset);
+		csp_poly1305_update(&mac, &packet->data[offset], chunk);
+		csp_aead_crypt_chunk(&packet->data[offset], chunk, key->key, 1 + offset / CSP_CHACHA20_BLOCKSIZE, nonce);
+	}
+	csp_aead_finish(&mac, headerlen, length, tag);
+	csp_key_put(&csp_aead_keys, slot);
+
+	/* Compare in constant time */
+	for (i = 0; i < CSP_AEAD_TAG_LENGTH; i++)
+		diff |= tag[i] ^ packet->data[length + i];
+	if (diff != 0)
+		return -1;
+
+	packet->length = length;
+
+	return 0;
+
+}
+
+#endif // CSP_USE_AEAD
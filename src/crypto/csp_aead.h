@@ -0,0 +1,63 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_AEAD_H_
+#define _CSP_AEAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Bytes of nonce and tag appended to each packet */
+#define CSP_AEAD_NONCE_LENGTH	8
+#define CSP_AEAD_TAG_LENGTH		16
+#define CSP_AEAD_OVERHEAD		(CSP_AEAD_NONCE_LENGTH + CSP_AEAD_TAG_LENGTH)
+
+/**
+ * Initialise the AEAD nonce generator
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOMEM on failure
+ */
+int csp_aead_init(void);
+
+/**
+ * Encrypt packet with ChaCha20-Poly1305, and append the tag and nonce.
+ * The CSP header is authenticated along with the data.
+ * @param packet Pointer to packet
+ * @param id Header the packet is sent with. The key is selected by the destination.
+ * @return 0 on success, -1 on failure
+ */
+int csp_aead_encrypt(csp_packet_t * packet, csp_id_t id);
+
+/**
+ * Verify and decrypt packet encrypted with csp_aead_encrypt, and strip the
+ * tag and nonce. The data is not usable if verification fails.
+ * @param packet Pointer to packet
+ * @param id Header the packet was received with. The key is selected by the source.
+ * @return 0 on success, -1 if verification failed
+ */
+int csp_aead_decrypt(csp_packet_t * packet, csp_id_t id);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_AEAD_H_
@@ -0,0 +1,84 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* ChaCha20 stream cipher as specified in RFC 8439 */
+
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+
+#include "csp_chacha20.h"
+
+#ifdef CSP_USE_AEAD
+
+/* Rotate left macro */
+#define ROL(x,y)	(((x) << (y)) | ((x) >> (32-y)))
+
+#define STORE32L(x, y) do { (y)[3] = (uint8_t)(((x) >> 24) & 0xff); \
+							(y)[2] = (uint8_t)(((x) >> 16) & 0xff); \
+							(y)[1] = (uint8_t)(((x) >> 8) & 0xff); \
+							(y)[0] = (uint8_t)(((x) >> 0) & 0xff); } while (0)
+
+/* Quarter round */
+#define QR(a, b, c, d) do { \
+	a += b; d ^= a; d = ROL(d, 16); \
+	c += d; b ^= c; b = ROL(b, 12); \
+	a += b; d ^= a; d = ROL(d, 8); \
+	c += d; b ^= c; b = ROL(b, 7); } while (0)
+
+void csp_chacha20_block(uint8_t * stream, const uint32_t key[8], uint32_t counter, const uint32_t nonce[3]) {
+
+	uint32_t input[16], x[16];
+	int i;
+
+	/* "expand 32-byte k" */
+	input[0] = 0x61707865;
+	input[1] = 0x3320646e;
+	input[2] = 0x79622d32;
+	input[3] = 0x6b206574;
+	for (i = 0; i < 8; i++)
+		input[4 + i] = key[i];
+	input[12] = counter;
+	input[13] = nonce[0];
+	input[14] = nonce[1];
+	input[15] = nonce[2];
+
+	for (i = 0; i < 16; i++)
+		x[i] = input[i];
+
+	/* 20 rounds, as column and diagonal round pairs */
+	for (i = 0; i < 10; i++) {
+		QR(x[0], x[4], x[8],  x[12]);
+		QR(x[1], x[5], x[9],  x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8],  x[13]);
+		QR(x[3], x[4], x[9],  x[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		STORE32L(x[i] + input[i], &stream[4 * i]);
+
+}
+
+#endif // CSP_USE_AEAD
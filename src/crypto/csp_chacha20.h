@@ -0,0 +1,48 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_CHACHA20_H_
+#define _CSP_CHACHA20_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* ChaCha20 key, nonce and block size in bytes */
+#define CSP_CHACHA20_KEY_LENGTH		32
+#define CSP_CHACHA20_NONCE_LENGTH	12
+#define CSP_CHACHA20_BLOCKSIZE		64
+
+/**
+ * Generate one block of ChaCha20 (RFC 8439) key stream
+ * @param stream [out] Key stream, CSP_CHACHA20_BLOCKSIZE bytes
+ * @param key Key as little endian words
+ * @param counter Block counter
+ * @param nonce Nonce as little endian words
+ */
+void csp_chacha20_block(uint8_t * stream, const uint32_t key[8], uint32_t counter, const uint32_t nonce[3]);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_CHACHA20_H_
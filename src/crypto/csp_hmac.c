@@ -26,22 +26,36 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 /* CSP includes */
 #include <csp/csp.h>
 
+#include "../arch/csp_malloc.h"
+
 #include "csp_hmac.h"
+#include "csp_key.h"
 #include "csp_sha1.h"
 
 #ifdef CSP_USE_HMAC
 
 #define HMAC_KEY_LENGTH	16
 
-/* HMAC key */
-static uint8_t csp_hmac_key[HMAC_KEY_LENGTH];
-
 /* HMAC state structure */
 typedef struct {
 	csp_sha1_state	md;
 	uint8_t		key[SHA1_BLOCKSIZE];
 } hmac_state;
 
+/* Expanded HMAC key: the hash states after the inner and outer key pad blocks,
+ * so each packet only hashes its data and the inner digest */
+typedef struct {
+	csp_sha1_state inner;
+	csp_sha1_state outer;
+} hmac_key_state;
+
+/* Default and per peer HMAC keys */
+static csp_key_table_t csp_hmac_keys;
+
+/* Key expanded from the zero key, used until a key is set */
+static hmac_key_state csp_hmac_zero_key;
+static uint8_t csp_hmac_zero_key_once;
+
 int csp_hmac_init(hmac_state * hmac, const uint8_t * key, uint32_t keylen) {
 	uint32_t i;
 	uint8_t buf[SHA1_BLOCKSIZE];
@@ -135,29 +149,140 @@ int csp_hmac_memory(const uint8_t * key, uint32_t keylen, const uint8_t * data,
 	return 0;
 }
 
-int csp_hmac_set_key(char * key, uint32_t keylen) {
+static int csp_hmac_key_expand(hmac_key_state * expanded, const uint8_t * key, uint32_t keylen) {
 
-	/* Use SHA1 as KDF */
-	uint8_t hash[SHA1_DIGESTSIZE];
-	csp_sha1_memory((uint8_t *)key, keylen, hash);
+	uint32_t i;
+	uint8_t buf[SHA1_BLOCKSIZE];
+	hmac_state hmac;
 
-	/* Copy key */
-	memcpy(csp_hmac_key, hash, HMAC_KEY_LENGTH);
+	/* Inner state */
+	if (csp_hmac_init(&hmac, key, keylen) != 0)
+		return -1;
+	expanded->inner = hmac.md;
+
+	/* Outer state */
+	for (i = 0; i < SHA1_BLOCKSIZE; i++)
+		buf[i] = hmac.key[i] ^ 0x5C;
+	csp_sha1_init(&expanded->outer);
+	csp_sha1_process(&expanded->outer, buf, SHA1_BLOCKSIZE);
 
 	return 0;
 
 }
 
-int csp_hmac_append(csp_packet_t * packet) {
+static void csp_hmac_key_memory(const hmac_key_state * expanded, const uint8_t * data, uint32_t datalen, uint8_t * hmac) {
+
+	csp_sha1_state md;
+	uint8_t isha[SHA1_DIGESTSIZE];
+
+	/* Inner hash of the data */
+	md = expanded->inner;
+	csp_sha1_process(&md, data, datalen);
+	csp_sha1_done(&md, isha);
+
+	/* Outer hash of the inner digest */
+	md = expanded->outer;
+	csp_sha1_process(&md, isha, SHA1_DIGESTSIZE);
+	csp_sha1_done(&md, hmac);
+
+}
+
+static void csp_hmac_zero_key_init(void) {
+
+	uint8_t zero[HMAC_KEY_LENGTH] = {0};
+	csp_hmac_key_expand(&csp_hmac_zero_key, zero, HMAC_KEY_LENGTH);
+
+}
+
+/* Pin the key of a peer, release it with csp_key_put */
+static const hmac_key_state * csp_hmac_key_get(uint8_t node, int * slot) {
+
+	csp_key_once(&csp_hmac_zero_key_once, csp_hmac_zero_key_init);
+
+	return csp_key_get(&csp_hmac_keys, node, &csp_hmac_zero_key, slot);
+
+}
+
+static int csp_hmac_key_set(int slot, char * key, uint32_t keylen) {
+
+	hmac_key_state * expanded = NULL;
+
+	if (key != NULL) {
+		expanded = csp_malloc(sizeof(*expanded));
+		if (expanded == NULL)
+			return -1;
+
+		/* Use SHA1 as KDF */
+		uint8_t hash[SHA1_DIGESTSIZE];
+		csp_sha1_memory((uint8_t *)key, keylen, hash);
+
+		/* Expand key */
+		if (csp_hmac_key_expand(expanded, hash, HMAC_KEY_LENGTH) != 0) {
+			csp_free(expanded);
+			return -1;
+		}
+	}
+
+	csp_key_set(&csp_hmac_keys, slot, expanded);
+
+	return 0;
+
+}
+
+int csp_hmac_set_key(char * key, uint32_t keylen) {
+
+	return csp_hmac_key_set(CSP_KEY_DEFAULT, key, keylen);
+
+}
+
+int csp_hmac_set_peer_key(uint8_t node, char * key, uint32_t keylen) {
+
+	if (node > CSP_ID_HOST_MAX)
+		return -1;
+
+	return csp_hmac_key_set(node, key, keylen);
+
+}
+
+void csp_hmac_start(csp_sha1_state * md, uint8_t node) {
+
+	int slot;
+	*md = csp_hmac_key_get(node, &slot)->inner;
+	csp_key_put(&csp_hmac_keys, slot);
+
+}
+
+void csp_hmac_finish(csp_sha1_state * md, uint8_t node, uint8_t * hmac) {
+
+	uint8_t digest[SHA1_DIGESTSIZE];
+
+	/* Inner hash of the data */
+	csp_sha1_done(md, digest);
+
+	/* Outer hash of the inner digest */
+	int slot;
+	*md = csp_hmac_key_get(node, &slot)->outer;
+	csp_key_put(&csp_hmac_keys, slot);
+	csp_sha1_process(md, digest, SHA1_DIGESTSIZE);
+	csp_sha1_done(md, digest);
+
+	/* Truncate */
+	memcpy(hmac, digest, CSP_HMAC_LENGTH);
+
+}
+
+int csp_hmac_append(csp_packet_t * packet, uint8_t node) {
 
 	/* NULL pointer check */
 	if (packet == NULL)
 		return -1;
 
 	uint8_t hmac[SHA1_DIGESTSIZE];
+	int slot;
 
 	/* Calculate HMAC */
-	csp_hmac_memory(csp_hmac_key, HMAC_KEY_LENGTH, packet->data, packet->length, hmac);
+	csp_hmac_key_memory(csp_hmac_key_get(node, &slot), packet->data, packet->length, hmac);
+	csp_key_put(&csp_hmac_keys, slot);
 
 	/* Truncate hash and copy to packet */
 	memcpy(&packet->data[packet->length], hmac, CSP_HMAC_LENGTH);
@@ -167,16 +292,18 @@ int csp_hmac_append(csp_packet_t * packet) {
 
 }
 
-int csp_hmac_verify(csp_packet_t * packet) {
+int csp_hmac_verify(csp_packet_t * packet, uint8_t node) {
 
 	/* NULL pointer check */
 	if (packet == NULL)
 		return -1;
 
 	uint8_t hmac[SHA1_DIGESTSIZE];
+	int slot;
 
 	/* Calculate HMAC */
-	csp_hmac_memory(csp_hmac_key, HMAC_KEY_LENGTH, packet->data, packet->length - CSP_HMAC_LENGTH, hmac);
+	csp_hmac_key_memory(csp_hmac_key_get(node, &slot), packet->data, packet->length - CSP_HMAC_LENGTH, hmac);
+	csp_key_put(&csp_hmac_keys, slot);
 
 	/* Compare calculated HMAC with packet header */
 	if (memcmp(&packet->data[packet->length] - CSP_HMAC_LENGTH, hmac, CSP_HMAC_LENGTH) != 0) {
@@ -190,4 +317,109 @@ int csp_hmac_verify(csp_packet_t * packet) {
 
 }
 
+/* Store a 32-bit word big endian */
+static void csp_hmac_store32(uint32_t x, uint8_t * out) {
+	out[0] = x >> 24;
+	out[1] = x >> 16;
+	out[2] = x >> 8;
+	out[3] = x;
+}
+
+/* Copy the final partial block of a message to tail and pad it, as csp_sha1_done
+ * would for a message of total bytes. Returns the number of tail blocks (1 or 2). */
+static unsigned int csp_hmac_pad(uint8_t * tail, const uint8_t * data, uint32_t len, uint64_t total) {
+
+	unsigned int blocks = (len + 9 > SHA1_BLOCKSIZE) ? 2 : 1;
+
+	memcpy(tail, data, len);
+	tail[len] = 0x80;
+	memset(tail + len + 1, 0, blocks * SHA1_BLOCKSIZE - len - 1);
+	csp_hmac_store32(total >> 29, tail + blocks * SHA1_BLOCKSIZE - 8);
+	csp_hmac_store32(total << 3, tail + blocks * SHA1_BLOCKSIZE - 4);
+
+	return blocks;
+
+}
+
+void csp_hmac_verify_batch(csp_packet_t * packets[], int results[], unsigned int count) {
+
+	static const uint8_t idle[SHA1_BLOCKSIZE];
+	const hmac_key_state * key[CSP_SHA1_LANES];
+	int slot[CSP_SHA1_LANES];
+	uint32_t state[CSP_SHA1_LANES][5], digest[CSP_SHA1_LANES][5];
+	uint8_t tail[CSP_SHA1_LANES][2 * SHA1_BLOCKSIZE];
+	const uint8_t * blocks[CSP_SHA1_LANES];
+	unsigned int full[CSP_SHA1_LANES], total[CSP_SHA1_LANES];
+	unsigned int first, lanes, steps, step, l, i;
+	uint8_t hmac[4];
+
+	for (first = 0; first < count; first += lanes) {
+
+		lanes = count - first;
+		if (lanes > CSP_SHA1_LANES)
+			lanes = CSP_SHA1_LANES;
+
+		/* Inner hash: the key pad block is already in the state, so each lane
+		 * hashes its full data blocks, then the padded tail */
+		steps = 0;
+		for (l = 0; l < CSP_SHA1_LANES; l++) {
+			key[l] = csp_hmac_key_get(l < lanes ? packets[first + l]->id.src : 0, &slot[l]);
+			memcpy(state[l], key[l]->inner.state, sizeof(state[l]));
+			full[l] = total[l] = 0;
+			/* Idle and short lanes have no inner digest, but still go through the outer hash */
+			memset(digest[l], 0, sizeof(digest[l]));
+			if (l >= lanes || packets[first + l]->length < CSP_HMAC_LENGTH)
+				continue;
+			csp_packet_t * packet = packets[first + l];
+			uint32_t len = packet->length - CSP_HMAC_LENGTH;
+			full[l] = len / SHA1_BLOCKSIZE;
+			total[l] = full[l] + csp_hmac_pad(tail[l], packet->data + full[l] * SHA1_BLOCKSIZE,
+					len % SHA1_BLOCKSIZE, SHA1_BLOCKSIZE + len);
+			if (total[l] > steps)
+				steps = total[l];
+		}
+
+		for (step = 0; step < steps; step++) {
+			for (l = 0; l < CSP_SHA1_LANES; l++) {
+				if (step < full[l])
+					blocks[l] = packets[first + l]->data + step * SHA1_BLOCKSIZE;
+				else if (step < total[l])
+					blocks[l] = tail[l] + (step - full[l]) * SHA1_BLOCKSIZE;
+				else
+					blocks[l] = idle;
+			}
+			csp_sha1_compress_lanes(state, blocks);
+			for (l = 0; l < CSP_SHA1_LANES; l++)
+				if (step + 1 == total[l])
+					memcpy(digest[l], state[l], sizeof(digest[l]));
+		}
+
+		/* Outer hash of the inner digests, one block per lane */
+		for (l = 0; l < CSP_SHA1_LANES; l++) {
+			uint8_t isha[SHA1_DIGESTSIZE];
+			for (i = 0; i < 5; i++)
+				csp_hmac_store32(digest[l][i], isha + 4 * i);
+			csp_hmac_pad(tail[l], isha, SHA1_DIGESTSIZE, SHA1_BLOCKSIZE + SHA1_DIGESTSIZE);
+			memcpy(state[l], key[l]->outer.state, sizeof(state[l]));
+			csp_key_put(&csp_hmac_keys, slot[l]);
+			blocks[l] = tail[l];
+		}
+		csp_sha1_compress_lanes(state, blocks);
+
+		/* Compare truncated HMAC and strip it */
+		for (l = 0; l < lanes; l++) {
+			csp_packet_t * packet = packets[first + l];
+			csp_hmac_store32(state[l][0], hmac);
+			if (total[l] == 0 || memcmp(&packet->data[packet->length] - CSP_HMAC_LENGTH, hmac, CSP_HMAC_LENGTH) != 0) {
+				results[first + l] = -1;
+			} else {
+				packet->length -= CSP_HMAC_LENGTH;
+				results[first + l] = 0;
+			}
+		}
+
+	}
+
+}
+
 #endif // CSP_USE_HMAC
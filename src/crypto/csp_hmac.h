@@ -27,21 +27,51 @@ extern "C" {
 
 #include <stdint.h>
 
+#include "csp_sha1.h"
+
 #define CSP_HMAC_LENGTH	4
 
 /**
  * Append HMAC to packet
  * @param packet Pointer to packet
+ * @param node Destination node, selects the key
  * @return 0 on success, -1 on failure
  */
-int csp_hmac_append(csp_packet_t * packet);
+int csp_hmac_append(csp_packet_t * packet, uint8_t node);
 
 /**
  * Verify HMAC of packet
  * @param packet Pointer to packet
+ * @param node Source node, selects the key
  * @return 0 on correct HMAC, -1 if verification failed
  */
-int csp_hmac_verify(csp_packet_t * packet);
+int csp_hmac_verify(csp_packet_t * packet, uint8_t node);
+
+/**
+ * Start HMAC of data. The data is then passed to csp_sha1_process.
+ * @param md Hash state to initialise
+ * @param node Peer node, selects the key
+ */
+void csp_hmac_start(csp_sha1_state * md, uint8_t node);
+
+/**
+ * Finish HMAC started with csp_hmac_start
+ * @param md Hash state
+ * @param node Peer node, selects the key
+ * @param hmac [out] Truncated HMAC, CSP_HMAC_LENGTH bytes
+ */
+void csp_hmac_finish(csp_sha1_state * md, uint8_t node, uint8_t * hmac);
+
+/**
+ * Verify HMAC of a batch of packets.
+ * Independent packets are hashed together in interleaved lanes, which is
+ * cheaper than calling csp_hmac_verify for each of them. The key of each
+ * packet is selected by its source node.
+ * @param packets Array of packets. The HMAC is stripped from verified packets.
+ * @param results Array of results, 0 on correct HMAC, -1 if verification failed
+ * @param count Number of packets
+ */
+void csp_hmac_verify_batch(csp_packet_t * packets[], int results[], unsigned int count);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,101 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+
+#include "../arch/csp_malloc.h"
+#include "../arch/csp_thread.h"
+
+#include "csp_key.h"
+
+#define CSP_KEY_ONCE_RUNNING	1
+#define CSP_KEY_ONCE_DONE		2
+
+const void * csp_key_get(csp_key_table_t * table, uint8_t node, const void * zero, int * slot) {
+
+	const void * key;
+	int i = node & CSP_ID_HOST_MAX;
+
+	/* Pin the slot before loading the key, so a key loaded here is not
+	 * freed by csp_key_set until the slot is released */
+	__atomic_add_fetch(&table->readers[i], 1, __ATOMIC_SEQ_CST);
+	key = __atomic_load_n(&table->key[i], __ATOMIC_SEQ_CST);
+	if (key != NULL) {
+		*slot = i;
+		return key;
+	}
+	__atomic_sub_fetch(&table->readers[i], 1, __ATOMIC_SEQ_CST);
+
+	i = CSP_KEY_DEFAULT;
+	__atomic_add_fetch(&table->readers[i], 1, __ATOMIC_SEQ_CST);
+	key = __atomic_load_n(&table->key[i], __ATOMIC_SEQ_CST);
+	if (key != NULL) {
+		*slot = i;
+		return key;
+	}
+	__atomic_sub_fetch(&table->readers[i], 1, __ATOMIC_SEQ_CST);
+
+	*slot = -1;
+	return zero;
+
+}
+
+void csp_key_put(csp_key_table_t * table, int slot) {
+
+	if (slot >= 0)
+		__atomic_sub_fetch(&table->readers[slot], 1, __ATOMIC_SEQ_CST);
+
+}
+
+void csp_key_set(csp_key_table_t * table, int slot, void * key) {
+
+	void * old = __atomic_exchange_n(&table->key[slot], key, __ATOMIC_SEQ_CST);
+	if (old == NULL)
+		return;
+
+	/* Wait for packets still processed with the replaced key */
+	while (__atomic_load_n(&table->readers[slot], __ATOMIC_SEQ_CST) > 0)
+		csp_sleep_ms(1);
+
+	csp_free(old);
+
+}
+
+void csp_key_once(uint8_t * state, void (*init)(void)) {
+
+	uint8_t expected = 0;
+
+	if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == CSP_KEY_ONCE_DONE)
+		return;
+
+	if (__atomic_compare_exchange_n(state, &expected, CSP_KEY_ONCE_RUNNING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		init();
+		__atomic_store_n(state, CSP_KEY_ONCE_DONE, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* Another task is running it */
+	while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != CSP_KEY_ONCE_DONE)
+		csp_sleep_ms(1);
+
+}
@@ -0,0 +1,85 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_KEY_H_
+#define _CSP_KEY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+/* Slot of the key used with peers that have no key of their own */
+#define CSP_KEY_DEFAULT		(CSP_ID_HOST_MAX + 1)
+
+/**
+ * Expanded keys of one security option, indexed by peer address, with the
+ * default key last. A key is never modified once published: a new key is
+ * expanded into a fresh heap entry and replaces the old one in one store.
+ * The readers of each slot are counted, so the replaced entry is freed once
+ * the last packet processed with it is done.
+ */
+typedef struct {
+	void * key[CSP_KEY_DEFAULT + 1];
+	uint32_t readers[CSP_KEY_DEFAULT + 1];
+} csp_key_table_t;
+
+/**
+ * Pin the key of a peer for reading. Falls back to the default key, and to
+ * the zero key if no default key is set.
+ * @param table key table
+ * @param node peer address
+ * @param zero key to use when no key is set
+ * @param slot returns the pinned slot, to pass to csp_key_put
+ * @return key, which stays valid until csp_key_put
+ */
+const void * csp_key_get(csp_key_table_t * table, uint8_t node, const void * zero, int * slot);
+
+/**
+ * Release a key pinned by csp_key_get
+ * @param table key table
+ * @param slot slot returned by csp_key_get
+ */
+void csp_key_put(csp_key_table_t * table, int slot);
+
+/**
+ * Publish a key, and free the key it replaces once it has no readers.
+ * Must not be called while holding a key of the same table.
+ * @param table key table
+ * @param slot peer address or CSP_KEY_DEFAULT
+ * @param key expanded key allocated with csp_malloc, or NULL to remove the key
+ */
+void csp_key_set(csp_key_table_t * table, int slot, void * key);
+
+/**
+ * Run an initialisation function exactly once, also when called concurrently
+ * @param state zero initialised state of the function
+ * @param init function to run
+ */
+void csp_key_once(uint8_t * state, void (*init)(void));
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CSP_KEY_H_ */
@@ -0,0 +1,225 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Poly1305 one time authenticator as specified in RFC 8439, using 26 bit limbs
+ * as in the public domain poly1305-donna */
+
+#include <stdint.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+
+#include "csp_poly1305.h"
+
+#ifdef CSP_USE_AEAD
+
+#define LOAD32L(x, y) do { (x) = ((uint32_t)((y)[3] & 0xff) << 24) | \
+								 ((uint32_t)((y)[2] & 0xff) << 16) | \
+								 ((uint32_t)((y)[1] & 0xff) << 8)  | \
+								 ((uint32_t)((y)[0] & 0xff) << 0); } while (0)
+
+#define STORE32L(x, y) do { (y)[3] = (uint8_t)(((x) >> 24) & 0xff); \
+							(y)[2] = (uint8_t)(((x) >> 16) & 0xff); \
+							(y)[1] = (uint8_t)(((x) >> 8) & 0xff); \
+							(y)[0] = (uint8_t)(((x) >> 0) & 0xff); } while (0)
+
+static void csp_poly1305_blocks(csp_poly1305_state * st, const uint8_t * in, uint32_t inlen, uint32_t hibit) {
+
+	uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+	uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+	uint32_t t, c;
+	uint64_t d0, d1, d2, d3, d4;
+
+	while (inlen >= 16) {
+		/* h += m[i] */
+		LOAD32L(t, &in[0]);  h0 += t & 0x3ffffff;
+		LOAD32L(t, &in[3]);  h1 += (t >> 2) & 0x3ffffff;
+		LOAD32L(t, &in[6]);  h2 += (t >> 4) & 0x3ffffff;
+		LOAD32L(t, &in[9]);  h3 += (t >> 6) & 0x3ffffff;
+		LOAD32L(t, &in[12]); h4 += (t >> 8) | hibit;
+
+		/* h *= r */
+		d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+		d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) + ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+		d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) + ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+		d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) + ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+		d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+		/* (partial) h %= p */
+		c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+		d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+		d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+		d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+		d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+		h1 += c;
+
+		in += 16;
+		inlen -= 16;
+	}
+
+	st->h[0] = h0;
+	st->h[1] = h1;
+	st->h[2] = h2;
+	st->h[3] = h3;
+	st->h[4] = h4;
+
+}
+
+void csp_poly1305_init(csp_poly1305_state * st, const uint8_t * key) {
+
+	uint32_t t;
+
+	/* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+	LOAD32L(t, &key[0]);  st->r[0] = t & 0x3ffffff;
+	LOAD32L(t, &key[3]);  st->r[1] = (t >> 2) & 0x3ffff03;
+	LOAD32L(t, &key[6]);  st->r[2] = (t >> 4) & 0x3ffc0ff;
+	LOAD32L(t, &key[9]);  st->r[3] = (t >> 6) & 0x3f03fff;
+	LOAD32L(t, &key[12]); st->r[4] = (t >> 8) & 0x00fffff;
+
+	memset(st->h, 0, sizeof(st->h));
+
+	LOAD32L(st->pad[0], &key[16]);
+	LOAD32L(st->pad[1], &key[20]);
+	LOAD32L(st->pad[2], &key[24]);
+	LOAD32L(st->pad[3], &key[28]);
+
+	st->leftover = 0;
+
+}
+
+void csp_poly1305_update(csp_poly1305_state * st, const uint8_t * in, uint32_t inlen) {
+
+	uint32_t n;
+
+	/* Complete a partial block */
+	if (st->leftover) {
+		n = 16 - st->leftover;
+		if (n > inlen)
+			n = inlen;
+		memcpy(&st->buf[st->leftover], in, n);
+		st->leftover += n;
+		in += n;
+		inlen -= n;
+		if (st->leftover < 16)
+			return;
+		csp_poly1305_blocks(st, st->buf, 16, 1UL << 24);
+		st->leftover = 0;
+	}
+
+	/* Whole blocks */
+	if (inlen >= 16) {
+		n = inlen & ~15UL;
+		csp_poly1305_blocks(st, in, n, 1UL << 24);
+		in += n;
+		inlen -= n;
+	}
+
+	/* Keep the rest */
+	if (inlen) {
+		memcpy(st->buf, in, inlen);
+		st->leftover = inlen;
+	}
+
+}
+
+void csp_poly1305_pad(csp_poly1305_state * st) {
+
+	if (st->leftover) {
+		memset(&st->buf[st->leftover], 0, 16 - st->leftover);
+		csp_poly1305_blocks(st, st->buf, 16, 1UL << 24);
+		st->leftover = 0;
+	}
+
+}
+
+void csp_poly1305_finish(csp_poly1305_state * st, uint8_t * tag) {
+
+	uint32_t h0, h1, h2, h3, h4, c;
+	uint32_t g0, g1, g2, g3, g4, mask;
+	uint64_t f;
+
+	/* Process the last partial block */
+	if (st->leftover) {
+		st->buf[st->leftover] = 1;
+		memset(&st->buf[st->leftover + 1], 0, 16 - st->leftover - 1);
+		csp_poly1305_blocks(st, st->buf, 16, 0);
+	}
+
+	/* Fully carry h */
+	h0 = st->h[0];
+	h1 = st->h[1];
+	h2 = st->h[2];
+	h3 = st->h[3];
+	h4 = st->h[4];
+
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	/* Compute h + -p */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1UL << 26);
+
+	/* Select h if h < p, or h + -p if h >= p */
+	mask = (g4 >> 31) - 1;
+	g0 &= mask;
+	g1 &= mask;
+	g2 &= mask;
+	g3 &= mask;
+	g4 &= mask;
+	mask = ~mask;
+	h0 = (h0 & mask) | g0;
+	h1 = (h1 & mask) | g1;
+	h2 = (h2 & mask) | g2;
+	h3 = (h3 & mask) | g3;
+	h4 = (h4 & mask) | g4;
+
+	/* h = h % (2^128) */
+	h0 = (h0 | (h1 << 26));
+	h1 = ((h1 >> 6) | (h2 << 20));
+	h2 = ((h2 >> 12) | (h3 << 14));
+	h3 = ((h3 >> 18) | (h4 << 8));
+
+	/* tag = (h + pad) % (2^128) */
+	f = (uint64_t)h0 + st->pad[0];             h0 = (uint32_t)f;
+	f = (uint64_t)h1 + st->pad[1] + (f >> 32); h1 = (uint32_t)f;
+	f = (uint64_t)h2 + st->pad[2] + (f >> 32); h2 = (uint32_t)f;
+	f = (uint64_t)h3 + st->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+	STORE32L(h0, &tag[0]);
+	STORE32L(h1, &tag[4]);
+	STORE32L(h2, &tag[8]);
+	STORE32L(h3, &tag[12]);
+
+	/* Wipe the one time key */
+	memset(st, 0, sizeof(*st));
+
+}
+
+#endif // CSP_USE_AEAD
@@ -0,0 +1,75 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_POLY1305_H_
+#define _CSP_POLY1305_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Poly1305 key and tag size in bytes */
+#define CSP_POLY1305_KEY_LENGTH		32
+#define CSP_POLY1305_TAG_LENGTH		16
+
+/* Poly1305 state structure */
+typedef struct {
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+	uint32_t leftover;
+	uint8_t buf[16];
+} csp_poly1305_state;
+
+/**
+ * Initialize the state with a one time key
+ * @param st The state you wish to initialize
+ * @param key Key, CSP_POLY1305_KEY_LENGTH bytes
+ */
+void csp_poly1305_init(csp_poly1305_state * st, const uint8_t * key);
+
+/**
+ * Process a block of memory through the authenticator
+ * @param st The state
+ * @param in The data to authenticate
+ * @param inlen The length of the data (octets)
+ */
+void csp_poly1305_update(csp_poly1305_state * st, const uint8_t * in, uint32_t inlen);
+
+/**
+ * Pad the processed data with zeros to a multiple of 16 bytes
+ * @param st The state
+ */
+void csp_poly1305_pad(csp_poly1305_state * st);
+
+/**
+ * Terminate the authenticator to get the tag
+ * @param st The state
+ * @param tag [out] Tag, CSP_POLY1305_TAG_LENGTH bytes
+ */
+void csp_poly1305_finish(csp_poly1305_state * st, uint8_t * tag);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_POLY1305_H_
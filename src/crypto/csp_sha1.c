@@ -28,7 +28,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "csp_sha1.h"
 
-#ifdef CSP_USE_HMAC
+#if defined(CSP_USE_HMAC) || defined(CSP_USE_XTEA) || defined(CSP_USE_AEAD)
 
 /* Rotate left macro */
 #define ROL(x,y)	(((x) << (y)) | ((x) >> (32-y)))
@@ -133,6 +133,77 @@ static void csp_sha1_compress(csp_sha1_state * sha1, const uint8_t * buf) {
 
 }
 
+/* One round of all lanes, with the schedule word for the lane in W[i & 15] */
+#define FF_LANES(f, k) do { \
+	for (l = 0; l < CSP_SHA1_LANES; l++) { \
+		t = ROL(a[l], 5) + f(b[l], c[l], d[l]) + e[l] + W[i & 15][l] + k; \
+		e[l] = d[l]; \
+		d[l] = c[l]; \
+		c[l] = ROL(b[l], 30); \
+		b[l] = a[l]; \
+		a[l] = t; \
+	} } while (0)
+
+/* Expand the schedule word for round i in all lanes */
+#define W_LANES() do { \
+	for (l = 0; l < CSP_SHA1_LANES; l++) { \
+		t = W[(i - 3) & 15][l] ^ W[(i - 8) & 15][l] ^ W[(i - 14) & 15][l] ^ W[i & 15][l]; \
+		W[i & 15][l] = ROL(t, 1); \
+	} } while (0)
+
+void csp_sha1_compress_lanes(uint32_t state[CSP_SHA1_LANES][5], const uint8_t * blocks[CSP_SHA1_LANES]) {
+
+	uint32_t a[CSP_SHA1_LANES], b[CSP_SHA1_LANES], c[CSP_SHA1_LANES], d[CSP_SHA1_LANES], e[CSP_SHA1_LANES];
+	uint32_t W[16][CSP_SHA1_LANES], t, i, l;
+
+	/* Load blocks and state */
+	for (l = 0; l < CSP_SHA1_LANES; l++) {
+		for (i = 0; i < 16; i++)
+			LOAD32H(W[i][l], blocks[l] + (4*i));
+		a[l] = state[l][0];
+		b[l] = state[l][1];
+		c[l] = state[l][2];
+		d[l] = state[l][3];
+		e[l] = state[l][4];
+	}
+
+	/* Round one */
+	for (i = 0; i < 16; i++)
+		FF_LANES(F0, 0x5a827999UL);
+	for (; i < 20; i++) {
+		W_LANES();
+		FF_LANES(F0, 0x5a827999UL);
+	}
+
+	/* Round two */
+	for (; i < 40; i++) {
+		W_LANES();
+		FF_LANES(F1, 0x6ed9eba1UL);
+	}
+
+	/* Round three */
+	for (; i < 60; i++) {
+		W_LANES();
+		FF_LANES(F2, 0x8f1bbcdcUL);
+	}
+
+	/* Round four */
+	for (; i < 80; i++) {
+		W_LANES();
+		FF_LANES(F3, 0xca62c1d6UL);
+	}
+
+	/* Store */
+	for (l = 0; l < CSP_SHA1_LANES; l++) {
+		state[l][0] += a[l];
+		state[l][1] += b[l];
+		state[l][2] += c[l];
+		state[l][3] += d[l];
+		state[l][4] += e[l];
+	}
+
+}
+
 void csp_sha1_init(csp_sha1_state * sha1) {
 
    sha1->state[0] = 0x67452301UL;
@@ -214,4 +285,4 @@ void csp_sha1_memory(const uint8_t * msg, uint32_t len, uint8_t * hash) {
 
 }
 
-#endif // CSP_USE_HMAC
+#endif // CSP_USE_HMAC || CSP_USE_XTEA || CSP_USE_AEAD
@@ -31,6 +31,9 @@ extern "C" {
 #define SHA1_BLOCKSIZE	64
 #define SHA1_DIGESTSIZE	20
 
+/* Number of independent hash states compressed together by csp_sha1_compress_lanes */
+#define CSP_SHA1_LANES	4
+
 /* SHA1 state structure */
 typedef struct {
 	uint64_t length;
@@ -59,6 +62,16 @@ void csp_sha1_process(csp_sha1_state * sha1, const uint8_t * in, uint32_t inlen)
  */
 void csp_sha1_done(csp_sha1_state * sha1, uint8_t * out);
 
+/**
+ * Compress one 64 byte block into each of CSP_SHA1_LANES independent hash
+ * chaining states. The lanes are processed round by round, so their
+ * dependency chains overlap and the compiler is free to vectorise them.
+ * Padding and length encoding is left to the caller.
+ * @param state  Chaining state of each lane
+ * @param blocks One block per lane
+ */
+void csp_sha1_compress_lanes(uint32_t state[CSP_SHA1_LANES][5], const uint8_t * blocks[CSP_SHA1_LANES]);
+
 /**
  * Calculate SHA1 hash of block of memory.
  * @param msg   Pointer to message buffer
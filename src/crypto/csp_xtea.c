@@ -27,6 +27,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/csp.h>
 #include <csp/csp_endian.h>
 
+#include "../arch/csp_malloc.h"
+
+#include "csp_key.h"
 #include "csp_sha1.h"
 #include "csp_xtea.h"
 
@@ -36,8 +39,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define XTEA_ROUNDS 	32
 #define XTEA_KEY_LENGTH	16
 
-/* XTEA key */
-static uint32_t csp_xtea_key[XTEA_KEY_LENGTH/sizeof(uint32_t)] __attribute__ ((aligned(sizeof(uint32_t))));
+/* Expanded XTEA key: the round key of each half round */
+typedef struct {
+	uint32_t schedule[2 * XTEA_ROUNDS];
+} xtea_key_state;
+
+/* Default and per peer XTEA keys */
+static csp_key_table_t csp_xtea_keys;
+
+/* Key expanded from the zero key, used until a key is set */
+static xtea_key_state csp_xtea_zero_key;
+static uint8_t csp_xtea_zero_key_once;
 
 #define STORE32L(x, y) do { (y)[3] = (uint8_t)(((x) >> 24) & 0xff); \
 							(y)[2] = (uint8_t)(((x) >> 16) & 0xff); \
@@ -49,86 +61,179 @@ static uint32_t csp_xtea_key[XTEA_KEY_LENGTH/sizeof(uint32_t)] __attribute__ ((a
 								 ((uint32_t)((y)[1] & 0xff) << 8)  | \
 								 ((uint32_t)((y)[0] & 0xff) << 0); } while (0)
 
-/* This function takes 64 bits of data in block and the 128 bits key in key */
-static inline void csp_xtea_encrypt_block(uint8_t *block, uint8_t const *key) {
+/* Number of counter blocks encrypted together */
+#define XTEA_LANES		4	/* XTEA_HALF_ROUND is written out for four lanes */
+
+#if (XTEA_LANES * XTEA_BLOCKSIZE != CSP_XTEA_CHUNK_LENGTH)
+#error "CSP_XTEA_CHUNK_LENGTH must match the key stream of one pass"
+#endif
 
-	uint32_t i, v0, v1, delta = 0x9E3779B9, sum = 0, k[4];
+/* The counter block is big endian, but loaded little endian by the cipher */
+#define SWAP32(x) ((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | (((x) >> 8) & 0xff00) | (((x) >> 24) & 0xff))
+
+/* Expand the 128 bits key into the round key of each half round */
+static void csp_xtea_key_schedule(uint32_t schedule[2 * XTEA_ROUNDS], uint8_t const *key) {
+
+	uint32_t i, delta = 0x9E3779B9, sum = 0, k[4];
 
 	LOAD32L(k[0], &key[0]);
 	LOAD32L(k[1], &key[4]);
 	LOAD32L(k[2], &key[8]);
 	LOAD32L(k[3], &key[12]);
 
-	LOAD32L(v0, &block[0]);
-	LOAD32L(v1, &block[4]);
-
 	for (i = 0; i < XTEA_ROUNDS; i++) {
-		v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + k[sum & 3]);
+		schedule[2 * i] = sum + k[sum & 3];
 		sum += delta;
-		v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + k[(sum >> 11) & 3]);
+		schedule[2 * i + 1] = sum + k[(sum >> 11) & 3];
 	}
 
-	STORE32L(v0, &block[0]);
-	STORE32L(v1, &block[4]);
+}
+
+/* Half round of all four lanes */
+#define XTEA_HALF_ROUND(x, y, k) do { \
+	x[0] += (((y[0] << 4) ^ (y[0] >> 5)) + y[0]) ^ (k); \
+	x[1] += (((y[1] << 4) ^ (y[1] >> 5)) + y[1]) ^ (k); \
+	x[2] += (((y[2] << 4) ^ (y[2] >> 5)) + y[2]) ^ (k); \
+	x[3] += (((y[3] << 4) ^ (y[3] >> 5)) + y[3]) ^ (k); } while (0)
+
+/* Encrypt XTEA_LANES counter blocks into stream. The lanes are independent,
+ * so their rounds are interleaved. */
+static void csp_xtea_encrypt_lanes(uint8_t * stream, const uint32_t schedule[2 * XTEA_ROUNDS], uint32_t nonce, const uint32_t counter[XTEA_LANES]) {
+
+	uint32_t i, l, v0[XTEA_LANES], v1[XTEA_LANES];
+
+	for (l = 0; l < XTEA_LANES; l++) {
+		v0[l] = SWAP32(nonce);
+		v1[l] = SWAP32(counter[l]);
+	}
+
+	for (i = 0; i < 2 * XTEA_ROUNDS; i += 2) {
+		XTEA_HALF_ROUND(v0, v1, schedule[i]);
+		XTEA_HALF_ROUND(v1, v0, schedule[i + 1]);
+	}
+
+	for (l = 0; l < XTEA_LANES; l++) {
+		STORE32L(v0[l], &stream[l * XTEA_BLOCKSIZE]);
+		STORE32L(v1[l], &stream[l * XTEA_BLOCKSIZE + 4]);
+	}
+
+}
+
+static inline void csp_xtea_xor(uint8_t * dst, const uint8_t * src, uint32_t len) {
+
+	uint32_t d, s;
+
+	/* Whole words */
+	for (; len >= sizeof(d); len -= sizeof(d), dst += sizeof(d), src += sizeof(d)) {
+		memcpy(&d, dst, sizeof(d));
+		memcpy(&s, src, sizeof(s));
+		d ^= s;
+		memcpy(dst, &d, sizeof(d));
+	}
+
+	/* Remaining bytes */
+	while (len--)
+		*dst++ ^= *src++;
 
 }
 
-static inline void csp_xtea_xor_byte(uint8_t * dst, uint8_t * src, uint32_t len) {
+static void csp_xtea_zero_key_init(void) {
 
-	unsigned int i;
-	for (i = 0; i < len; i++)
-		dst[i] ^= src[i];
+	uint8_t zero[XTEA_KEY_LENGTH] = {0};
+	csp_xtea_key_schedule(csp_xtea_zero_key.schedule, zero);
 
 }
 
-int csp_xtea_set_key(char * key, uint32_t keylen) {
+/* Pin the key of a peer, release it with csp_key_put */
+static const xtea_key_state * csp_xtea_key_get(uint8_t node, int * slot) {
 
-	/* Use SHA1 as KDF */
-	uint8_t hash[SHA1_DIGESTSIZE];
-	csp_sha1_memory((uint8_t *)key, keylen, hash);
+	csp_key_once(&csp_xtea_zero_key_once, csp_xtea_zero_key_init);
 
-	/* Copy key */
-	memcpy(csp_xtea_key, hash, XTEA_KEY_LENGTH);
+	return csp_key_get(&csp_xtea_keys, node, &csp_xtea_zero_key, slot);
+
+}
+
+static int csp_xtea_key_set(int slot, char * key, uint32_t keylen) {
+
+	xtea_key_state * expanded = NULL;
+
+	if (key != NULL) {
+		expanded = csp_malloc(sizeof(*expanded));
+		if (expanded == NULL)
+			return -1;
+
+		/* Use SHA1 as KDF */
+		uint8_t hash[SHA1_DIGESTSIZE];
+		csp_sha1_memory((uint8_t *)key, keylen, hash);
+
+		/* Expand key */
+		csp_xtea_key_schedule(expanded->schedule, hash);
+	}
+
+	csp_key_set(&csp_xtea_keys, slot, expanded);
 
 	return 0;
 
 }
 
-int csp_xtea_encrypt(uint8_t * plain, const uint32_t len, uint32_t iv[2]) {
+int csp_xtea_set_key(char * key, uint32_t keylen) {
 
-	unsigned int i;
-	uint32_t stream[2];
+	return csp_xtea_key_set(CSP_KEY_DEFAULT, key, keylen);
 
-	uint32_t blocks = (len + XTEA_BLOCKSIZE - 1)/ XTEA_BLOCKSIZE;
-	uint32_t remain;
+}
 
-	/* Initialize stream */
-	stream[0] = csp_htobe32(iv[0]);
-	stream[1] = csp_htobe32(iv[1]);
+int csp_xtea_set_peer_key(uint8_t node, char * key, uint32_t keylen) {
 
-	for (i = 0; i < blocks; i++) {
-		/* Create stream */
-		csp_xtea_encrypt_block((uint8_t *)stream, (uint8_t *)csp_xtea_key);
+	if (node > CSP_ID_HOST_MAX)
+		return -1;
 
-		/* Calculate remaining bytes */
-		remain = len - i * XTEA_BLOCKSIZE;
+	return csp_xtea_key_set(node, key, keylen);
 
-		/* XOR plain text with stream to generate cipher text */
-		csp_xtea_xor_byte(&plain[len - remain], (uint8_t *)stream, remain < XTEA_BLOCKSIZE ? remain : XTEA_BLOCKSIZE);
+}
+
+void csp_xtea_crypt_chunk(uint8_t * data, uint32_t offset, uint32_t len, const uint32_t iv[2], uint8_t node) {
+
+	unsigned int l;
+	int slot;
+	uint32_t counter[XTEA_LANES];
+	uint8_t stream[CSP_XTEA_CHUNK_LENGTH];
+	uint32_t block = offset / XTEA_BLOCKSIZE;
+
+	/* Counter of each block. The first two blocks both use iv[1],
+	 * which is kept for compatibility with existing nodes */
+	for (l = 0; l < XTEA_LANES; l++, block++)
+		counter[l] = iv[1] + (block ? block - 1 : 0);
+
+	/* Create stream, with the key of the peer expanded when it was set */
+	csp_xtea_encrypt_lanes(stream, csp_xtea_key_get(node, &slot)->schedule, iv[0], counter);
+	csp_key_put(&csp_xtea_keys, slot);
+
+	/* XOR plain text with stream to generate cipher text */
+	csp_xtea_xor(data, stream, len);
 
-		/* Increment counter */
-		stream[0] = csp_htobe32(iv[0]);
-		stream[1] = csp_htobe32(iv[1]++);
+}
+
+int csp_xtea_encrypt(uint8_t * plain, const uint32_t len, uint32_t iv[2], uint8_t node) {
+
+	uint32_t offset, chunk;
+	uint32_t blocks = (len + XTEA_BLOCKSIZE - 1)/ XTEA_BLOCKSIZE;
+
+	for (offset = 0; offset < len; offset += chunk) {
+		chunk = (len - offset < CSP_XTEA_CHUNK_LENGTH) ? len - offset : CSP_XTEA_CHUNK_LENGTH;
+		csp_xtea_crypt_chunk(&plain[offset], offset, chunk, iv, node);
 	}
 
+	/* Advance counter by the number of blocks */
+	iv[1] += blocks;
+
 	return 0;
 
 }
 
-int csp_xtea_decrypt(uint8_t * cipher, const uint32_t len, uint32_t iv[2]) {
+int csp_xtea_decrypt(uint8_t * cipher, const uint32_t len, uint32_t iv[2], uint8_t node) {
 
 	/* Since we use counter mode, we can reuse the encryption function */
-	return csp_xtea_encrypt(cipher, len, iv);
+	return csp_xtea_encrypt(cipher, len, iv, node);
 
 }
 
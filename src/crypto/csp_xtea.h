@@ -29,21 +29,37 @@ extern "C" {
 
 #define CSP_XTEA_IV_LENGTH	8
 
+/* Key stream generated per pass, in bytes */
+#define CSP_XTEA_CHUNK_LENGTH	32
+
 /**
  * XTEA encrypt byte array
  * @param plain Pointer to plain text
  * @param len Length of plain text
  * @param iv Initialization vector
+ * @param node Destination node, selects the key
+ */
+int csp_xtea_encrypt(uint8_t * plain, const uint32_t len, uint32_t iv[2], uint8_t node);
+
+/**
+ * Encrypt or decrypt one chunk of a byte array.
+ * csp_xtea_encrypt is equivalent to calling this for each chunk in turn.
+ * @param data Pointer to the chunk
+ * @param offset Position of the chunk in the array, a multiple of CSP_XTEA_CHUNK_LENGTH
+ * @param len Length of the chunk, at most CSP_XTEA_CHUNK_LENGTH
+ * @param iv Initialization vector of the array
+ * @param node Peer node, selects the key
  */
-int csp_xtea_encrypt(uint8_t * plain, const uint32_t len, uint32_t iv[2]);
+void csp_xtea_crypt_chunk(uint8_t * data, uint32_t offset, uint32_t len, const uint32_t iv[2], uint8_t node);
 
 /**
  * Decrypt XTEA encrypted byte array
  * @param cipher Pointer to cipher text
  * @param len Length of plain text
  * @param iv Initialization vector
+ * @param node Source node, selects the key
  */
-int csp_xtea_decrypt(uint8_t * cipher, const uint32_t len, uint32_t iv[2]);
+int csp_xtea_decrypt(uint8_t * cipher, const uint32_t len, uint32_t iv[2], uint8_t node);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -29,21 +29,22 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "arch/csp_malloc.h"
 #include "arch/csp_semaphore.h"
 
-typedef enum csp_buffer_state_t {
-	CSP_BUFFER_FREE	= 0,
-	CSP_BUFFER_USED	= 1,
-} csp_buffer_state_t;
+/* Each buffer element is tracked by a reference count. A count of zero
+ * means the element is free. */
+typedef uint8_t csp_buffer_refc_t;
+
+#define CSP_BUFFER_FREE		0
 
 #ifdef CSP_BUFFER_STATIC
 	typedef struct { uint8_t data[CSP_BUFFER_SIZE]; } csp_buffer_element_t;
 	static csp_buffer_element_t csp_buffer[CSP_BUFFER_COUNT];
-	static csp_buffer_state csp_buffer_list[CSP_BUFFER_COUNT];
+	static csp_buffer_refc_t csp_buffer_list[CSP_BUFFER_COUNT];
 	static void * csp_buffer_p = &csp_buffer;
-	static const size_t = CSP_BUFFER_SIZE;
+	static const size_t size = CSP_BUFFER_SIZE;
 	static const int count = CSP_BUFFER_COUNT;
 #else
 	static uint8_t * csp_buffer_p;
-	static csp_buffer_state_t * csp_buffer_list;
+	static csp_buffer_refc_t * csp_buffer_list;
 	static size_t size;
 	static int count;
 #endif
@@ -65,7 +66,7 @@ int csp_buffer_init(int buf_count, int buf_size) {
 		return CSP_ERR_NOMEM;
 
 	/* Allocate housekeeping memory */
-	csp_buffer_list = (csp_buffer_state_t *) csp_malloc(count * sizeof(csp_buffer_state_t));
+	csp_buffer_list = (csp_buffer_refc_t *) csp_malloc(count * sizeof(csp_buffer_refc_t));
 	if (csp_buffer_list == NULL) {
 		csp_free(csp_buffer_p);
 		return CSP_ERR_NOMEM;
@@ -87,7 +88,7 @@ int csp_buffer_init(int buf_count, int buf_size) {
 #endif
 
 	/* Clear housekeeping memory = all free mem */
-	memset(csp_buffer_list, 0, count * sizeof(csp_buffer_state_t));
+	memset(csp_buffer_list, 0, count * sizeof(csp_buffer_refc_t));
 
 	return CSP_ERR_NONE;
 
@@ -105,8 +106,9 @@ void * csp_buffer_get_isr(size_t buf_size) {
 	int i = csp_buffer_last_given; // Start with the last given element
 	i = (i + 1) % count; // Increment by one
 	while (i != csp_buffer_last_given) { // Loop till we have checked all
-		if (csp_buffer_list[i] == CSP_BUFFER_FREE) { // Check the buffer list
-			csp_buffer_list[i] = CSP_BUFFER_USED; // Mark as used
+		csp_buffer_refc_t expected = CSP_BUFFER_FREE;
+		if (__atomic_compare_exchange_n(&csp_buffer_list[i], &expected, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) { // Mark as used, with one reference
 			csp_buffer_last_given = i; // Remember the progress
 			csp_debug(CSP_BUFFER, "BUFFER: Using element %u at %p\r\n", i, csp_buffer_p + (i * size));
 			return csp_buffer_p + (i * size); // Return poniter
@@ -134,16 +136,63 @@ void * csp_buffer_get(size_t buf_size) {
 }
 
 /**
- * Instantly free's the packet buffer
- * This call is safe from both ISR and Task context
+ * Find the element number of a buffer
+ * @param buffer pointer to buffer
+ * @return element number or -1 if the pointer is outside the pool
+ */
+static inline int csp_buffer_index(void * buffer) {
+	int i = ((uint8_t *) buffer - csp_buffer_p) / size;		// Find number in array by math (wooo)
+	if (buffer == NULL || i < 0 || i >= count)
+		return -1;
+	return i;
+}
+
+/**
+ * Releases one reference to the packet buffer, and frees the
+ * buffer when the last reference is released. The count is updated
+ * atomically, so this call is safe from both ISR and task context.
  * @param packet
  */
 void csp_buffer_free(void * packet) {
-	int i = ((uint8_t *) packet - csp_buffer_p) / size;					// Find number in array by math (wooo)
+	int i = csp_buffer_index(packet);
+	if (i < 0)
+		return;
 	csp_debug(CSP_BUFFER, "BUFFER: Free element %u\r\n", i);
-	if (i < 0 || i > count)
+	csp_buffer_refc_t refc = __atomic_load_n(&csp_buffer_list[i], __ATOMIC_RELAXED);
+	while (refc != CSP_BUFFER_FREE) {			// Mark this as free when no references remain
+		if (__atomic_compare_exchange_n(&csp_buffer_list[i], &refc, refc - 1, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/**
+ * Take an extra reference to a packet buffer
+ * This call is safe from both ISR and task context.
+ * @param buffer pointer to buffer
+ */
+void csp_buffer_refc_inc(void * buffer) {
+	int i = csp_buffer_index(buffer);
+	if (i < 0)
 		return;
-	csp_buffer_list[i] = CSP_BUFFER_FREE;					// Mark this as free now
+	csp_buffer_refc_t refc = __atomic_load_n(&csp_buffer_list[i], __ATOMIC_RELAXED);
+	while (refc != CSP_BUFFER_FREE) {
+		if (__atomic_compare_exchange_n(&csp_buffer_list[i], &refc, refc + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/**
+ * Get number of references held to a packet buffer
+ * @param buffer pointer to buffer
+ * @return reference count, 0 if the buffer is free or invalid
+ */
+int csp_buffer_refc(void * buffer) {
+	int i = csp_buffer_index(buffer);
+	if (i < 0)
+		return 0;
+	return __atomic_load_n(&csp_buffer_list[i], __ATOMIC_RELAXED);
 }
 
 /**
@@ -166,6 +215,10 @@ void * csp_buffer_clone(void * buffer) {
 
 }
 
+int csp_buffer_size(void) {
+	return size - CSP_BUFFER_PACKET_OVERHEAD;
+}
+
 int csp_buffer_remaining(void) {
 	int buf_count = 0, i;
 	for(i = 0; i < count; i++) {
@@ -181,7 +234,7 @@ void csp_buffer_print_table(void) {
 	csp_packet_t * packet;
 	for(i = 0; i < count; i++) {
 		printf("[%02u] ", i);
-		printf("%s ", csp_buffer_list[i] == CSP_BUFFER_FREE ? "FREE" : "USED");
+		printf("%s (%u) ", csp_buffer_list[i] == CSP_BUFFER_FREE ? "FREE" : "USED", csp_buffer_list[i]);
 		packet = (csp_packet_t *) (csp_buffer_p + (i * size));
 		printf("Packet P 0x%02X, S 0x%02X, D 0x%02X, Dp 0x%02X, Sp 0x%02X",
 			packet->id.pri, packet->id.src, packet->id.dst, packet->id.dport,
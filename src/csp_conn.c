@@ -21,10 +21,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 /* CSP includes */
 #include <csp/csp.h>
 #include <csp/csp_error.h>
+#include <csp/csp_mcast.h>
 
 #include "arch/csp_thread.h"
 #include "arch/csp_queue.h"
@@ -33,6 +35,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "arch/csp_time.h"
 
 #include "csp_conn.h"
+#include "csp_port.h"
+#include "csp_route.h"
 #include "transport/csp_transport.h"
 
 /* Static connection pool */
@@ -41,20 +45,124 @@ static csp_conn_t arr_conn[CSP_CONN_MAX];
 /* Connection pool lock */
 static csp_bin_sem_handle_t conn_lock;
 
+/* Lookup buckets of connections by incoming identifier, chained through
+ * hash_next, and the number of connections using each local port. Both are
+ * protected by conn_lock. */
+#define CSP_CONN_BUCKETS	(2 * CSP_CONN_MAX)
+static csp_conn_t * conn_buckets[CSP_CONN_BUCKETS];
+static uint16_t port_conns[CSP_ID_PORT_MAX + 1];
+
 /* Source port */
 static uint8_t sport;
 
 /* Source port lock */
 static csp_bin_sem_handle_t sport_lock;
 
-void csp_conn_check_timeouts(void) {
+/* Lookup bucket of an incoming identifier */
+static unsigned int csp_conn_bucket(csp_id_t id) {
+
+	csp_id_ext_t key = id.ext & CSP_ID_CONN_MASK;
+	uint32_t hash = (uint32_t) key;
+#ifdef CSP_EXT_HEADER
+	hash ^= (uint32_t) (key >> 32);
+#endif
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return hash % CSP_CONN_BUCKETS;
+
+}
+
+/* Make a connection visible to lookups, conn_lock must be held */
+static void csp_conn_link(csp_conn_t * conn) {
+
+	csp_conn_t ** bucket = &conn_buckets[csp_conn_bucket(conn->idin)];
+
+	conn->hash_next = *bucket;
+	*bucket = conn;
+	port_conns[conn->idin.dport]++;
+
+}
+
+/* Remove a connection from lookups, conn_lock must be held */
+static void csp_conn_unlink(csp_conn_t * conn) {
+
+	csp_conn_t ** link = &conn_buckets[csp_conn_bucket(conn->idin)];
+
+	while (*link != NULL) {
+		if (*link == conn) {
+			*link = conn->hash_next;
+			port_conns[conn->idin.dport]--;
+			break;
+		}
+		link = &(*link)->hash_next;
+	}
+
+	conn->hash_next = NULL;
+
+}
+
+/* Return 1 if an idle connection can carry another transaction */
+static int csp_conn_idle_usable(csp_conn_t * conn) {
+
 #ifdef CSP_USE_RDP
+	/* Reset by the peer */
+	if (conn->rdp.state != RDP_OPEN)
+		return 0;
+#endif
+
+	/* Unexpected data, which could be mistaken for a reply */
+	int prio;
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++)
+		if (csp_queue_size(conn->rx_queue[prio]) > 0)
+			return 0;
+
+	return 1;
+
+}
+
+/* Take an idle connection out of the pool, return 1 if it was still idle */
+static int csp_conn_idle_claim(csp_conn_t * conn) {
+
+	int claimed = 0;
+
+	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK)
+		return 0;
+
+	if (conn->state == CONN_OPEN && conn->idle) {
+		conn->idle = 0;
+		claimed = 1;
+	}
+
+	csp_bin_sem_post(&conn_lock);
+
+	return claimed;
+
+}
+
+void csp_conn_check_timeouts(void) {
 	int i;
+#ifdef CSP_USE_RDP
 	for (i = 0; i < CSP_CONN_MAX; i++)
 		if (arr_conn[i].state == CONN_OPEN)
 			if (arr_conn[i].idin.flags & CSP_FRDP)
 				csp_rdp_check_timeouts(&arr_conn[i]);
 #endif
+
+	/* Close idle connections that have expired or can no longer be used */
+	uint32_t time_now = csp_get_ms();
+	for (i = 0; i < CSP_CONN_MAX; i++) {
+		csp_conn_t * conn = &arr_conn[i];
+		if (conn->state != CONN_OPEN || !conn->idle)
+			continue;
+		if ((time_now - conn->idle_timestamp) < CSP_CONN_IDLE_TIMEOUT && csp_conn_idle_usable(conn))
+			continue;
+		if (csp_conn_idle_claim(conn)) {
+			csp_debug(CSP_PROTOCOL, "Closing idle connection %p\r\n", conn);
+			csp_close(conn);
+		}
+	}
 }
 
 int csp_conn_get_rxq(int prio) {
@@ -86,10 +194,17 @@ int csp_conn_unlock(csp_conn_t * conn) {
 
 int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
-	if (!conn || !packet)
+	if (!conn)
 		return CSP_ERR_INVAL;
 
-	int rxq = csp_conn_get_rxq(packet->id.pri);
+	/* A NULL packet wakes up the reader when the connection is reset */
+	int rxq = packet ? csp_conn_get_rxq(packet->id.pri) : 0;
+
+#ifdef CSP_USE_AQM
+	/* RDP delivers acknowledged data, which must not be dropped */
+	if (packet && !(conn->idin.flags & CSP_FRDP))
+		csp_qos_stamp(packet, NULL);
+#endif
 
 	if (csp_queue_enqueue(conn->rx_queue[rxq], &packet, 0) != CSP_QUEUE_OK)
 		return CSP_ERR_NOMEM;
@@ -146,19 +261,21 @@ int csp_conn_init(void) {
 
 }
 
-csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask) {
+csp_conn_t * csp_conn_find(csp_id_t id) {
 
-	/* Search for matching connection */
-	int i;
 	csp_conn_t * conn;
 
-	for (i = 0; i < CSP_CONN_MAX; i++) {
-		conn = &arr_conn[i];
-		if ((conn->state != CONN_CLOSED) && (conn->type == CONN_CLIENT) && (conn->idin.ext & mask) == (id & mask))
-			return conn;
-	}
-	
-	return NULL;
+	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK)
+		return NULL;
+
+	/* Search the bucket for a matching connection */
+	for (conn = conn_buckets[csp_conn_bucket(id)]; conn != NULL; conn = conn->hash_next)
+		if ((conn->idin.ext & CSP_ID_CONN_MASK) == (id.ext & CSP_ID_CONN_MASK))
+			break;
+
+	csp_bin_sem_post(&conn_lock);
+
+	return conn;
 
 }
 
@@ -175,6 +292,16 @@ int csp_conn_flush_rx_queue(csp_conn_t * conn) {
 				csp_buffer_free(packet);
 	}
 
+#ifdef CSP_USE_AQM
+	memset(conn->rx_codel, 0, sizeof(conn->rx_codel));
+#endif
+
+	/* Drop partially read stream segment */
+	if (conn->stream_rx != NULL) {
+		csp_buffer_free(conn->stream_rx);
+		conn->stream_rx = NULL;
+	}
+
 	/* Flush event queue */
 #ifdef CSP_USE_QOS
 	int event;
@@ -216,7 +343,9 @@ csp_conn_t * csp_conn_allocate(csp_conn_type_t type) {
 	}
 
 	conn->socket = NULL;
+	conn->port_next = NULL;
 	conn->type = type;
+	conn->idle = 0;
 	csp_conn_last_given = i;
 	csp_bin_sem_post(&conn_lock);
 
@@ -238,6 +367,15 @@ csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
 
 		/* Ensure connection queue is empty */
 		csp_conn_flush_rx_queue(conn);
+
+		/* Let the router find it */
+		if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
+			csp_debug(CSP_ERROR, "Failed to lock conn array\r\n");
+			conn->state = CONN_CLOSED;
+			return NULL;
+		}
+		csp_conn_link(conn);
+		csp_bin_sem_post(&conn_lock);
 	}
 
 	return conn;
@@ -269,16 +407,27 @@ int csp_close(csp_conn_t * conn) {
 		return CSP_ERR_TIMEDOUT;
 	}
 
+	/* Stop delivery to a socket */
+	if (conn->type == CONN_SERVER) {
+		csp_port_unbind(conn);
+#ifdef CSP_USE_MCAST
+		csp_mcast_leave_all(conn);
+#endif
+	}
+
 	/* Set to closed */
+	if (conn->type == CONN_CLIENT)
+		csp_conn_unlink(conn);
 	conn->state = CONN_CLOSED;
+	conn->idle = 0;
 
 	/* Ensure connection queue is empty */
 	csp_conn_flush_rx_queue(conn);
 
-	/* Reset RDP state */
+	/* Reset RDP state and release queues */
 #ifdef CSP_USE_RDP
 	if (conn->idin.flags & CSP_FRDP)
-		csp_rdp_flush_all(conn);
+		csp_rdp_release(conn);
 #endif
 
 	/* Unlock connection array */
@@ -342,39 +491,55 @@ csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t tim
 		return NULL;
 #endif
 	}
+
+	if (opts & CSP_O_AEAD) {
+#ifdef CSP_USE_AEAD
+		outgoing_id.flags |= CSP_FAEAD;
+		incoming_id.flags |= CSP_FAEAD;
+#else
+		csp_debug(CSP_ERROR, "Attempt to create AEAD encrypted connection, but CSP was compiled without AEAD support\r\n");
+		return NULL;
+#endif
+	}
 	
 	/* Find an unused ephemeral port */
 	csp_conn_t * conn;
+	int i, sport_max = CSP_ID_PORT_MAX;
+
+#ifdef CSP_EXT_HEADER
+	/* The port must fit in the header of the interface to the destination */
+	csp_iface_t * ifc = csp_route_if(dest, NULL);
+	if (ifc != NULL && !ifc->ext_header)
+		sport_max = CSP_LEGACY_PORT_MAX;
+#endif
 
-	/* Wait for sport lock */
+	/* Wait for sport lock, which is held until the connection uses the port */
 	if (csp_bin_sem_wait(&sport_lock, 1000) != CSP_SEMAPHORE_OK)
 		return NULL;
 
-	uint8_t start = sport;
-	while (++sport != start) {
-		if (sport > CSP_ID_PORT_MAX)
-			sport = CSP_MAX_BIND_PORT + 1;
-
-		outgoing_id.sport = sport;
-		incoming_id.dport = sport;
-		
-		/* Match on destination port of _incoming_ identifier */
-		conn = csp_conn_find(incoming_id.ext, CSP_ID_DPORT_MASK);
+	for (i = 0; i < sport_max - CSP_MAX_BIND_PORT; i++) {
+		sport = (sport >= sport_max) ? CSP_MAX_BIND_PORT + 1 : sport + 1;
 
 		/* Break if we found an unused ephemeral port */
-		if (conn == NULL)
+		if (port_conns[sport] == 0)
 			break;
 	}
 
-	/* Post sport lock */
-	csp_bin_sem_post(&sport_lock);
-
 	/* If no available ephemeral port was found */
-	if (sport == start)
+	if (i == sport_max - CSP_MAX_BIND_PORT) {
+		csp_bin_sem_post(&sport_lock);
 		return NULL;
+	}
+
+	outgoing_id.sport = sport;
+	incoming_id.dport = sport;
 
 	/* Get storage for new connection */
 	conn = csp_conn_new(incoming_id, outgoing_id);
+
+	/* Post sport lock */
+	csp_bin_sem_post(&sport_lock);
+
 	if (conn == NULL)
 		return NULL;
 
@@ -398,6 +563,50 @@ csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t tim
 
 }
 
+/**
+ * IDLE CONNECTIONS
+ * RDP connections used by csp_transaction2 are kept open after a successful
+ * transaction, and reused by the next transaction with the same priority,
+ * destination, port and options. This saves the handshake and teardown. Idle
+ * connections are closed after CSP_CONN_IDLE_TIMEOUT ms, or when the peer
+ * resets them.
+ */
+csp_conn_t * csp_conn_idle_get(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t opts) {
+
+	int i;
+	csp_conn_t * conn;
+
+	for (i = 0; i < CSP_CONN_MAX; i++) {
+		conn = &arr_conn[i];
+		if (conn->state != CONN_OPEN || !conn->idle || conn->opts != opts)
+			continue;
+		if (conn->idout.pri != prio || conn->idout.dst != dest || conn->idout.dport != dport)
+			continue;
+		if (!csp_conn_idle_claim(conn))
+			continue;
+		if (!csp_conn_idle_usable(conn)) {
+			csp_close(conn);
+			continue;
+		}
+		return conn;
+	}
+
+	return NULL;
+
+}
+
+void csp_conn_idle_put(csp_conn_t * conn) {
+
+	if (CSP_CONN_IDLE_TIMEOUT == 0 || !(conn->idout.flags & CSP_FRDP) || !csp_conn_idle_usable(conn)) {
+		csp_close(conn);
+		return;
+	}
+
+	conn->idle_timestamp = csp_get_ms();
+	conn->idle = 1;
+
+}
+
 inline int csp_conn_dport(csp_conn_t * conn) {
 
 	return conn->idin.dport;
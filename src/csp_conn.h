@@ -32,6 +32,8 @@ extern "C" {
 #include "arch/csp_queue.h"
 #include "arch/csp_semaphore.h"
 
+#include "csp_qos.h"
+
 /** @brief Connection states */
 typedef enum {
 	CONN_CLOSED = 0,
@@ -62,13 +64,17 @@ typedef struct {
 	uint16_t rcv_cur; 					/**< The sequence number of the last segment received correctly and in sequence */
 	uint16_t rcv_irs; 					/**< The initial receive sequence number */
 	uint16_t rcv_lsa; 					/**< The last sequence number acknowledged by the receiver */
+	uint16_t snd_wnd;					/**< The receive window last advertised by the peer */
+	uint16_t rcv_wnd;					/**< The receive window last advertised to the peer */
+	uint32_t features;					/**< Protocol features supported by both ends */
 	uint32_t window_size;
 	uint32_t conn_timeout;
 	uint32_t packet_timeout;
 	uint32_t delayed_acks;
 	uint32_t ack_timeout;
 	uint32_t ack_delay_count;
-	uint32_t ack_timestamp;
+	uint32_t ack_timestamp;				/**< Time of the last ACK, or of the first segment received after it */
+	uint32_t probe_timestamp;			/**< Time the last zero window probe was sent */
 	csp_bin_sem_handle_t tx_wait;
 	csp_queue_handle_t tx_queue;
 	csp_queue_handle_t rx_queue;
@@ -81,13 +87,22 @@ struct csp_conn_s {
 	csp_mutex_t lock;				/* Connection structure lock */
 	csp_id_t idin;				  	/* Identifier received */
 	csp_id_t idout;				 	/* Identifier transmitted */
+	struct csp_conn_s * hash_next;	/* Next connection in the same lookup bucket */
+	struct csp_conn_s * port_next;	/* Next socket bound to the same port, NULL if not bound */
 #ifdef CSP_USE_QOS
 	csp_queue_handle_t rx_event;	/* Event queue for RX packets */
 #endif
 	csp_queue_handle_t rx_queue[CSP_RX_QUEUES]; /* Queue for RX packets */
+#ifdef CSP_USE_AQM
+	csp_qos_codel_t rx_codel[CSP_RX_QUEUES];	/* AQM state of RX queues, not used with RDP */
+#endif
 	csp_queue_handle_t socket;		/* Socket to be "woken" when first packet is ready */
 	uint32_t timestamp;				/* Time the connection was opened */
 	uint32_t opts;					/* Connection or socket options */
+	uint8_t idle;					/* Connection is kept open for reuse by transactions */
+	uint32_t idle_timestamp;		/* Time the connection became idle */
+	csp_packet_t * stream_rx;		/* Partially read stream segment */
+	uint16_t stream_rx_offset;		/* Bytes already read from stream_rx */
 #ifdef CSP_USE_RDP
 	csp_rdp_t rdp;					/* RDP state */
 #endif
@@ -98,10 +113,12 @@ int csp_conn_unlock(csp_conn_t * conn);
 int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet);
 int csp_conn_init(void);
 csp_conn_t * csp_conn_allocate(csp_conn_type_t type);
-csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask);
+csp_conn_t * csp_conn_find(csp_id_t id);
 csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout);
 void csp_conn_check_timeouts(void);
 int csp_conn_get_rxq(int prio);
+csp_conn_t * csp_conn_idle_get(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t opts);
+void csp_conn_idle_put(csp_conn_t * conn);
 
 #ifdef __cplusplus
 } /* extern "C" */
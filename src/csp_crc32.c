@@ -47,16 +47,19 @@ void csp_crc32_gentab(void) {
 	}
 }
 
-uint32_t csp_crc32_memory(const uint8_t * data, uint32_t length) {
-   uint32_t crc;
+uint32_t csp_crc32_update(uint32_t crc, const uint8_t * data, uint32_t length) {
 
-   crc = 0xFFFFFFFF;
+   crc ^= 0xFFFFFFFF;
    while (length--)
 	   crc = crc_tab[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
 
    return (crc ^ 0xFFFFFFFF);
 }
 
+uint32_t csp_crc32_memory(const uint8_t * data, uint32_t length) {
+   return csp_crc32_update(0, data, length);
+}
+
 int csp_crc32_append(csp_packet_t * packet) {
 
 	uint32_t crc;
@@ -30,6 +30,23 @@ extern "C" {
  */
 void csp_crc32_gentab(void);
 
+/**
+ * Calculate CRC32 checksum of a memory block
+ * @param data pointer to data
+ * @param length number of bytes
+ * @return checksum
+ */
+uint32_t csp_crc32_memory(const uint8_t * data, uint32_t length);
+
+/**
+ * Continue CRC32 checksum over more data
+ * @param crc checksum of the preceding data, 0 to start a new checksum
+ * @param data pointer to data
+ * @param length number of bytes
+ * @return checksum
+ */
+uint32_t csp_crc32_update(uint32_t crc, const uint8_t * data, uint32_t length);
+
 /**
  * Append CRC32 checksum to packet
  * @param packet Packet to append checksum
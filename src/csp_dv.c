@@ -0,0 +1,447 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_dv.h>
+
+#include "arch/csp_queue.h"
+#include "arch/csp_thread.h"
+#include "arch/csp_time.h"
+
+#include "csp_io.h"
+#include "csp_route.h"
+
+#ifdef CSP_USE_DV
+
+#define CSP_DV_IFACES			4
+#define CSP_DV_NEIGHBOURS		8
+
+/* Number of adverts queued between the router and the daemon */
+#define CSP_DV_QUEUE_LENGTH		4
+
+/* Minimum time in ms between adverts sent because a route changed */
+#define CSP_DV_TRIGGER_GAP		100
+
+typedef struct {
+	csp_iface_t * ifc;
+	uint32_t packets;			// Packets at the last cost update
+	uint32_t errors;			// Errors and drops at the last cost update
+	uint16_t loss;				// Smoothed error rate, per mille
+	uint8_t cost;
+} csp_dv_iface_t;
+
+typedef struct {
+	csp_dv_iface_t * iface;		// NULL if the slot is unused
+	uint8_t node;
+	uint32_t heard;				// Time of the last advert
+	uint8_t cost[CSP_ID_HOST_MAX + 1];
+} csp_dv_neighbour_t;
+
+/* Route set by the daemon */
+typedef struct {
+	csp_iface_t * ifc;			// NULL if none
+	uint8_t mac;
+	uint8_t cost;
+} csp_dv_route_t;
+
+typedef struct {
+	csp_iface_t * ifc;
+	csp_packet_t * packet;
+} csp_dv_input_t;
+
+static csp_dv_iface_t dv_ifaces[CSP_DV_IFACES];
+static int dv_iface_count = 0;
+static csp_dv_neighbour_t dv_neighbours[CSP_DV_NEIGHBOURS];
+static csp_dv_route_t dv_routes[CSP_ID_HOST_MAX + 1];
+static csp_queue_handle_t dv_queue = NULL;
+static uint32_t dv_opts = 0;
+static csp_thread_handle_t handle_dv;
+
+int csp_dv_add_interface(csp_iface_t * ifc) {
+
+	int i, count = __atomic_load_n(&dv_iface_count, __ATOMIC_ACQUIRE);
+
+	if (ifc == NULL)
+		return CSP_ERR_INVAL;
+
+	for (i = 0; i < count; i++)
+		if (dv_ifaces[i].ifc == ifc)
+			return CSP_ERR_NONE;
+
+	if (count >= CSP_DV_IFACES) {
+		csp_debug(CSP_ERROR, "Failed to add %s to routing daemon: too many interfaces\r\n", ifc->name);
+		return CSP_ERR_NOMEM;
+	}
+
+	/* The daemon may be running, so publish the slot when it is complete */
+	memset(&dv_ifaces[count], 0, sizeof(dv_ifaces[count]));
+	dv_ifaces[count].ifc = ifc;
+	dv_ifaces[count].cost = 1;
+	__atomic_store_n(&dv_iface_count, count + 1, __ATOMIC_RELEASE);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_dv_set_opts(uint32_t opts) {
+
+	if (opts & ~CSP_SO_HMACREQ)
+		return CSP_ERR_INVAL;
+
+#ifndef CSP_USE_HMAC
+	if (opts & CSP_SO_HMACREQ)
+		return CSP_ERR_NOTSUP;
+#endif
+
+	__atomic_store_n(&dv_opts, opts, __ATOMIC_RELAXED);
+
+	return CSP_ERR_NONE;
+
+}
+
+uint32_t csp_dv_get_opts(void) {
+
+	return __atomic_load_n(&dv_opts, __ATOMIC_RELAXED);
+
+}
+
+int csp_dv_input(csp_iface_t * ifc, csp_packet_t * packet) {
+
+	if (dv_queue == NULL)
+		return CSP_ERR_INVAL;
+
+	csp_dv_input_t input = {ifc, packet};
+	if (csp_queue_enqueue(dv_queue, &input, 0) != CSP_QUEUE_OK) {
+		csp_debug(CSP_WARN, "Routing daemon queue full\r\n");
+		csp_buffer_free(packet);
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+static csp_dv_iface_t * csp_dv_iface_find(csp_iface_t * ifc) {
+
+	int i, count = __atomic_load_n(&dv_iface_count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++)
+		if (dv_ifaces[i].ifc == ifc)
+			return &dv_ifaces[i];
+
+	return NULL;
+
+}
+
+/* Update the cost of each link from its interface statistics since the last update */
+static void csp_dv_link_costs(void) {
+
+	int i, count = __atomic_load_n(&dv_iface_count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++) {
+		csp_dv_iface_t * iface = &dv_ifaces[i];
+		csp_iface_t * ifc = iface->ifc;
+
+		uint32_t packets = ifc->tx + ifc->rx;
+		uint32_t errors = ifc->tx_error + ifc->rx_error + ifc->drop + ifc->autherr + ifc->frame;
+		uint32_t dp = packets - iface->packets;
+		uint32_t de = errors - iface->errors;
+		iface->packets = packets;
+		iface->errors = errors;
+
+		if (dp + de > 0) {
+			uint32_t sample = (uint32_t) ((uint64_t) de * 1000 / (dp + de));
+			iface->loss = (3 * iface->loss + sample) / 4;
+		}
+
+		iface->cost = 1 + (iface->loss * (CSP_DV_COST_MAX - 1) + 500) / 1000;
+	}
+
+}
+
+/* Store the costs advertised by a neighbour, return 1 if they changed */
+static int csp_dv_receive(csp_dv_input_t * input) {
+
+	int i;
+	csp_packet_t * packet = input->packet;
+	struct csp_dv_advert * advert = (struct csp_dv_advert *) packet->data;
+	csp_dv_neighbour_t * neighbour = NULL;
+
+	if (packet->length != sizeof(*advert) || advert->version != CSP_DV_VERSION)
+		return 0;
+
+	if (packet->id.src == my_address)
+		return 0;
+
+	csp_dv_iface_t * iface = csp_dv_iface_find(input->ifc);
+	if (iface == NULL)
+		return 0;
+
+	for (i = 0; i < CSP_DV_NEIGHBOURS; i++) {
+		csp_dv_neighbour_t * n = &dv_neighbours[i];
+		if (n->iface == iface && n->node == packet->id.src) {
+			neighbour = n;
+			break;
+		}
+		if (n->iface == NULL && neighbour == NULL)
+			neighbour = n;
+	}
+
+	if (neighbour == NULL) {
+		csp_debug(CSP_WARN, "Routing daemon: no room for neighbour %u\r\n", packet->id.src);
+		return 0;
+	}
+
+	neighbour->heard = csp_get_ms();
+
+	if (neighbour->iface == iface && memcmp(neighbour->cost, advert->cost, sizeof(neighbour->cost)) == 0)
+		return 0;
+
+	if (neighbour->iface == NULL)
+		csp_debug(CSP_INFO, "Routing daemon: neighbour %u on %s\r\n", packet->id.src, input->ifc->name);
+
+	neighbour->iface = iface;
+	neighbour->node = packet->id.src;
+	memcpy(neighbour->cost, advert->cost, sizeof(neighbour->cost));
+
+	return 1;
+
+}
+
+/* Drop neighbours not heard from, return 1 if any was dropped */
+static int csp_dv_expire(uint32_t now) {
+
+	int i, expired = 0;
+
+	for (i = 0; i < CSP_DV_NEIGHBOURS; i++) {
+		csp_dv_neighbour_t * n = &dv_neighbours[i];
+		if (n->iface != NULL && now - n->heard > CSP_DV_TIMEOUT) {
+			csp_debug(CSP_INFO, "Routing daemon: lost neighbour %u on %s\r\n", n->node, n->iface->ifc->name);
+			n->iface = NULL;
+			expired = 1;
+		}
+	}
+
+	return expired;
+
+}
+
+/* Choose the best neighbour for each node and set the routes, return 1 if any cost changed */
+static int csp_dv_update_routes(void) {
+
+	int node, i, changed = 0;
+
+	for (node = 0; node <= CSP_ID_HOST_MAX; node++) {
+
+		if (node == my_address || node == CSP_BROADCAST_ADDR)
+			continue;
+
+		csp_dv_route_t * route = &dv_routes[node];
+		csp_dv_neighbour_t * best = NULL;
+		unsigned int best_cost = CSP_DV_INFINITY;
+
+		for (i = 0; i < CSP_DV_NEIGHBOURS; i++) {
+			csp_dv_neighbour_t * n = &dv_neighbours[i];
+			if (n->iface == NULL)
+				continue;
+
+			unsigned int cost = n->iface->cost + ((n->node == node) ? 0 : n->cost[node]);
+			if (cost >= CSP_DV_INFINITY)
+				continue;
+
+			/* Stay with the current next hop unless another one is cheaper */
+			int current = (n->iface->ifc == route->ifc && n->node == route->mac);
+			if (cost < best_cost || (cost == best_cost && current)) {
+				best = n;
+				best_cost = cost;
+			}
+		}
+
+		csp_iface_t * ifc = best ? best->iface->ifc : NULL;
+		uint8_t mac = best ? best->node : 0;
+
+		if (ifc != route->ifc || mac != route->mac) {
+			if (csp_route_set_dynamic(node, ifc, mac) != CSP_ERR_NONE)
+				continue;
+			route->ifc = ifc;
+			route->mac = mac;
+		}
+
+		if (route->cost != best_cost) {
+			route->cost = best_cost;
+			changed = 1;
+		}
+
+	}
+
+	return changed;
+
+}
+
+/* Broadcast the cost to every node on each interface */
+static void csp_dv_advertise(void) {
+
+	int i, node, count = __atomic_load_n(&dv_iface_count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++) {
+		csp_iface_t * ifc = dv_ifaces[i].ifc;
+
+		csp_packet_t * packet = csp_buffer_get(sizeof(struct csp_dv_advert));
+		if (packet == NULL) {
+			csp_debug(CSP_WARN, "Routing daemon: no buffer for advert\r\n");
+			return;
+		}
+
+		struct csp_dv_advert * advert = (struct csp_dv_advert *) packet->data;
+		advert->version = CSP_DV_VERSION;
+
+		/* Poison routes through the interface itself, so they are not learnt back */
+		for (node = 0; node <= CSP_ID_HOST_MAX; node++) {
+			csp_dv_route_t * route = &dv_routes[node];
+			if (route->ifc == NULL || route->ifc == ifc)
+				advert->cost[node] = CSP_DV_INFINITY;
+			else
+				advert->cost[node] = route->cost;
+		}
+		advert->cost[my_address] = 0;
+		packet->length = sizeof(*advert);
+
+		csp_id_t id = {.ext = 0};
+		id.pri = CSP_PRIO_HIGH;
+		id.src = my_address;
+		id.dst = CSP_BROADCAST_ADDR;
+		id.dport = CSP_DV;
+		id.sport = CSP_DV;
+		if (csp_dv_get_opts() & CSP_SO_HMACREQ)
+			id.flags = CSP_FHMAC;
+
+		if (csp_send_direct_iface(id, packet, ifc, 0) != CSP_ERR_NONE)
+			csp_buffer_free(packet);
+	}
+
+}
+
+#ifndef CSP_WINDOWS
+static csp_thread_return_t csp_dv_task(__attribute__ ((unused)) void * pvParameters) {
+#else
+static csp_thread_return_t __stdcall csp_dv_task(__attribute__ ((unused)) void * pvParameters) {
+#endif
+
+	csp_dv_input_t input;
+	uint32_t next = csp_get_ms();
+	uint32_t last = next - CSP_DV_TRIGGER_GAP;
+	int pending = 0;
+
+	if (!dv_queue) {
+		csp_debug(CSP_ERROR, "Routing daemon not initialized\r\n");
+		csp_thread_exit();
+	}
+
+	while (1) {
+
+		/* Sleep until the next periodic advert, or until a triggered one may be sent */
+		uint32_t now = csp_get_ms();
+		int32_t wait = (int32_t) (next - now);
+		if (pending && (int32_t) (last + CSP_DV_TRIGGER_GAP - now) < wait)
+			wait = (int32_t) (last + CSP_DV_TRIGGER_GAP - now);
+		if (wait < 0)
+			wait = 0;
+
+		int changed = 0;
+		if (csp_queue_dequeue(dv_queue, &input, wait) == CSP_QUEUE_OK) {
+			changed = csp_dv_receive(&input);
+			csp_buffer_free(input.packet);
+		}
+
+		now = csp_get_ms();
+		int periodic = ((int32_t) (now - next) >= 0);
+
+		if (periodic) {
+			csp_dv_link_costs();
+			changed |= csp_dv_expire(now);
+			next = now + CSP_DV_INTERVAL;
+		}
+
+		if ((changed || periodic) && csp_dv_update_routes())
+			pending = 1;
+
+		if (periodic || (pending && now - last >= CSP_DV_TRIGGER_GAP)) {
+			csp_dv_advertise();
+			last = now;
+			pending = 0;
+		}
+
+	}
+
+}
+
+int csp_dv_start(unsigned int task_stack_size, unsigned int priority) {
+
+	if (dv_queue != NULL)
+		return CSP_ERR_ALREADY;
+
+	csp_queue_handle_t queue = csp_queue_create(CSP_DV_QUEUE_LENGTH, sizeof(csp_dv_input_t));
+	if (queue == NULL)
+		return CSP_ERR_NOMEM;
+
+	/* The router hands adverts to the daemon once the queue is set */
+	dv_queue = queue;
+
+	if (csp_thread_create(csp_dv_task, (signed char *) "DV", task_stack_size, NULL, priority, &handle_dv) != 0) {
+		csp_debug(CSP_ERROR, "Failed to start routing daemon task\r\n");
+		dv_queue = NULL;
+		csp_queue_remove(queue);
+		return CSP_ERR_NOMEM;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+#ifdef CSP_DEBUG
+void csp_dv_print_table(void) {
+
+	int i, count = __atomic_load_n(&dv_iface_count, __ATOMIC_ACQUIRE);
+	uint32_t now = csp_get_ms();
+
+	for (i = 0; i < count; i++)
+		printf("Link: %s\tcost %u loss %u/1000\r\n", dv_ifaces[i].ifc->name,
+				dv_ifaces[i].cost, dv_ifaces[i].loss);
+
+	for (i = 0; i < CSP_DV_NEIGHBOURS; i++)
+		if (dv_neighbours[i].iface != NULL)
+			printf("Neighbour: %u on %s\theard %"PRIu32" ms ago\r\n", dv_neighbours[i].node,
+					dv_neighbours[i].iface->ifc->name, now - dv_neighbours[i].heard);
+
+	for (i = 0; i <= CSP_ID_HOST_MAX; i++)
+		if (dv_routes[i].ifc != NULL)
+			printf("Node: %u\tcost %u via %u on %s\r\n", i, dv_routes[i].cost,
+					dv_routes[i].mac, dv_routes[i].ifc->name);
+
+}
+#endif
+
+#endif // CSP_USE_DV
@@ -0,0 +1,133 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_interface.h>
+
+#ifdef CSP_EXT_HEADER
+
+/* Field offsets of the 32-bit header */
+#define LEGACY_SPORT_SHIFT	(CSP_ID_FLAGS_SIZE)
+#define LEGACY_DPORT_SHIFT	(LEGACY_SPORT_SHIFT + CSP_LEGACY_PORT_SIZE)
+#define LEGACY_DST_SHIFT	(LEGACY_DPORT_SHIFT + CSP_LEGACY_PORT_SIZE)
+#define LEGACY_SRC_SHIFT	(LEGACY_DST_SHIFT + CSP_LEGACY_HOST_SIZE)
+#define LEGACY_PRIO_SHIFT	(LEGACY_SRC_SHIFT + CSP_LEGACY_HOST_SIZE)
+
+#define LEGACY_FIELD(v, shift, size)	(((v) >> (shift)) & ((1 << (size)) - 1))
+
+/* Broadcasts use the highest address of each header, multicast groups are not translated */
+static int csp_id_broadcast(csp_id_t id) {
+
+	return (id.dst == CSP_BROADCAST_ADDR) && !(id.flags & CSP_FMCAST);
+
+}
+
+#endif
+
+int csp_id_fits(csp_id_t id, uint8_t ext_header) {
+
+#ifdef CSP_EXT_HEADER
+	if (ext_header)
+		return 1;
+
+	if (id.src >= CSP_LEGACY_HOST_MAX || id.sport > CSP_LEGACY_PORT_MAX || id.dport > CSP_LEGACY_PORT_MAX)
+		return 0;
+
+	if (id.flags & CSP_FMCAST)
+		return id.dst <= CSP_LEGACY_HOST_MAX;
+
+	return (id.dst < CSP_LEGACY_HOST_MAX) || csp_id_broadcast(id);
+#else
+	return 1;
+#endif
+
+}
+
+int csp_id_encode(csp_id_t id, uint8_t * buf, uint8_t ext_header) {
+
+	uint32_t legacy;
+
+#ifdef CSP_EXT_HEADER
+	if (ext_header) {
+		int i;
+		for (i = 0; i < CSP_HEADER_LENGTH; i++)
+			buf[i] = (uint8_t) (id.ext >> (8 * (CSP_HEADER_LENGTH - 1 - i)));
+		return CSP_HEADER_LENGTH;
+	}
+
+	if (!csp_id_fits(id, 0))
+		return CSP_ERR_INVAL;
+
+	legacy = ((uint32_t) id.pri << LEGACY_PRIO_SHIFT)
+			| ((uint32_t) id.src << LEGACY_SRC_SHIFT)
+			| ((uint32_t) (csp_id_broadcast(id) ? CSP_LEGACY_HOST_MAX : id.dst) << LEGACY_DST_SHIFT)
+			| ((uint32_t) id.dport << LEGACY_DPORT_SHIFT)
+			| ((uint32_t) id.sport << LEGACY_SPORT_SHIFT)
+			| id.flags;
+#else
+	legacy = id.ext;
+#endif
+
+	legacy = csp_hton32(legacy);
+	memcpy(buf, &legacy, sizeof(legacy));
+
+	return CSP_LEGACY_HEADER_LENGTH;
+
+}
+
+csp_id_t csp_id_decode(const uint8_t * buf, uint8_t ext_header) {
+
+	csp_id_t id;
+	uint32_t legacy;
+
+#ifdef CSP_EXT_HEADER
+	int i;
+	id.ext = 0;
+	if (ext_header) {
+		for (i = 0; i < CSP_HEADER_LENGTH; i++)
+			id.ext = (id.ext << 8) | buf[i];
+		return id;
+	}
+#endif
+
+	memcpy(&legacy, buf, sizeof(legacy));
+	legacy = csp_ntoh32(legacy);
+
+#ifdef CSP_EXT_HEADER
+	id.pri = LEGACY_FIELD(legacy, LEGACY_PRIO_SHIFT, CSP_ID_PRIO_SIZE);
+	id.src = LEGACY_FIELD(legacy, LEGACY_SRC_SHIFT, CSP_LEGACY_HOST_SIZE);
+	id.dst = LEGACY_FIELD(legacy, LEGACY_DST_SHIFT, CSP_LEGACY_HOST_SIZE);
+	id.dport = LEGACY_FIELD(legacy, LEGACY_DPORT_SHIFT, CSP_LEGACY_PORT_SIZE);
+	id.sport = LEGACY_FIELD(legacy, LEGACY_SPORT_SHIFT, CSP_LEGACY_PORT_SIZE);
+	id.flags = LEGACY_FIELD(legacy, 0, CSP_ID_FLAGS_SIZE);
+	if (id.dst == CSP_LEGACY_HOST_MAX && !(id.flags & CSP_FMCAST))
+		id.dst = CSP_BROADCAST_ADDR;
+#else
+	id.ext = legacy;
+#endif
+
+	return id;
+
+}
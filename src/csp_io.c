@@ -27,6 +27,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/csp.h>
 #include <csp/csp_error.h>
 #include <csp/csp_endian.h>
+#include <csp/csp_interface.h>
+#include <csp/csp_transfer.h>
+#include <csp/csp_mcast.h>
 #include <csp/interfaces/csp_if_lo.h>
 
 #include "arch/csp_thread.h"
@@ -37,7 +40,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "crypto/csp_hmac.h"
 #include "crypto/csp_xtea.h"
+#include "crypto/csp_aead.h"
 #include "csp_crc32.h"
+#include "csp_security.h"
 
 #include "csp_io.h"
 #include "csp_port.h"
@@ -98,6 +103,22 @@ int csp_init(unsigned char address) {
 	/* Generate CRC32 table */
 #ifdef CSP_USE_CRC32
 	csp_crc32_gentab();
+
+	ret = csp_transfer_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+#endif
+
+#ifdef CSP_USE_AEAD
+	ret = csp_aead_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+#endif
+
+#ifdef CSP_USE_MCAST
+	ret = csp_mcast_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
 #endif
 
 	/* Register loopback route */
@@ -144,9 +165,16 @@ csp_socket_t * csp_socket(uint32_t opts) {
 		return NULL;
 	} 
 #endif
+
+#ifndef CSP_USE_AEAD
+	if (opts & CSP_SO_AEADREQ) {
+		csp_debug(CSP_ERROR, "Attempt to create socket that requires AEAD, but CSP was compiled without AEAD support\r\n");
+		return NULL;
+	}
+#endif
 	
 	/* Drop packet if reserved flags are set */
-	if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_CONN_LESS)) {
+	if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_AEADREQ | CSP_SO_CONN_LESS | CSP_SO_REUSEPORT)) {
 		csp_debug(CSP_ERROR, "Invalid socket option\r\n");
 		return NULL;
 	}
@@ -187,6 +215,34 @@ csp_conn_t * csp_accept(csp_socket_t * sock, uint32_t timeout) {
 
 }
 
+/**
+ * Check if a packet read from a connection is dropped by AQM
+ * @param conn connection the packet was read from
+ * @param packet packet read, or NULL
+ * @param rxq RX queue the packet was read from
+ * @return 1 if the packet was dropped and freed, 0 otherwise
+ */
+static int csp_read_early_drop(csp_conn_t * conn, csp_packet_t * packet, int rxq) {
+
+#ifdef CSP_USE_AQM
+	/* Data acknowledged by RDP must be delivered */
+	if (packet == NULL || rxq >= CSP_RX_QUEUES || (conn->idin.flags & CSP_FRDP))
+		return 0;
+
+	if (csp_qos_codel_drop(&conn->rx_codel[rxq], packet, csp_queue_size(conn->rx_queue[rxq]))) {
+		csp_buffer_free(packet);
+		return 1;
+	}
+#else
+	(void) conn;
+	(void) packet;
+	(void) rxq;
+#endif
+
+	return 0;
+
+}
+
 csp_packet_t * csp_read(csp_conn_t * conn, uint32_t timeout) {
 
 	csp_packet_t * packet = NULL;
@@ -194,18 +250,25 @@ csp_packet_t * csp_read(csp_conn_t * conn, uint32_t timeout) {
 	if (conn == NULL || conn->state != CONN_OPEN)
 		return NULL;
 
+	int rxq = 0;
 #ifdef CSP_USE_QOS
-	int prio, event;
-	if (csp_queue_dequeue(conn->rx_event, &event, timeout) != CSP_QUEUE_OK)
-		return NULL;
+	int event;
+#endif
+
+	do {
+#ifdef CSP_USE_QOS
+		if (csp_queue_dequeue(conn->rx_event, &event, timeout) != CSP_QUEUE_OK)
+			return NULL;
 
-	for (prio = 0; prio < CSP_RX_QUEUES; prio++)
-		if (csp_queue_dequeue(conn->rx_queue[prio], &packet, 0) == CSP_QUEUE_OK)
-			break;
+		packet = NULL;
+		for (rxq = 0; rxq < CSP_RX_QUEUES; rxq++)
+			if (csp_queue_dequeue(conn->rx_queue[rxq], &packet, 0) == CSP_QUEUE_OK)
+				break;
 #else
-	if (csp_queue_dequeue(conn->rx_queue[0], &packet, timeout) != CSP_QUEUE_OK)
-		return NULL;
+		if (csp_queue_dequeue(conn->rx_queue[0], &packet, timeout) != CSP_QUEUE_OK)
+			return NULL;
 #endif
+	} while (csp_read_early_drop(conn, packet, rxq));
 
 #ifdef CSP_USE_RDP
 	/* Packet read could trigger ACK transmission */
@@ -221,17 +284,36 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 
 	if (packet == NULL) {
 		csp_debug(CSP_ERROR, "csp_send_direct called with NULL packet\r\n");
-		goto err;
+		return CSP_ERR_TX;
 	}
 
-	csp_route_t * ifout = csp_route_if(idout.dst);
+	csp_iface_t * ifout = csp_route_if_flow(idout, NULL);
+
+	if (ifout == NULL) {
+		csp_debug(CSP_ERROR, "No route to host: %u\r\n", idout.dst);
+		return CSP_ERR_TX;
+	}
 
-	if ((ifout == NULL) || (ifout->interface == NULL) || (ifout->interface->nexthop == NULL)) {
-		csp_debug(CSP_ERROR, "No route to host: %#08x\r\n", idout.ext);
+	return csp_send_direct_iface(idout, packet, ifout, timeout);
+
+}
+
+int csp_send_direct_iface(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout, uint32_t timeout) {
+
+	if ((packet == NULL) || (ifout == NULL) || (ifout->nexthop == NULL)) {
+		csp_debug(CSP_ERROR, "Invalid call to csp_send_direct_iface\r\n");
 		goto err;
 	}
 
-	csp_debug(CSP_PACKET, "Sending packet size %u from %u to %u port %u via interface %s\r\n", packet->length, idout.src, idout.dst, idout.dport, ifout->interface->name);
+	csp_debug(CSP_PACKET, "Sending packet size %u from %u to %u port %u via interface %s\r\n", packet->length, idout.src, idout.dst, idout.dport, ifout->name);
+
+#ifdef CSP_EXT_HEADER
+	/* Interfaces with the 32-bit header only reach the low addresses */
+	if (!csp_id_fits(idout, ifout->ext_header)) {
+		csp_debug(CSP_WARN, "Header does not fit interface %s\r\n", ifout->name);
+		goto tx_err;
+	}
+#endif
 	
 #ifdef CSP_USE_PROMISC
 	/* Loopback traffic is added to promisc queue by the router */
@@ -243,11 +325,24 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 
 	/* Only encrypt packets from the current node */
 	if (idout.src == my_address) {
+		int fused = 0;
+
+#ifdef CSP_SECURITY_FUSED
+		/* Authenticate, checksum and encrypt in a single pass */
+		if (csp_security_fused(idout.flags)) {
+			if (csp_security_append(packet, idout.flags, idout.dst) != CSP_ERR_NONE) {
+				csp_debug(CSP_WARN, "Security append failed!\r\n");
+				goto tx_err;
+			}
+			fused = 1;
+		}
+#endif
+
 		/* Append HMAC */
-		if (idout.flags & CSP_FHMAC) {
+		if (!fused && (idout.flags & CSP_FHMAC)) {
 #ifdef CSP_USE_HMAC
 			/* Calculate and add HMAC */
-			if (csp_hmac_append(packet) != 0) {
+			if (csp_hmac_append(packet, idout.dst) != 0) {
 				/* HMAC append failed */
 				csp_debug(CSP_WARN, "HMAC append failed!\r\n");
 				goto tx_err;
@@ -259,7 +354,7 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 		}
 
 		/* Append CRC32 */
-		if (idout.flags & CSP_FCRC32) {
+		if (!fused && (idout.flags & CSP_FCRC32)) {
 #ifdef CSP_USE_CRC32
 			/* Calculate and add CRC32 */
 			if (csp_crc32_append(packet) != 0) {
@@ -273,7 +368,7 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 #endif
 		}
 
-		if (idout.flags & CSP_FXTEA) {
+		if (!fused && (idout.flags & CSP_FXTEA)) {
 #ifdef CSP_USE_XTEA
 			/* Create nonce */
 			uint32_t nonce, nonce_n;
@@ -285,7 +380,7 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 			uint32_t iv[2] = {nonce, 1};
 
 			/* Encrypt data */
-			if (csp_xtea_encrypt(packet->data, packet->length, iv) != 0) {
+			if (csp_xtea_encrypt(packet->data, packet->length, iv, idout.dst) != 0) {
 				/* Encryption failed */
 				csp_debug(CSP_WARN, "Encryption failed! Discarding packet\r\n");
 				goto tx_err;
@@ -295,6 +390,19 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 #else
 			csp_debug(CSP_WARN, "Attempt to send XTEA encrypted packet, but CSP was compiled without XTEA support. Discarding packet\r\n");
 			goto tx_err;
+#endif
+		}
+
+		/* Encrypt and authenticate, last so it covers all other trailers */
+		if (idout.flags & CSP_FAEAD) {
+#ifdef CSP_USE_AEAD
+			if (csp_aead_encrypt(packet, idout) != 0) {
+				csp_debug(CSP_WARN, "AEAD encryption failed! Discarding packet\r\n");
+				goto tx_err;
+			}
+#else
+			csp_debug(CSP_WARN, "Attempt to send AEAD encrypted packet, but CSP was compiled without AEAD support. Discarding packet\r\n");
+			goto tx_err;
 #endif
 		}
 	}
@@ -304,20 +412,30 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 
 	/* Store length before passing to interface */
 	uint16_t bytes = packet->length;
-	uint16_t mtu = ifout->interface->mtu;
+	uint16_t mtu = ifout->mtu;
 
 	if (mtu > 0 && bytes > mtu)
 		goto tx_err;
 
-	if ((*ifout->interface->nexthop)(packet, timeout) != 1)
+	/* Leave the transmission to the interface task, if it has one */
+	if (ifout->tx_queue != NULL) {
+		if (csp_route_tx_enqueue(ifout, packet, timeout) != CSP_ERR_NONE) {
+			csp_debug(CSP_WARN, "Transmit queue of %s is FULL. Dropping packet.\r\n", ifout->name);
+			ifout->drop++;
+			goto err;
+		}
+		return CSP_ERR_NONE;
+	}
+
+	if ((*ifout->nexthop)(packet, timeout) != 1)
 		goto tx_err;
 
-	ifout->interface->tx++;
-	ifout->interface->txbytes += bytes;
+	ifout->tx++;
+	ifout->txbytes += bytes;
 	return CSP_ERR_NONE;
 
 tx_err:
-	ifout->interface->tx_error++;
+	ifout->tx_error++;
 err:
 	return CSP_ERR_TX;
 
@@ -334,13 +452,18 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 #ifdef CSP_USE_RDP
 	if (conn->idout.flags & CSP_FRDP) {
-		if (csp_rdp_send(conn, packet, timeout) != CSP_ERR_NONE) {
-			csp_route_t * ifout = csp_route_if(conn->idout.dst);
-			if (ifout != NULL && ifout->interface != NULL)
-				ifout->interface->tx_error++;
+		uint16_t ack_nr;
+		if (csp_rdp_send(conn, packet, timeout, &ack_nr) != CSP_ERR_NONE) {
+			csp_iface_t * ifout = csp_route_if_flow(conn->idout, NULL);
+			if (ifout != NULL)
+				ifout->tx_error++;
 			csp_debug(CSP_WARN, "RPD send failed\r\n!");
 			return 0;
 		}
+		ret = csp_send_direct(conn->idout, packet, timeout);
+		if (ret == CSP_ERR_NONE)
+			csp_rdp_sent(conn, ack_nr);
+		return (ret == CSP_ERR_NONE) ? 1 : 0;
 	}
 #endif
 
@@ -350,6 +473,29 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 }
 
+int csp_send_rdp(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
+
+#ifdef CSP_USE_RDP
+	if (conn->state != CONN_OPEN)
+		return CSP_ERR_RESET;
+
+	uint16_t ack_nr;
+	int ret = csp_rdp_send(conn, packet, timeout, &ack_nr);
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+	if (csp_send_direct(conn->idout, packet, timeout) != CSP_ERR_NONE)
+		csp_buffer_free(packet);
+	else
+		csp_rdp_sent(conn, ack_nr);
+
+	return CSP_ERR_NONE;
+#else
+	return CSP_ERR_INVAL;
+#endif
+
+}
+
 int csp_transaction_persistent(csp_conn_t * conn, uint32_t timeout, void * outbuf, int outlen, void * inbuf, int inlen) {
 
 	int size = (inlen > outlen) ? inlen : outlen;
@@ -392,11 +538,50 @@ int csp_transaction_persistent(csp_conn_t * conn, uint32_t timeout, void * outbu
 
 int csp_transaction(uint8_t prio, uint8_t dest, uint8_t port, uint32_t timeout, void * outbuf, int outlen, void * inbuf, int inlen) {
 
-	csp_conn_t * conn = csp_connect(prio, dest, port, 0, 0);
+	return csp_transaction2(prio, dest, port, timeout, outbuf, outlen, inbuf, inlen, 0);
+
+}
+
+int csp_transaction2(uint8_t prio, uint8_t dest, uint8_t port, uint32_t timeout, void * outbuf, int outlen, void * inbuf, int inlen, uint32_t opts) {
+
+	csp_conn_t * conn = NULL;
+	int status;
+
+#ifdef CSP_USE_RDP
+	/* Reuse an idle RDP connection from an earlier transaction */
+	if (opts & CSP_O_RDP)
+		conn = csp_conn_idle_get(prio, dest, port, opts);
+
+	if (conn != NULL) {
+		status = csp_transaction_persistent(conn, timeout, outbuf, outlen, inbuf, inlen);
+		if (status != 0) {
+			csp_conn_idle_put(conn);
+			return status;
+		}
+
+		/* The peer may have closed the connection just before it was reused,
+		 * in which case the request was not processed and is sent again */
+		int reset = (conn->rdp.state != RDP_OPEN);
+		csp_close(conn);
+		if (!reset)
+			return status;
+		csp_debug(CSP_WARN, "Idle connection to %u was reset, reconnecting\r\n", dest);
+	}
+#endif
+
+	conn = csp_connect(prio, dest, port, timeout, opts);
 	if (conn == NULL)
 		return 0;
 
-	int status = csp_transaction_persistent(conn, timeout, outbuf, outlen, inbuf, inlen);
+	status = csp_transaction_persistent(conn, timeout, outbuf, outlen, inbuf, inlen);
+
+#ifdef CSP_USE_RDP
+	/* Keep RDP connections open for the next transaction */
+	if ((opts & CSP_O_RDP) && status != 0) {
+		csp_conn_idle_put(conn);
+		return status;
+	}
+#endif
 
 	csp_close(conn);
 
@@ -452,6 +637,15 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
 #endif
 	}
 
+	if (opts & CSP_O_AEAD) {
+#ifdef CSP_USE_AEAD
+		packet->id.flags |= CSP_FAEAD;
+#else
+		csp_debug(CSP_ERROR, "Attempt to create AEAD encrypted packet, but CSP was compiled without AEAD support\r\n");
+		return -1;
+#endif
+	}
+
 	packet->id.dst = dest;
 	packet->id.dport = dport;
 	packet->id.src = my_address;
@@ -39,6 +39,27 @@ extern "C" {
  */
 int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout);
 
+/**
+ * As csp_send_direct, but transmit on an interface instead of the routed one
+ * @param idout 32bit CSP identifier
+ * @param packet pointer to packet
+ * @param ifout interface to transmit on
+ * @param timeout a timeout to wait for TX to complete
+ * @return CSP_ERR_NONE on success. You MUST free the frame yourself if the transmission was not successful.
+ */
+int csp_send_direct_iface(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout, uint32_t timeout);
+
+/**
+ * Queue a segment in the RDP window of a connection and transmit it. Once RDP
+ * has accepted the segment it is retransmitted until acknowledged, so a failed
+ * transmission only loses the first copy and the packet is consumed anyway.
+ * @param conn open RDP connection
+ * @param packet pointer to packet
+ * @param timeout time to wait for room in the window
+ * @return CSP_ERR_NONE if the packet was taken, otherwise an error and the caller keeps the packet
+ */
+int csp_send_rdp(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
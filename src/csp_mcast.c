@@ -0,0 +1,290 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_mcast.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+#include "arch/csp_queue.h"
+#include "arch/csp_semaphore.h"
+
+#include "csp_conn.h"
+#include "csp_io.h"
+#include "csp_route.h"
+
+#ifdef CSP_USE_MCAST
+
+#ifndef CSP_MCAST_MEMBERS
+#define CSP_MCAST_MEMBERS		8
+#endif
+
+/* Local socket or interface with members behind it, and the groups it belongs to */
+typedef struct {
+	csp_socket_t * socket;
+	csp_iface_t * ifc;
+	uint32_t groups;			// Bit per group, 0 if the entry is unused
+} csp_mcast_member_t;
+
+static csp_mcast_member_t mcast_members[CSP_MCAST_MEMBERS];
+static csp_mutex_t mcast_lock;
+
+int csp_mcast_init(void) {
+
+	memset(mcast_members, 0, sizeof(mcast_members));
+
+	if (csp_mutex_create(&mcast_lock) != CSP_MUTEX_OK) {
+		csp_debug(CSP_ERROR, "Failed to create multicast lock\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+/* Add or remove group membership of a socket or interface */
+static int csp_mcast_set(csp_socket_t * socket, csp_iface_t * ifc, uint8_t group, int join) {
+
+	int i, ret = CSP_ERR_NONE;
+	csp_mcast_member_t * member = NULL, * unused = NULL;
+
+	if (group >= CSP_MCAST_GROUPS)
+		return CSP_ERR_INVAL;
+
+	if (csp_mutex_lock(&mcast_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	for (i = 0; i < CSP_MCAST_MEMBERS; i++) {
+		csp_mcast_member_t * m = &mcast_members[i];
+		if (m->groups == 0) {
+			if (unused == NULL)
+				unused = m;
+		} else if (m->socket == socket && m->ifc == ifc) {
+			member = m;
+		}
+	}
+
+	if (join) {
+		if (member == NULL && unused == NULL) {
+			csp_debug(CSP_ERROR, "Failed to join multicast group %u: table full\r\n", group);
+			ret = CSP_ERR_NOMEM;
+		} else {
+			if (member == NULL) {
+				member = unused;
+				member->socket = socket;
+				member->ifc = ifc;
+			}
+			member->groups |= (uint32_t) 1 << group;
+		}
+	} else {
+		if (member == NULL || !(member->groups & ((uint32_t) 1 << group)))
+			ret = CSP_ERR_INVAL;
+		else
+			member->groups &= ~((uint32_t) 1 << group);
+	}
+
+	csp_mutex_unlock(&mcast_lock);
+
+	return ret;
+
+}
+
+int csp_mcast_join(csp_socket_t * socket, uint8_t group) {
+
+	if (socket == NULL || !(socket->opts & CSP_SO_CONN_LESS))
+		return CSP_ERR_INVAL;
+
+	if (socket->opts & (CSP_SO_HMACREQ | CSP_SO_XTEAREQ | CSP_SO_CRC32REQ | CSP_SO_AEADREQ))
+		return CSP_ERR_INVAL;
+
+	return csp_mcast_set(socket, NULL, group, 1);
+
+}
+
+int csp_mcast_leave(csp_socket_t * socket, uint8_t group) {
+
+	if (socket == NULL)
+		return CSP_ERR_INVAL;
+
+	return csp_mcast_set(socket, NULL, group, 0);
+
+}
+
+void csp_mcast_leave_all(csp_socket_t * socket) {
+
+	int i;
+
+	if (csp_mutex_lock(&mcast_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return;
+
+	for (i = 0; i < CSP_MCAST_MEMBERS; i++)
+		if (mcast_members[i].socket == socket)
+			mcast_members[i].groups = 0;
+
+	csp_mutex_unlock(&mcast_lock);
+
+}
+
+int csp_mcast_add_iface(uint8_t group, csp_iface_t * ifc) {
+
+	/* Local members join with a socket, the loopback would deliver twice */
+	if (ifc == NULL || ifc == &csp_if_lo)
+		return CSP_ERR_INVAL;
+
+	return csp_mcast_set(NULL, ifc, group, 1);
+
+}
+
+int csp_mcast_remove_iface(uint8_t group, csp_iface_t * ifc) {
+
+	if (ifc == NULL)
+		return CSP_ERR_INVAL;
+
+	return csp_mcast_set(NULL, ifc, group, 0);
+
+}
+
+/* Hand a reference to the packet to each member of its group, except the input interface */
+static void csp_mcast_fanout(csp_packet_t * packet, csp_iface_t * input, uint32_t timeout) {
+
+	csp_mcast_member_t members[CSP_MCAST_MEMBERS];
+	uint32_t group = (uint32_t) 1 << packet->id.dst;
+	int i, count = 0;
+
+	/* Take a copy of the members, so sending is done without the lock */
+	if (csp_mutex_lock(&mcast_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK) {
+		csp_buffer_free(packet);
+		return;
+	}
+	for (i = 0; i < CSP_MCAST_MEMBERS; i++)
+		if (mcast_members[i].groups & group)
+			members[count++] = mcast_members[i];
+	csp_mutex_unlock(&mcast_lock);
+
+	for (i = 0; i < count; i++) {
+
+		/* Local socket, which gets the shared buffer */
+		if (members[i].socket != NULL) {
+			csp_buffer_refc_inc(packet);
+			if (csp_queue_enqueue(members[i].socket->socket, &packet, 0) != CSP_QUEUE_OK) {
+				csp_debug(CSP_WARN, "Multicast socket queue full\r\n");
+				csp_buffer_free(packet);
+			}
+			continue;
+		}
+
+		csp_iface_t * ifc = members[i].ifc;
+		if (ifc == input)
+			continue;
+
+		/* Interfaces that modify packets on transmit need their own copy */
+		csp_packet_t * copy;
+		if (ifc->tx_shared) {
+			csp_buffer_refc_inc(packet);
+			copy = packet;
+		} else {
+			copy = csp_buffer_clone(packet);
+			if (copy == NULL) {
+				ifc->drop++;
+				continue;
+			}
+		}
+
+		if (csp_send_direct_iface(packet->id, copy, ifc, timeout) != CSP_ERR_NONE)
+			csp_buffer_free(copy);
+
+	}
+
+	/* Release the reference of the caller */
+	csp_buffer_free(packet);
+
+}
+
+void csp_mcast_input(csp_packet_t * packet, csp_iface_t * ifc) {
+
+	/* A shared buffer cannot be verified or decrypted in place */
+	if (packet->id.flags & (CSP_FHMAC | CSP_FXTEA | CSP_FCRC32 | CSP_FAEAD | CSP_FRDP)) {
+		csp_debug(CSP_WARN, "Multicast packet with security or RDP flags. Discarding packet\r\n");
+		csp_buffer_free(packet);
+		return;
+	}
+
+	/* Group addresses beyond the membership masks have no members */
+	if (packet->id.dst >= CSP_MCAST_GROUPS) {
+		csp_buffer_free(packet);
+		return;
+	}
+
+	/* Reverse path check */
+	if (csp_route_if(packet->id.src, NULL) != ifc) {
+		csp_buffer_free(packet);
+		return;
+	}
+
+	csp_mcast_fanout(packet, ifc, 0);
+
+}
+
+int csp_mcast_sendto(uint8_t prio, uint8_t group, uint8_t dport, uint8_t src_port, csp_packet_t * packet, uint32_t timeout) {
+
+	if (packet == NULL || group >= CSP_MCAST_GROUPS)
+		return -1;
+
+	packet->id.flags = CSP_FMCAST;
+	packet->id.dst = group;
+	packet->id.dport = dport;
+	packet->id.src = my_address;
+	packet->id.sport = src_port;
+	packet->id.pri = prio;
+
+	csp_mcast_fanout(packet, NULL, timeout);
+
+	return 0;
+
+}
+
+#ifdef CSP_DEBUG
+void csp_mcast_print_table(void) {
+
+	int i, group;
+
+	for (i = 0; i < CSP_MCAST_MEMBERS; i++) {
+		csp_mcast_member_t * m = &mcast_members[i];
+		if (m->groups == 0)
+			continue;
+		if (m->socket != NULL)
+			printf("Socket: %p\tgroups:", (void *) m->socket);
+		else
+			printf("Iface: %s\tgroups:", m->ifc->name);
+		for (group = 0; group < CSP_MCAST_GROUPS; group++)
+			if (m->groups & ((uint32_t) 1 << group))
+				printf(" %u", group);
+		printf("\r\n");
+	}
+
+}
+#endif
+
+#endif // CSP_USE_MCAST
@@ -33,21 +33,41 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "csp_port.h"
 #include "csp_conn.h"
 
-/* Allocation of ports */
-static csp_port_t ports[CSP_MAX_BIND_PORT + 2];
+/* Socket of each port, NULL if the port is not bound. Sockets sharing a port
+ * with CSP_SO_REUSEPORT are chained in a ring through port_next, and the
+ * entry points at the socket to get the next connection or packet. Entries
+ * are changed under port_lock, but a port with a single socket is looked up
+ * without it. */
+static csp_socket_t * ports[CSP_MAX_BIND_PORT + 2];
+static csp_mutex_t port_lock;
 
 csp_socket_t * csp_port_get_socket(unsigned int port) {
 
-	csp_socket_t * ret = NULL;
+	csp_socket_t * ret;
 
 	if (port > CSP_ANY)
 		return NULL;
 
 	/* Match dport to socket or local "catch all" port number */
-	if (ports[port].state == PORT_OPEN)
-		ret = ports[port].socket;
-	else if (ports[CSP_ANY].state == PORT_OPEN)
-		ret = ports[CSP_ANY].socket;
+	ret = __atomic_load_n(&ports[port], __ATOMIC_ACQUIRE);
+	if (ret == NULL) {
+		port = CSP_ANY;
+		ret = __atomic_load_n(&ports[port], __ATOMIC_ACQUIRE);
+	}
+
+	/* Only a shared port has a turn to advance */
+	if (ret == NULL || __atomic_load_n(&ret->port_next, __ATOMIC_ACQUIRE) == ret)
+		return ret;
+
+	if (csp_mutex_lock(&port_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return NULL;
+
+	/* Serve the sockets of a port in turn */
+	ret = ports[port];
+	if (ret != NULL)
+		__atomic_store_n(&ports[port], ret->port_next, __ATOMIC_RELEASE);
+
+	csp_mutex_unlock(&port_lock);
 
 	return ret;
 
@@ -55,7 +75,12 @@ csp_socket_t * csp_port_get_socket(unsigned int port) {
 
 int csp_port_init(void) {
 
-	memset(ports, PORT_CLOSED, sizeof(csp_port_t) * (CSP_MAX_BIND_PORT + 2));
+	memset(ports, 0, sizeof(ports));
+
+	if (csp_mutex_create(&port_lock) != CSP_MUTEX_OK) {
+		csp_debug(CSP_ERROR, "Failed to create port lock\r\n");
+		return CSP_ERR_NOMEM;
+	}
 
 	return CSP_ERR_NONE;
 
@@ -76,25 +101,77 @@ int csp_listen(csp_socket_t * socket, size_t conn_queue_length) {
 
 int csp_bind(csp_socket_t * socket, uint8_t port) {
 	
+	if (socket == NULL)
+		return CSP_ERR_INVAL;
+
 	if (port > CSP_ANY) {
 		csp_debug(CSP_ERROR, "Only ports from 0-%u (and CSP_ANY for default) are available for incoming ports\r\n", CSP_ANY);
 		return CSP_ERR_INVAL;
 	}
 
-	/* Check if port number is valid */
-	if (ports[port].state != PORT_CLOSED) {
+	if (csp_mutex_lock(&port_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	csp_socket_t * bound = ports[port];
+	int reuse = (socket->opts & CSP_SO_REUSEPORT) != 0;
+
+	/* Sockets share a port if all of them ask for it with the same options,
+	 * and a shared socket is in the ring of one port only */
+	if ((bound != NULL && (!reuse || bound->opts != socket->opts)) || (reuse && socket->port_next != NULL)) {
+		csp_mutex_unlock(&port_lock);
 		csp_debug(CSP_ERROR, "Port %d is already in use\r\n", port);
 		return CSP_ERR_USED;
 	}
 
 	csp_debug(CSP_INFO, "Binding socket %p to port %u\r\n", socket, port);
 
-	/* Save listener */
-	ports[port].socket = socket;
-	ports[port].state = PORT_OPEN;
+	/* Save listener, behind the other sockets of the port */
+	if (bound != NULL) {
+		socket->port_next = bound->port_next;
+		__atomic_store_n(&bound->port_next, socket, __ATOMIC_RELEASE);
+	} else {
+		socket->port_next = socket;
+		__atomic_store_n(&ports[port], socket, __ATOMIC_RELEASE);
+	}
+
+	csp_mutex_unlock(&port_lock);
 
 	return CSP_ERR_NONE;
 
 }
 
+void csp_port_unbind(csp_socket_t * socket) {
+
+	unsigned int port;
+
+	if (socket->port_next == NULL)
+		return;
+
+	if (csp_mutex_lock(&port_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return;
+
+	for (port = 0; port <= CSP_ANY; port++) {
+		csp_socket_t * prev = ports[port];
+		if (prev == NULL)
+			continue;
 
+		/* Find the socket before this one in the ring */
+		while (prev->port_next != socket && prev->port_next != ports[port])
+			prev = prev->port_next;
+		if (prev->port_next != socket)
+			continue;
+
+		if (prev == socket) {
+			__atomic_store_n(&ports[port], NULL, __ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n(&prev->port_next, socket->port_next, __ATOMIC_RELEASE);
+			if (ports[port] == socket)
+				__atomic_store_n(&ports[port], socket->port_next, __ATOMIC_RELEASE);
+		}
+	}
+
+	__atomic_store_n(&socket->port_next, NULL, __ATOMIC_RELEASE);
+
+	csp_mutex_unlock(&port_lock);
+
+}
@@ -29,25 +29,27 @@ extern "C" {
 
 #include <csp/csp.h>
 
-/** @brief Port states */
-typedef enum {
-	PORT_CLOSED = 0,
-	PORT_OPEN = 1,
-} csp_port_state_t;
-
-/** @brief Port struct */
-typedef struct {
-	csp_port_state_t state;		 // Port state
-	csp_socket_t * socket;		  // New connections are added to this socket's conn queue
-} csp_port_t;
-
 /**
  * Init ports array
  */
 int csp_port_init(void);
 
+/**
+ * Get the socket to receive a new connection or connection-less packet.
+ * Sockets sharing a port with CSP_SO_REUSEPORT take turns, so each call
+ * must be followed by a delivery to the returned socket, and a packet must
+ * not be looked up again once it has a socket.
+ * @param dport Destination port
+ * @return Socket bound to the port or to CSP_ANY, NULL if there is none
+ */
 csp_socket_t * csp_port_get_socket(unsigned int dport);
 
+/**
+ * Release the ports of a socket. This is called by csp_close.
+ * @param socket Socket to unbind
+ */
+void csp_port_unbind(csp_socket_t * socket);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,365 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Priority queues: strict priority for critical, deficit round robin for the rest */
+
+#include <stdint.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+
+#include "arch/csp_queue.h"
+#include "arch/csp_malloc.h"
+#include "arch/csp_time.h"
+
+#include "csp_qos.h"
+
+#ifdef CSP_USE_QOS
+/* Round robin weight of each priority class, CSP_PRIO_CRITICAL is not used */
+static uint8_t csp_qos_weight[CSP_ROUTE_FIFOS] = {0, 4, 2, 1};
+#endif
+
+int csp_qos_set_weight(uint8_t prio, uint8_t weight) {
+
+#ifdef CSP_USE_QOS
+	if (prio == CSP_PRIO_CRITICAL || prio >= CSP_ROUTE_FIFOS || weight == 0)
+		return CSP_ERR_INVAL;
+
+	csp_qos_weight[prio] = weight;
+	return CSP_ERR_NONE;
+#else
+	return CSP_ERR_NOTSUP;
+#endif
+
+}
+
+#ifdef CSP_USE_AQM
+/* The timestamp is placed in the last padding bytes */
+#define CSP_QOS_STAMP	(CSP_PADDING_BYTES - sizeof(uint32_t))
+
+void csp_qos_stamp(csp_packet_t * packet, CSP_BASE_TYPE * pxTaskWoken) {
+
+	uint32_t now = (pxTaskWoken == NULL) ? csp_get_ms() : csp_get_ms_isr();
+	memcpy(&packet->padding[CSP_QOS_STAMP], &now, sizeof(now));
+
+}
+
+/* Integer square root */
+static uint32_t csp_qos_sqrt(uint32_t x) {
+
+	uint32_t root = 0, bit = 1UL << 30;
+
+	while (bit > x)
+		bit >>= 2;
+
+	while (bit) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+
+}
+
+/* Time of the next drop, closer together the more packets have been dropped */
+static uint32_t csp_qos_control_law(uint32_t t, uint32_t count) {
+	return t + CSP_AQM_INTERVAL / csp_qos_sqrt(count);
+}
+
+int csp_qos_codel_drop(csp_qos_codel_t * codel, csp_packet_t * packet, int backlog) {
+
+	uint32_t now = csp_get_ms();
+	uint32_t stamp;
+	int ok_to_drop = 0;
+
+	memcpy(&stamp, &packet->padding[CSP_QOS_STAMP], sizeof(stamp));
+
+	/* Sojourn time must stay above target for a full interval, and a
+	 * packet is never dropped if it is the last one in the queue */
+	if ((int32_t) (now - stamp) < CSP_AQM_TARGET || backlog == 0) {
+		codel->first_above = 0;
+	} else if (codel->first_above == 0) {
+		codel->first_above = (now + CSP_AQM_INTERVAL) | 1;
+	} else if ((int32_t) (now - codel->first_above) >= 0) {
+		ok_to_drop = 1;
+	}
+
+	if (codel->dropping) {
+		if (!ok_to_drop) {
+			codel->dropping = 0;
+		} else if ((int32_t) (now - codel->drop_next) >= 0) {
+			codel->count++;
+			codel->drop_next = csp_qos_control_law(codel->drop_next, codel->count);
+			return 1;
+		}
+	} else if (ok_to_drop) {
+		/* Continue with the previous drop rate if dropping stopped recently */
+		if (codel->count > 2 && (int32_t) (now - codel->drop_next) < 8 * CSP_AQM_INTERVAL)
+			codel->count -= 2;
+		else
+			codel->count = 1;
+		codel->dropping = 1;
+		codel->drop_next = csp_qos_control_law(now, codel->count);
+		return 1;
+	}
+
+	return 0;
+
+}
+#endif
+
+int csp_qos_queue_init(csp_qos_queue_t * queue, int length, size_t item_size, csp_qos_packet_func_t packet, int aqm) {
+
+	int prio;
+
+	memset(queue, 0, sizeof(*queue));
+	queue->item_size = item_size;
+	queue->packet = packet;
+
+	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
+		queue->fifo[prio] = csp_queue_create(length, item_size);
+		if (!queue->fifo[prio])
+			goto err;
+	}
+
+#ifdef CSP_USE_QOS
+	/* Each fifo can hold length items, plus one taken as head */
+	queue->event = csp_queue_create(CSP_ROUTE_FIFOS * (length + 1), sizeof(int));
+	if (!queue->event)
+		goto err;
+
+	queue->head = csp_malloc(CSP_ROUTE_FIFOS * item_size);
+	if (!queue->head)
+		goto err;
+
+	queue->current = CSP_PRIO_CRITICAL + 1;
+#endif
+
+#ifdef CSP_USE_AQM
+	queue->aqm = aqm;
+#else
+	(void) aqm;
+#endif
+
+	return CSP_ERR_NONE;
+
+err:
+	csp_qos_queue_free(queue);
+	return CSP_ERR_NOMEM;
+
+}
+
+void csp_qos_queue_free(csp_qos_queue_t * queue) {
+
+	int prio;
+
+	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
+		if (queue->fifo[prio])
+			csp_queue_remove(queue->fifo[prio]);
+		queue->fifo[prio] = NULL;
+	}
+
+#ifdef CSP_USE_QOS
+	if (queue->event)
+		csp_queue_remove(queue->event);
+	queue->event = NULL;
+
+	if (queue->head)
+		csp_free(queue->head);
+	queue->head = NULL;
+#endif
+
+}
+
+int csp_qos_enqueue(csp_qos_queue_t * queue, uint8_t prio, void * item, uint32_t timeout, CSP_BASE_TYPE * pxTaskWoken) {
+
+	int result;
+
+#ifdef CSP_USE_QOS
+	prio = (prio < CSP_ROUTE_FIFOS) ? prio : CSP_ROUTE_FIFOS - 1;
+#else
+	prio = 0;
+#endif
+
+#ifdef CSP_USE_AQM
+	if (queue->aqm)
+		csp_qos_stamp(queue->packet(item), pxTaskWoken);
+#endif
+
+	if (pxTaskWoken == NULL)
+		result = csp_queue_enqueue(queue->fifo[prio], item, timeout);
+	else
+		result = csp_queue_enqueue_isr(queue->fifo[prio], item, pxTaskWoken);
+
+	if (result != CSP_QUEUE_OK) {
+		queue->drops[prio]++;
+		return CSP_ERR_NOBUFS;
+	}
+
+#ifdef CSP_USE_QOS
+	/* The event queue has room for every item, so this cannot fail */
+	static int event = 0;
+	if (pxTaskWoken == NULL)
+		csp_queue_enqueue(queue->event, &event, 0);
+	else
+		csp_queue_enqueue_isr(queue->event, &event, pxTaskWoken);
+#endif
+
+	return CSP_ERR_NONE;
+
+}
+
+#ifdef CSP_USE_QOS
+/**
+ * Make sure the head item of a class is loaded, if the class has any
+ * @return 1 if the class has an item, 0 otherwise
+ */
+static int csp_qos_peek(csp_qos_queue_t * queue, int prio) {
+
+	if (!queue->head_valid[prio])
+		if (csp_queue_dequeue(queue->fifo[prio], &queue->head[prio * queue->item_size], 0) == CSP_QUEUE_OK)
+			queue->head_valid[prio] = 1;
+
+	return queue->head_valid[prio];
+
+}
+
+static void csp_qos_take(csp_qos_queue_t * queue, int prio, void * item) {
+
+	memcpy(item, &queue->head[prio * queue->item_size], queue->item_size);
+	queue->head_valid[prio] = 0;
+
+}
+
+static void csp_qos_next(csp_qos_queue_t * queue) {
+
+	queue->current = (queue->current + 1 < CSP_ROUTE_FIFOS) ? queue->current + 1 : CSP_PRIO_CRITICAL + 1;
+	queue->granted = 0;
+
+}
+#endif
+
+/**
+ * Take the next item to serve from the queue
+ * @return priority class of the item, or -1 if no item was available
+ */
+static int csp_qos_select(csp_qos_queue_t * queue, void * item, uint32_t timeout) {
+
+#ifdef CSP_USE_QOS
+	int prio, event;
+
+	/* Wait for item in any fifo */
+	if (csp_queue_dequeue(queue->event, &event, timeout) != CSP_QUEUE_OK)
+		return -1;
+
+	/* Critical traffic goes first */
+	if (csp_qos_peek(queue, CSP_PRIO_CRITICAL)) {
+		csp_qos_take(queue, CSP_PRIO_CRITICAL, item);
+		return CSP_PRIO_CRITICAL;
+	}
+
+	/* The item of this event may have been taken with an earlier event */
+	for (prio = CSP_PRIO_CRITICAL + 1; prio < CSP_ROUTE_FIFOS; prio++)
+		if (csp_qos_peek(queue, prio))
+			break;
+	if (prio == CSP_ROUTE_FIFOS)
+		return -1;
+
+	/* Deficit round robin. Each visit grants a quantum of at least one full
+	 * buffer per weight, so this finds an item within one round */
+	while (1) {
+		prio = queue->current;
+
+		if (!queue->granted) {
+			if (!csp_qos_peek(queue, prio)) {
+				queue->deficit[prio] = 0;
+				csp_qos_next(queue);
+				continue;
+			}
+			queue->deficit[prio] += csp_qos_weight[prio] * csp_buffer_size();
+			queue->granted = 1;
+		}
+
+		if (csp_qos_peek(queue, prio)) {
+			uint16_t size = queue->packet(&queue->head[prio * queue->item_size])->length;
+			if (size <= queue->deficit[prio]) {
+				queue->deficit[prio] -= size;
+				csp_qos_take(queue, prio, item);
+				return prio;
+			}
+		} else {
+			/* Idle classes do not save up credit */
+			queue->deficit[prio] = 0;
+		}
+
+		csp_qos_next(queue);
+	}
+#else
+	if (csp_queue_dequeue(queue->fifo[0], item, timeout) != CSP_QUEUE_OK)
+		return -1;
+
+	return 0;
+#endif
+
+}
+
+int csp_qos_dequeue(csp_qos_queue_t * queue, void * item, uint32_t timeout) {
+
+	int prio;
+
+	while ((prio = csp_qos_select(queue, item, timeout)) >= 0) {
+
+#ifdef CSP_USE_AQM
+		int aqm = queue->aqm;
+#ifdef CSP_USE_QOS
+		/* Critical traffic is never dropped early */
+		if (prio == CSP_PRIO_CRITICAL)
+			aqm = 0;
+#endif
+		if (aqm) {
+			int backlog = csp_queue_size(queue->fifo[prio]);
+#ifdef CSP_USE_QOS
+			backlog += queue->head_valid[prio];
+#endif
+			csp_packet_t * packet = queue->packet(item);
+			if (csp_qos_codel_drop(&queue->codel[prio], packet, backlog)) {
+				csp_buffer_free(packet);
+				queue->early_drops[prio]++;
+				/* The queue holds further packets, so do not wait */
+				timeout = 0;
+				continue;
+			}
+		}
+#endif
+
+		return CSP_ERR_NONE;
+
+	}
+
+	return CSP_ERR_TIMEDOUT;
+
+}
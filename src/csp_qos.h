@@ -0,0 +1,148 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_QOS_H_
+#define _CSP_QOS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <csp/csp.h>
+
+#include "arch/csp_queue.h"
+
+#ifdef CSP_USE_AQM
+#if CSP_PADDING_BYTES < 4
+#error "AQM needs at least 4 padding bytes for the enqueue timestamp"
+#endif
+
+/**
+ * CoDel state of a queue. Packets are dropped when they have spent more than
+ * CSP_AQM_TARGET ms in the queue for at least CSP_AQM_INTERVAL ms, at a rate
+ * increasing with the square root of the number of drops.
+ */
+typedef struct {
+	uint32_t first_above;		/* Time the sojourn time may stay above target until, 0 if below */
+	uint32_t drop_next;			/* Time of the next drop */
+	uint32_t count;				/* Packets dropped since dropping started */
+	uint8_t dropping;			/* In drop state */
+} csp_qos_codel_t;
+
+/**
+ * Store the enqueue time of a packet in its padding bytes
+ * @param packet packet being queued
+ * @param pxTaskWoken NULL if called from task context
+ */
+void csp_qos_stamp(csp_packet_t * packet, CSP_BASE_TYPE * pxTaskWoken);
+
+/**
+ * Decide whether to drop a packet just taken from a queue
+ * @param codel CoDel state of the queue
+ * @param packet packet taken from the queue, stamped by csp_qos_stamp
+ * @param backlog number of packets still in the queue
+ * @return 1 if the packet should be dropped, 0 otherwise
+ */
+int csp_qos_codel_drop(csp_qos_codel_t * codel, csp_packet_t * packet, int backlog);
+#endif
+
+/**
+ * Packet of a queued item
+ * @param item pointer to item
+ * @return packet referenced by the item
+ */
+typedef csp_packet_t * (*csp_qos_packet_func_t)(const void * item);
+
+/**
+ * Priority queue with one fifo per priority class. With CSP_USE_QOS,
+ * CSP_PRIO_CRITICAL is served with strict priority and the other classes
+ * share the rest with deficit round robin, weighted by csp_qos_set_weight.
+ * Without CSP_USE_QOS, all items go through a single fifo.
+ * With CSP_USE_AQM and aqm set, packets which have been queued for too long
+ * are dropped by CoDel, except for CSP_PRIO_CRITICAL with CSP_USE_QOS.
+ * Any number of tasks and ISRs may enqueue, but only a single task may dequeue.
+ */
+typedef struct {
+	csp_queue_handle_t fifo[CSP_ROUTE_FIFOS];	/* One fifo per priority class */
+#ifdef CSP_USE_QOS
+	csp_queue_handle_t event;					/* One event per queued item */
+	uint8_t * head;								/* Item taken from each fifo, but not yet scheduled */
+	uint8_t head_valid[CSP_ROUTE_FIFOS];
+	int32_t deficit[CSP_ROUTE_FIFOS];			/* Bytes each class may still send this round */
+	uint8_t current;							/* Class currently served by round robin */
+	uint8_t granted;							/* Quantum was granted to current class */
+#endif
+#ifdef CSP_USE_AQM
+	uint8_t aqm;								/* Drop packets queued for too long */
+	csp_qos_codel_t codel[CSP_ROUTE_FIFOS];
+#endif
+	csp_qos_packet_func_t packet;
+	size_t item_size;
+	uint32_t drops[CSP_ROUTE_FIFOS];			/* Items dropped because the fifo was full */
+	uint32_t early_drops[CSP_ROUTE_FIFOS];		/* Items dropped by AQM */
+} csp_qos_queue_t;
+
+/**
+ * Create the fifos of a priority queue
+ * @param queue queue to initialise
+ * @param length number of items per priority class
+ * @param item_size size of one item
+ * @param packet function returning the packet of an item
+ * @param aqm 1 to enable active queue management, if compiled in. The queue
+ * then stores timestamps in the padding bytes of queued packets.
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOMEM if out of memory
+ */
+int csp_qos_queue_init(csp_qos_queue_t * queue, int length, size_t item_size, csp_qos_packet_func_t packet, int aqm);
+
+/**
+ * Remove the fifos of a priority queue. The queue must be empty and unused.
+ * @param queue queue to free
+ */
+void csp_qos_queue_free(csp_qos_queue_t * queue);
+
+/**
+ * Add item to the fifo of its priority class
+ * @param queue priority queue
+ * @param prio packet priority
+ * @param item pointer to item, which is copied
+ * @param timeout timeout in ms, ignored from ISR
+ * @param pxTaskWoken NULL if called from task context
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOBUFS if the fifo is full
+ */
+int csp_qos_enqueue(csp_qos_queue_t * queue, uint8_t prio, void * item, uint32_t timeout, CSP_BASE_TYPE * pxTaskWoken);
+
+/**
+ * Take the next item to serve from the queue. Packets dropped by AQM are
+ * freed here.
+ * @param queue priority queue
+ * @param item [out] buffer for the item
+ * @param timeout timeout in ms
+ * @return CSP_ERR_NONE on success, CSP_ERR_TIMEDOUT if no item was available
+ */
+int csp_qos_dequeue(csp_qos_queue_t * queue, void * item, uint32_t timeout);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_QOS_H_
@@ -30,6 +30,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/csp_endian.h>
 #include <csp/csp_platform.h>
 #include <csp/csp_error.h>
+#include <csp/csp_dv.h>
+#include <csp/csp_mcast.h>
 
 #include "arch/csp_thread.h"
 #include "arch/csp_queue.h"
@@ -39,7 +41,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "crypto/csp_hmac.h"
 #include "crypto/csp_xtea.h"
+#include "crypto/csp_aead.h"
 #include "csp_crc32.h"
+#include "csp_security.h"
+#include "csp_qos.h"
 
 #include "csp_port.h"
 #include "csp_route.h"
@@ -49,15 +54,46 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 csp_thread_handle_t handle_router;
 
-/* Static allocation of routes */
+/* Number of flow hash buckets spread over the next hops of a route */
+#define CSP_ROUTE_SLOTS		8
+
+/* Room for a route to every node, plus the default route */
+#define CSP_ROUTE_ENTRIES	(CSP_ID_HOST_MAX + 2)
+
+#ifndef CSP_ROUTE_NEXTHOPS
+#define CSP_ROUTE_NEXTHOPS	2
+#endif
+
+/* Route to a range of addresses */
+typedef struct {
+	uint8_t address;						/* First address of the range */
+	uint8_t netmask;						/* Number of significant address bits */
+	uint8_t count;							/* Number of next hops */
+	uint8_t dynamic;						/* Set by a routing protocol, not configured */
+	csp_route_t hop[CSP_ROUTE_NEXTHOPS];
+	uint8_t weight[CSP_ROUTE_NEXTHOPS];
+	uint8_t slot[CSP_ROUTE_SLOTS];			/* Next hop of each flow hash bucket */
+} csp_route_entry_t;
+
+/* Routing table snapshot, never modified once published */
+typedef struct {
+	csp_route_entry_t entries[CSP_ROUTE_ENTRIES];
+	uint8_t count;
+	/* Most specific route of each node and the default route, entry index + 1, 0 if none */
+	uint8_t lookup[CSP_ID_HOST_MAX + 2];
+} csp_route_table_t;
+
+/* Static allocation of routes. Lookups read the published table without
+ * locking, while updates are prepared in the other one under routes_lock.
+ * The readers of each table are counted, so an update waits for the last
+ * reader of a replaced table before reusing it. */
 csp_iface_t * interfaces;
-csp_route_t routes[CSP_ID_HOST_MAX + 2];
+static csp_route_table_t route_tables[2];
+static uint32_t route_readers[2];
+static csp_route_table_t * route_table = &route_tables[0];
 csp_mutex_t routes_lock;
 
-static csp_queue_handle_t router_input_fifo[CSP_ROUTE_FIFOS];
-#ifdef CSP_USE_QOS
-static csp_queue_handle_t router_input_event;
-#endif
+static csp_qos_queue_t router_input;
 
 #ifdef CSP_USE_PROMISC
 csp_queue_handle_t csp_promisc_queue = NULL;
@@ -69,35 +105,108 @@ extern int csp_route_input_hook(csp_packet_t * packet) __attribute__((weak));
 typedef struct {
 	csp_iface_t * interface;
 	csp_packet_t * packet;
+	uint32_t security_opts;		/* Socket or connection options, for the crypto workers */
+	csp_socket_t * socket;		/* Connection-less socket chosen before the crypto worker */
+	uint8_t verified;			/* Security check already done by a crypto worker */
 } csp_route_queue_t;
 
+/* Maximum number of packets taken from the router input per pass */
+#define CSP_ROUTE_BATCH 4
+
+/* Number of crypto worker tasks, 0 runs the security check in the router */
+#ifndef CSP_CRYPTO_WORKERS
+#define CSP_CRYPTO_WORKERS 0
+#endif
+
+/* Element of an interface transmit queue */
+typedef struct {
+	csp_packet_t * packet;
+	uint32_t timeout;
+} csp_route_tx_t;
+
+/* Interface transmit queue, with token bucket shaping */
+typedef struct {
+	csp_qos_queue_t queue;
+	uint32_t rate;				/* Bytes per second, 0 to disable shaping */
+	uint32_t burst;				/* Bucket size in bytes */
+	int64_t tokens;				/* Bucket level in bytes/1000, negative while in debt */
+	uint32_t last;				/* Time of last refill in ms */
+} csp_route_txq_t;
+
+#if (CSP_CRYPTO_WORKERS > 0)
+static csp_queue_handle_t crypto_worker_fifo[CSP_CRYPTO_WORKERS];
+static csp_thread_handle_t handle_crypto_worker[CSP_CRYPTO_WORKERS];
+#endif
+
 /**
  * Helper function to decrypt, check auth and CRC32
  * @param security_opts either socket_opts or conn_opts
  * @param interface pointer to incoming interface
  * @param packet pointer to packet
+ * @param hmac result of batch HMAC verification: 0 if not checked, 1 if verified and stripped, -1 if failed
  * @return -1 Missing feature, -2 XTEA error, -3 CRC error, -4 HMAC error, 0 = OK.
  */
-static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interface, csp_packet_t * packet) {
+static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interface, csp_packet_t * packet, int hmac) {
+
+	int fused __attribute__ ((unused)) = 0;
+
+	/* AEAD encrypted packet, which covers all other trailers */
+	if (packet->id.flags & CSP_FAEAD) {
+#ifdef CSP_USE_AEAD
+		if (csp_aead_decrypt(packet, packet->id) != 0) {
+			csp_debug(CSP_ERROR, "AEAD verification error! Discarding packet\r\n");
+			interface->autherr++;
+			return CSP_ERR_AEAD;
+		}
+	} else if (security_opts & CSP_SO_AEADREQ) {
+		csp_debug(CSP_WARN, "Received packet without AEAD encryption. Discarding packet\r\n");
+		interface->autherr++;
+		return CSP_ERR_AEAD;
+#else
+		csp_debug(CSP_ERROR, "Received AEAD encrypted packet, but CSP was compiled without AEAD support. Discarding packet\r\n");
+		interface->autherr++;
+		return CSP_ERR_NOTSUP;
+#endif
+	}
+
+#ifdef CSP_SECURITY_FUSED
+	/* Decrypt and verify in a single pass, unless HMAC was verified with the batch */
+	if (hmac == 0 && csp_security_fused(packet->id.flags)) {
+		int ret = csp_security_verify(packet, packet->id.flags, packet->id.src);
+		if (ret == CSP_ERR_HMAC) {
+			csp_debug(CSP_ERROR, "HMAC verification error! Discarding packet\r\n");
+			interface->autherr++;
+			return ret;
+		} else if (ret != CSP_ERR_NONE) {
+			csp_debug(CSP_ERROR, "CRC32 verification error! Discarding packet\r\n");
+			interface->rx_error++;
+			return ret;
+		}
+		fused = 1;
+		hmac = 1;
+	}
+#endif
 
 	/* XTEA encrypted packet */
 	if (packet->id.flags & CSP_FXTEA) {
 #ifdef CSP_USE_XTEA
-		/* Read nonce */
-		uint32_t nonce;
-		memcpy(&nonce, &packet->data[packet->length - sizeof(nonce)], sizeof(nonce));
-		nonce = csp_ntoh32(nonce);
-		packet->length -= sizeof(nonce);
-
-		/* Create initialization vector */
-		uint32_t iv[2] = {nonce, 1};
-
-		/* Decrypt data */
-		if (csp_xtea_decrypt(packet->data, packet->length, iv) != 0) {
-			/* Decryption failed */
-			csp_debug(CSP_ERROR, "Decryption failed! Discarding packet\r\n");
-			interface->autherr++;
-			return CSP_ERR_XTEA;
+		if (!fused) {
+			/* Read nonce */
+			uint32_t nonce;
+			memcpy(&nonce, &packet->data[packet->length - sizeof(nonce)], sizeof(nonce));
+			nonce = csp_ntoh32(nonce);
+			packet->length -= sizeof(nonce);
+
+			/* Create initialization vector */
+			uint32_t iv[2] = {nonce, 1};
+
+			/* Decrypt data */
+			if (csp_xtea_decrypt(packet->data, packet->length, iv, packet->id.src) != 0) {
+				/* Decryption failed */
+				csp_debug(CSP_ERROR, "Decryption failed! Discarding packet\r\n");
+				interface->autherr++;
+				return CSP_ERR_XTEA;
+			}
 		}
 	} else if (security_opts & CSP_SO_XTEAREQ) {
 		csp_debug(CSP_WARN, "Received packet without XTEA encryption. Discarding packet\r\n");
@@ -114,7 +223,7 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 	if (packet->id.flags & CSP_FCRC32) {
 #ifdef CSP_USE_CRC32
 		/* Verify CRC32  */
-		if (csp_crc32_verify(packet) != 0) {
+		if (!fused && csp_crc32_verify(packet) != 0) {
 			/* Checksum failed */
 			csp_debug(CSP_ERROR, "CRC32 verification error! Discarding packet\r\n");
 			interface->rx_error++;
@@ -133,8 +242,8 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 	/* HMAC authenticated packet */
 	if (packet->id.flags & CSP_FHMAC) {
 #ifdef CSP_USE_HMAC
-		/* Verify HMAC */
-		if (csp_hmac_verify(packet) != 0) {
+		/* Verify HMAC, unless already done for the batch */
+		if (hmac < 0 || (hmac == 0 && csp_hmac_verify(packet, packet->id.src) != 0)) {
 			/* HMAC failed */
 			csp_debug(CSP_ERROR, "HMAC verification error! Discarding packet\r\n");
 			interface->autherr++;
@@ -155,213 +264,408 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 
 }
 
-int csp_route_table_init(void) {
+/* Packet of a router input element, for the input scheduler */
+static csp_packet_t * csp_route_queue_packet(const void * item) {
+	return ((const csp_route_queue_t *) item)->packet;
+}
 
-	int prio;
+int csp_route_table_init(void) {
 
 	/* Clear rounting table */
-	memset(routes, 0, sizeof(csp_route_t) * (CSP_ID_HOST_MAX + 2));
+	memset(route_tables, 0, sizeof(route_tables));
+	route_table = &route_tables[0];
 
 	/* Create routing table lock */
 	if (csp_mutex_create(&routes_lock) != CSP_MUTEX_OK)
 		return CSP_ERR_NOMEM;
 
 	/* Create router fifos for each priority */
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		router_input_fifo[prio] = csp_queue_create(CSP_FIFO_INPUT, sizeof(csp_route_queue_t));
-		if (!router_input_fifo[prio])
+	if (csp_qos_queue_init(&router_input, CSP_FIFO_INPUT, sizeof(csp_route_queue_t), csp_route_queue_packet, 1) != CSP_ERR_NONE)
+		return CSP_ERR_NOMEM;
+
+#if (CSP_CRYPTO_WORKERS > 0)
+	/* Create input fifo for each crypto worker */
+	int worker;
+	for (worker = 0; worker < CSP_CRYPTO_WORKERS; worker++) {
+		crypto_worker_fifo[worker] = csp_queue_create(CSP_FIFO_INPUT, sizeof(csp_route_queue_t));
+		if (!crypto_worker_fifo[worker])
 			return CSP_ERR_NOMEM;
 	}
-
-#ifdef CSP_USE_QOS
-	/* Create QoS fifo notification queue */
-	router_input_event = csp_queue_create(CSP_FIFO_INPUT, sizeof(int));
-	if (!router_input_event)
-		return CSP_ERR_NOMEM;
 #endif
 
 	return CSP_ERR_NONE;
 
 }
 
-int csp_route_next_packet(csp_route_queue_t * input) {
+int csp_route_next_packet(csp_route_queue_t * input, uint32_t timeout) {
 
-#ifdef CSP_USE_QOS
-	int prio, found, event;
+	return csp_qos_dequeue(&router_input, input, timeout);
 
-	/* Wait for packet in any queue */
-	if (csp_queue_dequeue(router_input_event, &event, 100) != CSP_QUEUE_OK)
-		return CSP_ERR_TIMEDOUT;
+}
 
-	/* Find packet with highest priority */
-	found = 0;
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (csp_queue_dequeue(router_input_fifo[prio], input, 0) == CSP_QUEUE_OK) {
-			found = 1;
-			break;
+/**
+ * Wait for the next packet to route, and take any further packets already
+ * queued, up to max. Packets dropped by the input hook are not returned.
+ * @param batch array to store the packets in
+ * @param max size of batch
+ * @return number of packets in batch
+ */
+static int csp_route_next_batch(csp_route_queue_t * batch, int max) {
+
+	int count = 0;
+	uint32_t timeout = 100;
+
+	while (count < max && csp_route_next_packet(&batch[count], timeout) == CSP_ERR_NONE) {
+
+		csp_route_queue_t * input = &batch[count];
+
+		/* Packets returned by a crypto worker have been through here already */
+		if (input->verified) {
+			timeout = 0;
+			count++;
+			continue;
 		}
+
+		/* Here is last chance to drop packet, call user hook */
+		if ((csp_route_input_hook) && (csp_route_input_hook(input->packet) == 0)) {
+			csp_buffer_free(input->packet);
+			continue;
+		}
+
+		csp_debug(CSP_PACKET, "Router input: P 0x%02X, S 0x%02X, D 0x%02X, Dp 0x%02X, Sp 0x%02X, F 0x%02X\r\n",
+				input->packet->id.pri, input->packet->id.src, input->packet->id.dst, input->packet->id.dport,
+				input->packet->id.sport, input->packet->id.flags);
+
+		/* Here there be promiscuous mode */
+#ifdef CSP_USE_PROMISC
+		csp_promisc_add(input->packet, csp_promisc_queue);
+#endif
+
+		/* Do not wait for further packets once one is available */
+		timeout = 0;
+		count++;
+
 	}
 
-	if (!found) {
-		csp_debug(CSP_WARN, "Spurious wakeup of router task. No packet found\r\n");
-		return CSP_ERR_TIMEDOUT;
+	return count;
+
+}
+
+#ifdef CSP_USE_HMAC
+/**
+ * Verify HMAC of the packets in a batch at once. Only packets to this node,
+ * which carry neither XTEA, CRC32 nor AEAD, are verified here, the rest are
+ * left to the security check.
+ * @param batch packets to verify
+ * @param count number of packets in batch
+ * @param hmac [out] per packet: 0 if not checked, 1 if verified and stripped, -1 if failed
+ */
+static void csp_route_verify_batch(csp_route_queue_t * batch, int count, int * hmac) {
+
+	csp_packet_t * packets[CSP_ROUTE_BATCH];
+	int results[CSP_ROUTE_BATCH];
+	int index[CSP_ROUTE_BATCH];
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		csp_packet_t * packet = batch[i].packet;
+		hmac[i] = 0;
+		if (batch[i].verified)
+			continue;
+		if ((packet->id.flags & (CSP_FHMAC | CSP_FXTEA | CSP_FCRC32 | CSP_FAEAD)) != CSP_FHMAC)
+			continue;
+		if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR))
+			continue;
+		if (packet->id.flags & CSP_FMCAST)
+			continue;
+		index[n] = i;
+		packets[n++] = packet;
 	}
-#else
-	if (csp_queue_dequeue(router_input_fifo[0], input, 100) != CSP_QUEUE_OK)
-		return CSP_ERR_TIMEDOUT;
-#endif
 
-	return CSP_ERR_NONE;
+	/* A single packet gains nothing from the batch */
+	if (n < 2)
+		return;
+
+	csp_hmac_verify_batch(packets, results, n);
+
+	for (i = 0; i < n; i++)
+		hmac[index[i]] = (results[i] == 0) ? 1 : -1;
 
 }
+#endif
+
+#if (CSP_CRYPTO_WORKERS > 0)
+/**
+ * Crypto worker task. Runs the security check on packets handed over by the
+ * router, and returns the verified packets to the router input.
+ * @param pvParameters pointer to the input fifo of the worker
+ */
 #ifndef CSP_WINDOWS
-csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters) {
+static csp_thread_return_t csp_route_crypto_worker(void * pvParameters) {
 #else
-csp_thread_return_t __stdcall vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters) {
+static csp_thread_return_t __stdcall csp_route_crypto_worker(void * pvParameters) {
 #endif
 
-	int prio;
-	csp_route_queue_t input;
-	csp_packet_t * packet;
-	csp_conn_t * conn;
-	csp_socket_t * socket;
-	csp_route_t * dst;
+	csp_queue_handle_t fifo = *(csp_queue_handle_t *) pvParameters;
+	csp_route_queue_t batch[CSP_ROUTE_BATCH];
+	int hmac[CSP_ROUTE_BATCH] = {0};
+	int i, count;
+	uint32_t timeout;
 
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (!router_input_fifo[prio]) {
-			csp_debug(CSP_ERROR, "Router %d not initialized\r\n", prio);
-			csp_thread_exit();
-		}
+	if (!fifo) {
+		csp_debug(CSP_ERROR, "Crypto worker not initialized\r\n");
+		csp_thread_exit();
 	}
 
-	/* Here there be routing */
 	while (1) {
 
-		/* Check connection timeouts */
-		csp_conn_check_timeouts();
-
-		/* Get next packet to route */
-		if (csp_route_next_packet(&input) != CSP_ERR_NONE)
-			continue;
-
-		/* Here is last chance to drop packet, call user hook */
-		if ((csp_route_input_hook) && (csp_route_input_hook(packet) == 0)) {
-			csp_buffer_free(packet);
-			continue;
+		/* Wait for work, and take what is already queued */
+		count = 0;
+		timeout = CSP_MAX_DELAY;
+		while (count < CSP_ROUTE_BATCH && csp_queue_dequeue(fifo, &batch[count], timeout) == CSP_QUEUE_OK) {
+			timeout = 0;
+			count++;
 		}
 
-		packet = input.packet;
-
-		csp_debug(CSP_PACKET, "Router input: P 0x%02X, S 0x%02X, D 0x%02X, Dp 0x%02X, Sp 0x%02X, F 0x%02X\r\n",
-				packet->id.pri, packet->id.src, packet->id.dst, packet->id.dport,
-				packet->id.sport, packet->id.flags);
-
-		/* Here there be promiscuous mode */
-#ifdef CSP_USE_PROMISC
-		csp_promisc_add(packet, csp_promisc_queue);
+#ifdef CSP_USE_HMAC
+		csp_route_verify_batch(batch, count, hmac);
 #endif
 
-		/* If the message is not to me, route the message to the correct interface */
-		if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
+		for (i = 0; i < count; i++) {
+			csp_packet_t * packet = batch[i].packet;
 
-			/* Find the destination interface */
-			dst = csp_route_if(packet->id.dst);
-
-			/* If the message resolves to the input interface, don't loop it back out */
-			if ((dst == NULL) || ((dst->interface == input.interface) && (input.interface->split_horizon_off == 0))) {
+			if (csp_route_security_check(batch[i].security_opts, batch[i].interface, packet, hmac[i]) < 0) {
 				csp_buffer_free(packet);
 				continue;
 			}
 
-			/* Otherwise, actually send the message */
-			if (csp_send_direct(packet->id, packet, 0) != CSP_ERR_NONE) {
-				csp_debug(CSP_WARN, "Router failed to send\r\n");
+			/* The router drains its input, so it is safe to block here */
+			batch[i].verified = 1;
+			if (csp_qos_enqueue(&router_input, packet->id.pri, &batch[i], CSP_MAX_DELAY, NULL) != CSP_ERR_NONE) {
+				batch[i].interface->drop++;
 				csp_buffer_free(packet);
 			}
+		}
 
-			/* Next message, please */
-			continue;
+	}
 
+}
+#endif
+
+/**
+ * Run the security check on a packet to this node, or hand it over to a
+ * crypto worker. Packets of one connection always go to the same worker, so
+ * they come back to the router in the order they were received.
+ * @param input packet and incoming interface
+ * @param security_opts either socket_opts or conn_opts
+ * @param hmac result of batch HMAC verification, see csp_route_security_check
+ * @return 1 if the packet is ready for delivery, 0 if it was taken or discarded
+ */
+static int csp_route_secure(csp_route_queue_t * input, uint32_t security_opts, int hmac) {
+
+	csp_packet_t * packet = input->packet;
+
+	if (input->verified)
+		return 1;
+
+#if (CSP_CRYPTO_WORKERS > 0)
+	if (packet->id.flags & (CSP_FHMAC | CSP_FXTEA | CSP_FCRC32 | CSP_FAEAD)) {
+		unsigned int worker = ((packet->id.src * 31 + packet->id.sport) * 31 + packet->id.dport) % CSP_CRYPTO_WORKERS;
+		input->security_opts = security_opts;
+		if (csp_queue_enqueue(crypto_worker_fifo[worker], input, 0) != CSP_QUEUE_OK) {
+			csp_debug(CSP_WARN, "Crypto worker %u FIFO is FULL. Dropping packet.\r\n", worker);
+			input->interface->drop++;
+			csp_buffer_free(packet);
 		}
+		return 0;
+	}
+#endif
 
-		/* The message is to me, search for incoming socket */
-		socket = csp_port_get_socket(packet->id.dport);
+	if (csp_route_security_check(security_opts, input->interface, packet, hmac) < 0) {
+		csp_buffer_free(packet);
+		return 0;
+	}
 
-		/* If the socket is connection-less, deliver now */
-		if (socket && (socket->opts & CSP_SO_CONN_LESS)) { 
-			if (csp_route_security_check(socket->opts, input.interface, packet) < 0) {
-				csp_buffer_free(packet);
-				continue;
-			}
-			if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
-				csp_debug(CSP_ERROR, "Conn-less socket queue full\r\n");
-				csp_buffer_free(packet);
-				continue;
-			}
-			continue;
+	input->verified = 1;
+	return 1;
+
+}
+
+/**
+ * Route a single packet from the router input
+ * @param input packet and incoming interface
+ * @param hmac result of batch HMAC verification, see csp_route_security_check
+ */
+static void csp_route_input(csp_route_queue_t * input, int hmac) {
+
+	csp_packet_t * packet;
+	csp_conn_t * conn;
+	csp_socket_t * socket;
+	csp_iface_t * dst;
+
+	packet = input->packet;
+
+	/* Multicast packets are replicated to the members of their group */
+	if (packet->id.flags & CSP_FMCAST) {
+#ifdef CSP_USE_MCAST
+		csp_mcast_input(packet, input->interface);
+#else
+		csp_buffer_free(packet);
+#endif
+		return;
+	}
+
+	/* If the message is not to me, route the message to the correct interface */
+	if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
+
+		/* Find the destination interface */
+		dst = csp_route_if_flow(packet->id, NULL);
+
+		/* If the message resolves to the input interface, don't loop it back out */
+		if ((dst == NULL) || ((dst == input->interface) && (input->interface->split_horizon_off == 0))) {
+			csp_buffer_free(packet);
+			return;
 		}
 
-		/* Search for an existing connection */
-		conn = csp_conn_find(packet->id.ext, CSP_ID_CONN_MASK);
+		/* Otherwise, actually send the message */
+		if (csp_send_direct(packet->id, packet, 0) != CSP_ERR_NONE) {
+			csp_debug(CSP_WARN, "Router failed to send\r\n");
+			csp_buffer_free(packet);
+		}
 
-		/* If no connection was found, try to create a new one */
-		if (conn == NULL) {
+		/* Next message, please */
+		return;
 
-			/* Reject packet if no matching socket is found */
-			if (!socket) {
-				csp_buffer_free(packet);
-				continue;
-			}
+	}
 
-			/* New incoming connection accepted */
-			csp_id_t idout;
-			idout.pri   = packet->id.pri;
-			idout.src   = my_address;
-			idout.dst   = packet->id.src;
-			idout.dport = packet->id.sport;
-			idout.sport = packet->id.dport;
-			idout.flags = packet->id.flags;
+#ifdef CSP_USE_DV
+	/* Routing adverts go to the routing daemon, which needs the interface */
+	if ((packet->id.dport == CSP_DV) && (packet->id.dst == CSP_BROADCAST_ADDR)) {
+		if (!csp_route_secure(input, csp_dv_get_opts(), hmac))
+			return;
+		if (csp_dv_input(input->interface, packet) == CSP_ERR_NONE)
+			return;
+	}
+#endif
+
+	/* The message is to me, search for an existing connection */
+	conn = csp_conn_find(packet->id);
 
-			/* Create connection */
-			conn = csp_conn_new(packet->id, idout);
+	/* If no connection was found, search for incoming socket */
+	if (conn == NULL) {
+
+		/* A verified packet keeps the socket of its first lookup, so
+		 * sockets sharing the port still take turns */
+		if (input->verified && input->socket != NULL)
+			socket = input->socket;
+		else
+			socket = csp_port_get_socket(packet->id.dport);
+
+		/* Reject packet if no matching socket is found */
+		if (!socket) {
+			csp_buffer_free(packet);
+			return;
+		}
 
-			if (!conn) {
-				csp_debug(CSP_ERROR, "No more connections available\r\n");
+		/* If the socket is connection-less, deliver now */
+		if (socket->opts & CSP_SO_CONN_LESS) {
+			input->socket = socket;
+			if (!csp_route_secure(input, socket->opts, hmac))
+				return;
+			if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
+				csp_debug(CSP_ERROR, "Conn-less socket queue full\r\n");
 				csp_buffer_free(packet);
-				continue;
+				return;
 			}
+			return;
+		}
 
-			/* Store the socket queue and options */
-			conn->socket = socket->socket;
-			conn->opts = socket->opts;
+		/* Try to create a new connection */
 
-		}
+		/* New incoming connection accepted */
+		csp_id_t idout;
+		idout.pri   = packet->id.pri;
+		idout.src   = my_address;
+		idout.dst   = packet->id.src;
+		idout.dport = packet->id.sport;
+		idout.sport = packet->id.dport;
+		idout.flags = packet->id.flags;
 
-		/* Run security check on incoming packet */
-		if (csp_route_security_check(conn->opts, input.interface, packet) < 0) {
+		/* Create connection */
+		conn = csp_conn_new(packet->id, idout);
+
+		if (!conn) {
+			csp_debug(CSP_ERROR, "No more connections available\r\n");
 			csp_buffer_free(packet);
-			continue;
+			return;
 		}
 
-		/* Pass packet to the right transport module */
-		if (packet->id.flags & CSP_FRDP) {
+		/* Store the socket queue and options */
+		conn->socket = socket->socket;
+		conn->opts = socket->opts;
+
+	}
+
+	/* Run security check on incoming packet */
+	if (!csp_route_secure(input, conn->opts, hmac))
+		return;
+
+	/* Pass packet to the right transport module */
+	if (packet->id.flags & CSP_FRDP) {
 #ifdef CSP_USE_RDP
-			csp_rdp_new_packet(conn, packet);
-		} else if (conn->opts & CSP_SO_RDPREQ) {
-			csp_debug(CSP_WARN, "Received packet without RDP header. Discarding packet\r\n");
-			input.interface->rx_error++;
-			csp_buffer_free(packet);
+		csp_rdp_new_packet(conn, packet);
+	} else if (conn->opts & CSP_SO_RDPREQ) {
+		csp_debug(CSP_WARN, "Received packet without RDP header. Discarding packet\r\n");
+		input->interface->rx_error++;
+		csp_buffer_free(packet);
 #else
-			csp_debug(CSP_ERROR, "Received RDP packet, but CSP was compiled without RDP support. Discarding packet\r\n");
-			input.interface->rx_error++;
-			csp_buffer_free(packet);
+		csp_debug(CSP_ERROR, "Received RDP packet, but CSP was compiled without RDP support. Discarding packet\r\n");
+		input->interface->rx_error++;
+		csp_buffer_free(packet);
 #endif
-		} else {
-			/* Pass packet to UDP module */
-			csp_udp_new_packet(conn, packet);
+	} else {
+		/* Pass packet to UDP module */
+		csp_udp_new_packet(conn, packet);
+	}
+
+}
+
+#ifndef CSP_WINDOWS
+csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters) {
+#else
+csp_thread_return_t __stdcall vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters) {
+#endif
+
+	int prio, i, count;
+	csp_route_queue_t batch[CSP_ROUTE_BATCH];
+	int hmac[CSP_ROUTE_BATCH] = {0};
+
+	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
+		if (!router_input.fifo[prio]) {
+			csp_debug(CSP_ERROR, "Router %d not initialized\r\n", prio);
+			csp_thread_exit();
 		}
 	}
 
+	/* Here there be routing */
+	while (1) {
+
+		/* Check connection timeouts */
+		csp_conn_check_timeouts();
+
+		/* Get next packets to route */
+		count = csp_route_next_batch(batch, CSP_ROUTE_BATCH);
+
+#if defined(CSP_USE_HMAC) && (CSP_CRYPTO_WORKERS == 0)
+		/* Verify HMAC of the whole batch at once */
+		csp_route_verify_batch(batch, count, hmac);
+#endif
+
+		for (i = 0; i < count; i++)
+			csp_route_input(&batch[i], hmac[i]);
+
+	}
+
 }
 
 int csp_route_start_task(unsigned int task_stack_size, unsigned int priority) {
@@ -373,92 +677,590 @@ int csp_route_start_task(unsigned int task_stack_size, unsigned int priority) {
 		return CSP_ERR_NOMEM;
 	}
 
+#if (CSP_CRYPTO_WORKERS > 0)
+	int worker;
+	for (worker = 0; worker < CSP_CRYPTO_WORKERS; worker++) {
+		ret = csp_thread_create(csp_route_crypto_worker, (signed char *) "CRYPTO", task_stack_size, &crypto_worker_fifo[worker], priority, &handle_crypto_worker[worker]);
+		if (ret != 0) {
+			csp_debug(CSP_ERROR, "Failed to start crypto worker task\n");
+			return CSP_ERR_NOMEM;
+		}
+	}
+#endif
+
 	return CSP_ERR_NONE;
 
 }
 
-int csp_route_set(uint8_t node, csp_iface_t * ifc, uint8_t nexthop_mac_addr) {
+/* Packet of a transmit queue element, for the output scheduler */
+static csp_packet_t * csp_route_tx_packet(const void * item) {
+	return ((const csp_route_tx_t *) item)->packet;
+}
 
-	/* Add interface to pool */
-	if (ifc != NULL) {
-		if (interfaces == NULL) {
-			/* This is the first interface to be added */
-			interfaces = ifc;
-			ifc->next = NULL;
-		} else {
-			/* One or more interfaces were already added */
-			csp_iface_t * i = interfaces;
-			while (i != ifc && i->next)
-				i = i->next;
-
-			/* Insert interface last if not already in pool */
-			if (i != ifc && i->next == NULL) {
-				i->next = ifc;
-				ifc->next = NULL;
-			}
+/* Add tokens for the time since the last refill */
+static void csp_route_tx_refill(csp_route_txq_t * txq) {
+
+	uint32_t now = csp_get_ms();
+	txq->tokens += (int64_t) (now - txq->last) * txq->rate;
+	txq->last = now;
+
+	if (txq->tokens > (int64_t) txq->burst * 1000)
+		txq->tokens = (int64_t) txq->burst * 1000;
+
+}
+
+/**
+ * Wait until the token bucket of a transmit queue is out of debt. The
+ * packet is only taken from the queue once the link may send again, so the
+ * highest priority packet at that time is sent, and the bucket may go into
+ * debt by that one packet.
+ */
+static void csp_route_tx_shape(csp_route_txq_t * txq) {
+
+	while (txq->rate > 0) {
+		csp_route_tx_refill(txq);
+		if (txq->tokens >= 0)
+			break;
+		csp_sleep_ms((uint32_t) (-txq->tokens / txq->rate) + 1);
+	}
+
+}
+
+/**
+ * Interface transmit task. Passes queued packets to the nexthop function.
+ * @param pvParameters pointer to the interface
+ */
+#ifndef CSP_WINDOWS
+static csp_thread_return_t csp_route_tx_task(void * pvParameters) {
+#else
+static csp_thread_return_t __stdcall csp_route_tx_task(void * pvParameters) {
+#endif
+
+	csp_iface_t * ifc = pvParameters;
+	csp_route_txq_t * txq = ifc->tx_queue;
+	csp_route_tx_t tx;
+
+	if (!txq) {
+		csp_debug(CSP_ERROR, "Transmit queue of %s not initialized\r\n", ifc->name);
+		csp_thread_exit();
+	}
+
+	while (1) {
+
+		csp_route_tx_shape(txq);
+
+		if (csp_qos_dequeue(&txq->queue, &tx, CSP_MAX_DELAY) != CSP_ERR_NONE)
+			continue;
+
+		/* Store length before passing to interface */
+		uint16_t bytes = tx.packet->length;
+
+		/* Pay for the packet, including time spent idle in the queue */
+		if (txq->rate > 0) {
+			csp_route_tx_refill(txq);
+			txq->tokens -= (int64_t) (bytes + CSP_HEADER_LENGTH) * 1000;
 		}
+
+		if ((*ifc->nexthop)(tx.packet, tx.timeout) != 1) {
+			ifc->tx_error++;
+			csp_buffer_free(tx.packet);
+			continue;
+		}
+
+		ifc->tx++;
+		ifc->txbytes += bytes;
+
 	}
 
-	/* Set route */
-	if (node <= CSP_DEFAULT_ROUTE) {
-		routes[node].interface = ifc;
-		routes[node].nexthop_mac_addr = nexthop_mac_addr;
-	} else {
-		csp_debug(CSP_ERROR, "Failed to set route: invalid node id %u\r\n", node);
+}
+
+int csp_route_start_tx_task(csp_iface_t * ifc, unsigned int queue_length, unsigned int task_stack_size, unsigned int priority) {
+
+	csp_thread_handle_t handle;
+
+	if (ifc == NULL || ifc->nexthop == NULL || queue_length == 0)
+		return CSP_ERR_INVAL;
+
+	if (ifc->tx_queue != NULL)
+		return CSP_ERR_ALREADY;
+
+	csp_route_txq_t * txq = csp_malloc(sizeof(*txq));
+	if (txq == NULL)
+		return CSP_ERR_NOMEM;
+
+	txq->rate = 0;
+	txq->burst = 0;
+	txq->tokens = 0;
+	txq->last = 0;
+
+	/* No AQM, as queued packets may be shared with the RDP retransmit queue */
+	if (csp_qos_queue_init(&txq->queue, queue_length, sizeof(csp_route_tx_t), csp_route_tx_packet, 0) != CSP_ERR_NONE) {
+		csp_debug(CSP_ERROR, "Failed to create transmit queue of %s\r\n", ifc->name);
+		csp_free(txq);
+		return CSP_ERR_NOMEM;
 	}
 
+	/* The task reads the queue from the interface when it starts */
+	ifc->tx_queue = txq;
+
+	if (csp_thread_create(csp_route_tx_task, (signed char *) "TX", task_stack_size, ifc, priority, &handle) != 0) {
+		csp_debug(CSP_ERROR, "Failed to start transmit task of %s\r\n", ifc->name);
+		ifc->tx_queue = NULL;
+		csp_qos_queue_free(&txq->queue);
+		csp_free(txq);
+		return CSP_ERR_NOMEM;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_route_tx_enqueue(csp_iface_t * ifc, csp_packet_t * packet, uint32_t timeout) {
+
+	csp_route_tx_t tx;
+	tx.packet = packet;
+	tx.timeout = timeout;
+
+	return csp_qos_enqueue(&((csp_route_txq_t *) ifc->tx_queue)->queue, packet->id.pri, &tx, timeout, NULL);
+
+}
+
+int csp_route_set_tx_rate(csp_iface_t * ifc, uint32_t rate, uint32_t burst) {
+
+	if (ifc == NULL || ifc->tx_queue == NULL)
+		return CSP_ERR_INVAL;
+
+	csp_route_txq_t * txq = ifc->tx_queue;
+
+	/* Default to one full packet */
+	if (burst == 0)
+		burst = ((ifc->mtu > 0) ? ifc->mtu : csp_buffer_size()) + CSP_HEADER_LENGTH;
+
+	txq->rate = 0;
+	txq->burst = burst;
+	txq->tokens = (int64_t) burst * 1000;
+	txq->last = csp_get_ms();
+	txq->rate = rate;
+
 	return CSP_ERR_NONE;
 
 }
 
-csp_route_t * csp_route_if(uint8_t id) {
+/* Add interface to pool, with routes_lock held. Readers may walk the list
+ * concurrently, so the new tail is complete before it is linked in. */
+static void csp_route_iface_add(csp_iface_t * ifc) {
 
-	if (routes[id].interface != NULL) {
-		return &routes[id];
-	} else if (routes[CSP_DEFAULT_ROUTE].interface != NULL) {
-		return &routes[CSP_DEFAULT_ROUTE];
+	if (interfaces == NULL) {
+		/* This is the first interface to be added */
+		ifc->next = NULL;
+		__atomic_store_n(&interfaces, ifc, __ATOMIC_RELEASE);
+	} else {
+		/* One or more interfaces were already added */
+		csp_iface_t * i = interfaces;
+		while (i != ifc && i->next)
+			i = i->next;
+
+		/* Insert interface last if not already in pool */
+		if (i != ifc && i->next == NULL) {
+			ifc->next = NULL;
+			__atomic_store_n(&i->next, ifc, __ATOMIC_RELEASE);
+		}
 	}
+
+}
+
+/* Address bits significant for a netmask */
+static uint8_t csp_route_mask(uint8_t netmask) {
+	return (uint8_t) (CSP_ID_HOST_MAX << (CSP_ID_HOST_SIZE - netmask)) & CSP_ID_HOST_MAX;
+}
+
+static csp_route_entry_t * csp_route_entry_find(csp_route_table_t * table, uint8_t address, uint8_t netmask) {
+
+	int i;
+	uint8_t mask = csp_route_mask(netmask);
+
+	for (i = 0; i < table->count; i++)
+		if (table->entries[i].netmask == netmask && table->entries[i].address == (address & mask))
+			return &table->entries[i];
+
 	return NULL;
 
 }
 
-int csp_route_enqueue(csp_queue_handle_t handle, void * value, uint32_t timeout, CSP_BASE_TYPE * pxTaskWoken) {
+/* Spread the flow hash buckets of a route over its next hops by weight */
+static void csp_route_entry_slots(csp_route_entry_t * entry) {
 
-	int result;
+	unsigned int total = 0, sum = 0;
+	int i, hop = 0;
+
+	for (i = 0; i < entry->count; i++)
+		total += entry->weight[i];
+
+	for (i = 0; i < CSP_ROUTE_SLOTS; i++) {
+		/* Middle of the bucket in the weight range */
+		unsigned int point = (2 * i + 1) * total / (2 * CSP_ROUTE_SLOTS);
+		while (sum + entry->weight[hop] <= point)
+			sum += entry->weight[hop++];
+		entry->slot[i] = hop;
+	}
+
+}
+
+/* Find the most specific route of each node, so lookups are a single index */
+static void csp_route_rebuild(csp_route_table_t * table) {
+
+	int node, i;
+
+	for (node = 0; node <= CSP_ID_HOST_MAX; node++) {
+		int best = -1;
+		for (i = 0; i < table->count; i++) {
+			csp_route_entry_t * entry = &table->entries[i];
+			if ((node & csp_route_mask(entry->netmask)) != entry->address)
+				continue;
+			if (best < 0 || entry->netmask > table->entries[best].netmask)
+				best = i;
+		}
+		table->lookup[node] = best + 1;
+	}
+
+	table->lookup[CSP_DEFAULT_ROUTE] = 0;
+	for (i = 0; i < table->count; i++)
+		if (table->entries[i].netmask == 0)
+			table->lookup[CSP_DEFAULT_ROUTE] = i + 1;
+
+}
+
+/**
+ * Pin the published routing table for reading
+ * Lock-free: if an update is published between loading and pinning the
+ * table, the table might already be reused, so the new one is pinned instead.
+ */
+static csp_route_table_t * csp_route_read_begin(void) {
+
+	while (1) {
+		csp_route_table_t * table = __atomic_load_n(&route_table, __ATOMIC_SEQ_CST);
+		uint32_t * readers = &route_readers[table - route_tables];
+		__atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&route_table, __ATOMIC_SEQ_CST) == table)
+			return table;
+		__atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	}
+
+}
+
+static void csp_route_read_end(csp_route_table_t * table) {
+	__atomic_sub_fetch(&route_readers[table - route_tables], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Copy the published routing table for an update, with routes_lock held
+ * @return table to modify and publish with csp_route_update_commit
+ */
+static csp_route_table_t * csp_route_update_begin(void) {
+
+	csp_route_table_t * table = &route_tables[(route_table == &route_tables[0]) ? 1 : 0];
+
+	/* Wait for lookups still using the table from before the last update */
+	while (__atomic_load_n(&route_readers[table - route_tables], __ATOMIC_SEQ_CST) > 0)
+		csp_sleep_ms(1);
+
+	memcpy(table, route_table, sizeof(*table));
+	return table;
+
+}
+
+/* Publish an updated routing table, with routes_lock held */
+static void csp_route_update_commit(csp_route_table_t * table) {
+
+	csp_route_rebuild(table);
+	__atomic_store_n(&route_table, table, __ATOMIC_SEQ_CST);
+
+}
+
+static int csp_route_table_add(csp_route_table_t * table, uint8_t node, uint8_t netmask, csp_iface_t * ifc, uint8_t nexthop_mac_addr, uint8_t weight) {
+
+	int i;
+
+	csp_route_iface_add(ifc);
+
+	csp_route_entry_t * entry = csp_route_entry_find(table, node, netmask);
+	if (entry == NULL) {
+		if (table->count >= CSP_ROUTE_ENTRIES) {
+			csp_debug(CSP_ERROR, "Failed to add route: routing table full\r\n");
+			return CSP_ERR_NOMEM;
+		}
+		entry = &table->entries[table->count];
+		memset(entry, 0, sizeof(*entry));
+		entry->address = node & csp_route_mask(netmask);
+		entry->netmask = netmask;
+	}
+
+	/* Update the weight of an existing next hop, or add a new one */
+	for (i = 0; i < entry->count; i++)
+		if (entry->hop[i].interface == ifc && entry->hop[i].nexthop_mac_addr == nexthop_mac_addr)
+			break;
+
+	if (i == entry->count) {
+		if (entry->count >= CSP_ROUTE_NEXTHOPS) {
+			csp_debug(CSP_ERROR, "Failed to add route: too many next hops for %u/%u\r\n", node, netmask);
+			return CSP_ERR_NOMEM;
+		}
+		entry->hop[i].interface = ifc;
+		entry->hop[i].nexthop_mac_addr = nexthop_mac_addr;
+		entry->count++;
+	}
+	entry->weight[i] = weight;
 
-	if (pxTaskWoken == NULL)
-		result = csp_queue_enqueue(handle, value, timeout);
+	if (entry == &table->entries[table->count])
+		table->count++;
+
+	csp_route_entry_slots(entry);
+
+	return CSP_ERR_NONE;
+
+}
+
+static int csp_route_table_remove(csp_route_table_t * table, uint8_t node, uint8_t netmask, csp_iface_t * ifc) {
+
+	int i, j;
+
+	csp_route_entry_t * entry = csp_route_entry_find(table, node, netmask);
+	if (entry == NULL)
+		return CSP_ERR_INVAL;
+
+	/* Remove next hops through the interface */
+	for (i = 0, j = 0; i < entry->count; i++) {
+		if (ifc != NULL && entry->hop[i].interface != ifc) {
+			entry->hop[j] = entry->hop[i];
+			entry->weight[j] = entry->weight[i];
+			j++;
+		}
+	}
+	entry->count = j;
+
+	/* Remove the route when no next hops are left */
+	if (entry->count == 0)
+		*entry = table->entries[--table->count];
 	else
-		result = csp_queue_enqueue_isr(handle, value, pxTaskWoken);
+		csp_route_entry_slots(entry);
 
-#ifdef CSP_USE_QOS
-	static int event = 0;
+	return CSP_ERR_NONE;
 
-	if (result == CSP_QUEUE_OK) {
-		if (pxTaskWoken == NULL)
-			csp_queue_enqueue(router_input_event, &event, 0);
-		else
-			csp_queue_enqueue_isr(router_input_event, &event, pxTaskWoken);
+}
+
+int csp_route_add(uint8_t node, uint8_t netmask, csp_iface_t * ifc, uint8_t nexthop_mac_addr, uint8_t weight) {
+
+	if (node > CSP_ID_HOST_MAX || netmask > CSP_ID_HOST_SIZE || ifc == NULL || weight == 0) {
+		csp_debug(CSP_ERROR, "Failed to add route: invalid route %u/%u\r\n", node, netmask);
+		return CSP_ERR_INVAL;
 	}
+
+	if (csp_mutex_lock(&routes_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	csp_route_table_t * table = csp_route_update_begin();
+
+	/* A configured route replaces a learnt one */
+	csp_route_entry_t * entry = csp_route_entry_find(table, node, netmask);
+	if (entry != NULL && entry->dynamic)
+		csp_route_table_remove(table, node, netmask, NULL);
+
+	int ret = csp_route_table_add(table, node, netmask, ifc, nexthop_mac_addr, weight);
+	if (ret == CSP_ERR_NONE)
+		csp_route_update_commit(table);
+
+	csp_mutex_unlock(&routes_lock);
+
+	return ret;
+
+}
+
+int csp_route_remove(uint8_t node, uint8_t netmask, csp_iface_t * ifc) {
+
+	if (node > CSP_ID_HOST_MAX || netmask > CSP_ID_HOST_SIZE)
+		return CSP_ERR_INVAL;
+
+	if (csp_mutex_lock(&routes_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	csp_route_table_t * table = csp_route_update_begin();
+	int ret = csp_route_table_remove(table, node, netmask, ifc);
+	if (ret == CSP_ERR_NONE)
+		csp_route_update_commit(table);
+
+	csp_mutex_unlock(&routes_lock);
+
+	return ret;
+
+}
+
+int csp_route_set(uint8_t node, csp_iface_t * ifc, uint8_t nexthop_mac_addr) {
+
+	int ret = CSP_ERR_NONE;
+
+	if (node > CSP_DEFAULT_ROUTE) {
+		csp_debug(CSP_ERROR, "Failed to set route: invalid node id %u\r\n", node);
+		return CSP_ERR_NONE;
+	}
+
+	/* A single node, or all nodes for the default route */
+	uint8_t address = (node == CSP_DEFAULT_ROUTE) ? 0 : node;
+	uint8_t netmask = (node == CSP_DEFAULT_ROUTE) ? 0 : CSP_ID_HOST_SIZE;
+
+	if (csp_mutex_lock(&routes_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	/* Replace any existing next hops in a single update */
+	csp_route_table_t * table = csp_route_update_begin();
+	csp_route_table_remove(table, address, netmask, NULL);
+	if (ifc != NULL)
+		ret = csp_route_table_add(table, address, netmask, ifc, nexthop_mac_addr, 1);
+	if (ret == CSP_ERR_NONE)
+		csp_route_update_commit(table);
+
+	csp_mutex_unlock(&routes_lock);
+
+	return ret;
+
+}
+
+int csp_route_set_dynamic(uint8_t node, csp_iface_t * ifc, uint8_t nexthop_mac_addr) {
+
+	int ret = CSP_ERR_NONE;
+
+	if (node > CSP_ID_HOST_MAX)
+		return CSP_ERR_INVAL;
+
+	if (csp_mutex_lock(&routes_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	/* Leave configured routes alone, and skip the update if there is nothing to remove */
+	csp_route_entry_t * entry = csp_route_entry_find(route_table, node, CSP_ID_HOST_SIZE);
+	if (entry != NULL && !entry->dynamic) {
+		csp_mutex_unlock(&routes_lock);
+		return CSP_ERR_USED;
+	}
+	if (entry == NULL && ifc == NULL) {
+		csp_mutex_unlock(&routes_lock);
+		return CSP_ERR_NONE;
+	}
+
+	csp_route_table_t * table = csp_route_update_begin();
+	csp_route_table_remove(table, node, CSP_ID_HOST_SIZE, NULL);
+	if (ifc != NULL) {
+		ret = csp_route_table_add(table, node, CSP_ID_HOST_SIZE, ifc, nexthop_mac_addr, 1);
+		if (ret == CSP_ERR_NONE)
+			csp_route_entry_find(table, node, CSP_ID_HOST_SIZE)->dynamic = 1;
+	}
+	if (ret == CSP_ERR_NONE)
+		csp_route_update_commit(table);
+
+	csp_mutex_unlock(&routes_lock);
+
+	return ret;
+
+}
+
+/* Next hop of a node, the first one unless a flow hash is given */
+static csp_iface_t * csp_route_lookup(uint8_t id, const uint32_t * flow, uint8_t * mac) {
+
+	csp_route_t * hop = NULL;
+	csp_iface_t * ifc = NULL;
+
+	if (id > CSP_DEFAULT_ROUTE)
+		return NULL;
+
+	csp_route_table_t * table = csp_route_read_begin();
+
+	if (table->lookup[id] > 0) {
+		csp_route_entry_t * entry = &table->entries[table->lookup[id] - 1];
+		hop = &entry->hop[(flow != NULL) ? entry->slot[*flow % CSP_ROUTE_SLOTS] : 0];
+		ifc = hop->interface;
+		if (mac != NULL)
+			*mac = hop->nexthop_mac_addr;
+	}
+
+	csp_route_read_end(table);
+
+	return ifc;
+
+}
+
+csp_iface_t * csp_route_if(uint8_t id, uint8_t * mac) {
+
+	return csp_route_lookup(id, NULL, mac);
+
+}
+
+csp_iface_t * csp_route_if_flow(csp_id_t id, uint8_t * mac) {
+
+	/* Hash the connection, so all its packets take the same next hop */
+	csp_id_ext_t key = id.ext & CSP_ID_CONN_MASK;
+	uint32_t hash = (uint32_t) key;
+#ifdef CSP_EXT_HEADER
+	hash ^= (uint32_t) (key >> 32);
 #endif
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
 
-	return (result == CSP_QUEUE_OK) ? CSP_ERR_NONE : CSP_ERR_NOBUFS;
+	return csp_route_lookup(id.dst, &hash, mac);
 
 }
 
-int csp_route_get_fifo(int prio) {
+/**
+ * Forward a transit packet straight to the transmit queue of its outgoing
+ * interface, from the receiving context. Transit packets need no security
+ * processing, so only the route lookup is left for the router to do.
+ * @return 1 if the packet was consumed, 0 if it must go through the router
+ */
+static int csp_route_cut_through(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYPE * pxTaskWoken) {
 
-#ifdef CSP_USE_QOS
-	return prio;
-#else
-	return 0;
+	/* Packets to and from this node, and multicast packets, need the router */
+	if ((packet->id.dst == my_address) || (packet->id.dst == CSP_BROADCAST_ADDR) || (packet->id.src == my_address))
+		return 0;
+	if (packet->id.flags & CSP_FMCAST)
+		return 0;
+
+	/* The input hook and promiscuous mode see every packet in the router */
+	if (csp_route_input_hook)
+		return 0;
+#ifdef CSP_USE_PROMISC
+	if (csp_promisc_enabled)
+		return 0;
 #endif
 
+	/* Only interfaces with a transmit task can be reached without blocking */
+	csp_iface_t * ifout = csp_route_if_flow(packet->id, NULL);
+	if ((ifout == NULL) || (ifout->tx_queue == NULL))
+		return 0;
+
+	/* Leave split horizon, oversize and header drops to the router */
+	if ((ifout == interface) && (interface->split_horizon_off == 0))
+		return 0;
+	if ((ifout->mtu > 0) && (packet->length > ifout->mtu))
+		return 0;
+#ifdef CSP_EXT_HEADER
+	if (!csp_id_fits(packet->id, ifout->ext_header))
+		return 0;
+#endif
+
+	csp_route_tx_t tx;
+	tx.packet = packet;
+	tx.timeout = 0;
+
+	if (csp_qos_enqueue(&((csp_route_txq_t *) ifout->tx_queue)->queue, packet->id.pri, &tx, 0, pxTaskWoken) != CSP_ERR_NONE) {
+		ifout->drop++;
+		csp_buffer_free(packet);
+	}
+
+	return 1;
+
 }
 
 void csp_new_packet(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYPE * pxTaskWoken) {
 
-	int result, fifo;
+	int result;
 
 	if (packet == NULL) {
 		csp_debug(CSP_WARN, "csp_new packet called with NULL packet\r\n");
@@ -469,12 +1271,22 @@ void csp_new_packet(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYP
 		return;
 	}
 
+	/* Transit packets bypass the router when they can */
+	uint16_t length = packet->length;
+	if (csp_route_cut_through(packet, interface, pxTaskWoken)) {
+		interface->rx++;
+		interface->rxbytes += length;
+		return;
+	}
+
 	csp_route_queue_t queue_element;
 	queue_element.interface = interface;
 	queue_element.packet = packet;
+	queue_element.security_opts = 0;
+	queue_element.socket = NULL;
+	queue_element.verified = 0;
 
-	fifo = csp_route_get_fifo(packet->id.pri);
-	result = csp_route_enqueue(router_input_fifo[fifo], &queue_element, 0, pxTaskWoken);
+	result = csp_qos_enqueue(&router_input, packet->id.pri, &queue_element, 0, pxTaskWoken);
 
 	if (result != CSP_ERR_NONE) {
 		csp_debug(CSP_WARN, "ERROR: Routing input FIFO is FULL. Dropping packet.\r\n");
@@ -489,8 +1301,17 @@ void csp_new_packet(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYP
 
 uint8_t csp_route_get_nexthop_mac(uint8_t node) {
 
-	csp_route_t * route = csp_route_if(node);
-	return route->nexthop_mac_addr;
+	uint8_t mac = CSP_NODE_MAC;
+	csp_route_if(node, &mac);
+	return mac;
+
+}
+
+uint8_t csp_route_get_nexthop_mac_id(csp_id_t id) {
+
+	uint8_t mac = CSP_NODE_MAC;
+	csp_route_if_flow(id, &mac);
+	return mac;
 
 }
 
@@ -558,13 +1379,31 @@ int csp_route_print_interfaces_str(char * str_buf, int str_size) {
 
 void csp_route_print_table(void) {
 
-	int i;
-	for (i = 0; i < CSP_DEFAULT_ROUTE; i++)
-		if (routes[i].interface != NULL)
-			printf("Node: %u\t\tNexthop: %s[%u]\r\n", i,
-					routes[i].interface->name, routes[i].nexthop_mac_addr);
-	printf("Default\t\tNexthop: %s [%u]\r\n", routes[CSP_DEFAULT_ROUTE].interface->name,
-	routes[CSP_DEFAULT_ROUTE].nexthop_mac_addr);
+	int i, j;
+	csp_route_table_t * table = csp_route_read_begin();
+
+	for (i = 0; i < table->count; i++) {
+		csp_route_entry_t * entry = &table->entries[i];
+		for (j = 0; j < entry->count; j++) {
+			if (entry->netmask == 0)
+				printf("Default\t\t");
+			else
+				printf("Node: %u/%u\t", entry->address, entry->netmask);
+			printf("Nexthop: %s [%u] weight %u\r\n", entry->hop[j].interface->name,
+					entry->hop[j].nexthop_mac_addr, entry->weight[j]);
+		}
+	}
+
+	csp_route_read_end(table);
+
+}
+
+void csp_route_print_qos(void) {
+
+	int prio;
+	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++)
+		printf("Prio: %u\t\tdrop: %05"PRIu32" early: %05"PRIu32"\r\n", prio,
+				router_input.drops[prio], router_input.early_drops[prio]);
 
 }
 #endif
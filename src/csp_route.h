@@ -45,11 +45,45 @@ int csp_route_table_init(void);
 /**
  * Routing table lookup
  * This is the actual lookup in the routing table
- * The table consists of one entry per possible node
- * If there is no explicit nexthop route for the destination
- * the default route (node CSP_DEFAULT_ROUTE) is used.
+ * The most specific route matching the node is used, which is the
+ * default route (node CSP_DEFAULT_ROUTE) if no other route matches.
+ * If the route has several next hops, the first one is returned.
+ * The lookup does not lock, and may run concurrently with route updates.
+ * @param id destination node
+ * @param mac if not NULL, set to the MAC layer address of the next hop
+ * @return interface of the next hop, or NULL if there is no route
  */
-csp_route_t * csp_route_if(uint8_t id);
+csp_iface_t * csp_route_if(uint8_t id, uint8_t * mac);
+
+/**
+ * Routing table lookup for a connection
+ * As csp_route_if, but if the route has several next hops, one is chosen
+ * by weight from a hash of the connection identifier, so all packets of a
+ * connection take the same next hop.
+ * @param id CSP header of the packet
+ * @param mac if not NULL, set to the MAC layer address of the next hop
+ */
+csp_iface_t * csp_route_if_flow(csp_id_t id, uint8_t * mac);
+
+/**
+ * Set the host route of a node learnt by a routing protocol.
+ * Routes added with csp_route_add or csp_route_set are neither replaced
+ * nor removed, and replace a learnt route when they are added.
+ * @param node destination node
+ * @param ifc interface of the next hop, or NULL to remove the learnt route
+ * @param nexthop_mac_addr MAC layer address of the next hop
+ * @return CSP_ERR_NONE on success, CSP_ERR_USED if the node has a configured route
+ */
+int csp_route_set_dynamic(uint8_t node, csp_iface_t * ifc, uint8_t nexthop_mac_addr);
+
+/**
+ * Queue packet for the transmit task of an interface
+ * @param ifc interface with a transmit queue
+ * @param packet packet to transmit, with the final header in packet->id
+ * @param timeout timeout in ms to wait for room in the queue, also used for the nexthop call
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOBUFS if the queue is full
+ */
+int csp_route_tx_enqueue(csp_iface_t * ifc, csp_packet_t * packet, uint32_t timeout);
 
 /**
  * Router Task
@@ -0,0 +1,253 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Single pass HMAC, CRC32 and XTEA over packet data */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+
+#include "crypto/csp_hmac.h"
+#include "crypto/csp_xtea.h"
+#include "csp_crc32.h"
+#include "csp_security.h"
+
+#ifdef CSP_SECURITY_FUSED
+
+#if defined(CSP_USE_XTEA)
+/* Data is processed in chunks of one XTEA key stream pass */
+#define CSP_SECURITY_CHUNK	CSP_XTEA_CHUNK_LENGTH
+#else
+#define CSP_SECURITY_CHUNK	32
+#endif
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+int csp_security_fused(uint8_t flags) {
+
+	int count = 0;
+
+	if (flags & CSP_FHMAC) {
+#ifdef CSP_USE_HMAC
+		count++;
+#else
+		return 0;
+#endif
+	}
+
+	if (flags & CSP_FCRC32) {
+#ifdef CSP_USE_CRC32
+		count++;
+#else
+		return 0;
+#endif
+	}
+
+	if (flags & CSP_FXTEA) {
+#ifdef CSP_USE_XTEA
+		count++;
+#else
+		return 0;
+#endif
+	}
+
+	return count > 1;
+
+}
+
+int csp_security_append(csp_packet_t * packet, uint8_t flags, uint8_t node) {
+
+	uint8_t * data = packet->data;
+	uint32_t length = packet->length;
+	uint32_t offset, chunk, encrypted = 0;
+#ifdef CSP_USE_HMAC
+	csp_sha1_state md;
+#endif
+#ifdef CSP_USE_CRC32
+	uint32_t crc = 0;
+#endif
+#ifdef CSP_USE_XTEA
+	uint32_t nonce = (uint32_t)rand();
+	uint32_t iv[2] = {nonce, 1};
+#endif
+
+	if (!csp_security_fused(flags))
+		return CSP_ERR_INVAL;
+
+#ifdef CSP_USE_HMAC
+	if (flags & CSP_FHMAC)
+		csp_hmac_start(&md, node);
+#endif
+
+	/* Authenticate and checksum each chunk, and encrypt it once complete */
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = MIN(CSP_SECURITY_CHUNK, length - offset);
+#ifdef CSP_USE_HMAC
+		if (flags & CSP_FHMAC)
+			csp_sha1_process(&md, &data[offset], chunk);
+#endif
+#ifdef CSP_USE_CRC32
+		if (flags & CSP_FCRC32)
+			crc = csp_crc32_update(crc, &data[offset], chunk);
+#endif
+#ifdef CSP_USE_XTEA
+		if ((flags & CSP_FXTEA) && chunk == CSP_SECURITY_CHUNK) {
+			csp_xtea_crypt_chunk(&data[offset], offset, chunk, iv, node);
+			encrypted = offset + chunk;
+		}
+#endif
+	}
+
+	/* Append HMAC, which is covered by the CRC32 */
+#ifdef CSP_USE_HMAC
+	if (flags & CSP_FHMAC) {
+		csp_hmac_finish(&md, node, &data[length]);
+#ifdef CSP_USE_CRC32
+		if (flags & CSP_FCRC32)
+			crc = csp_crc32_update(crc, &data[length], CSP_HMAC_LENGTH);
+#endif
+		length += CSP_HMAC_LENGTH;
+	}
+#endif
+
+	/* Append CRC32 */
+#ifdef CSP_USE_CRC32
+	if (flags & CSP_FCRC32) {
+		crc = csp_hton32(crc);
+		memcpy(&data[length], &crc, sizeof(crc));
+		length += sizeof(crc);
+	}
+#endif
+
+	/* Encrypt the last partial chunk and trailers, and append the nonce */
+#ifdef CSP_USE_XTEA
+	if (flags & CSP_FXTEA) {
+		for (offset = encrypted; offset < length; offset += chunk) {
+			chunk = MIN(CSP_SECURITY_CHUNK, length - offset);
+			csp_xtea_crypt_chunk(&data[offset], offset, chunk, iv, node);
+		}
+		nonce = csp_hton32(nonce);
+		memcpy(&data[length], &nonce, sizeof(nonce));
+		length += sizeof(nonce);
+	}
+#else
+	(void) encrypted;
+#endif
+
+	packet->length = length;
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_security_verify(csp_packet_t * packet, uint8_t flags, uint8_t node) {
+
+	uint8_t * data = packet->data;
+	uint32_t length = packet->length;
+	uint32_t offset, chunk, crc_length;
+#ifdef CSP_USE_HMAC
+	csp_sha1_state md;
+	uint8_t hmac[CSP_HMAC_LENGTH];
+	uint32_t hmac_length;
+#endif
+#ifdef CSP_USE_CRC32
+	uint32_t crc = 0;
+#endif
+#ifdef CSP_USE_XTEA
+	uint32_t iv[2];
+#endif
+
+	if (!csp_security_fused(flags))
+		return CSP_ERR_INVAL;
+
+	/* Length of each trailer */
+	uint32_t trailers = ((flags & CSP_FXTEA) ? sizeof(uint32_t) : 0)
+			+ ((flags & CSP_FCRC32) ? sizeof(uint32_t) : 0)
+			+ ((flags & CSP_FHMAC) ? CSP_HMAC_LENGTH : 0);
+	if (length < trailers)
+		return CSP_ERR_INVAL;
+
+	/* Read nonce */
+#ifdef CSP_USE_XTEA
+	if (flags & CSP_FXTEA) {
+		uint32_t nonce;
+		length -= sizeof(nonce);
+		memcpy(&nonce, &data[length], sizeof(nonce));
+		iv[0] = csp_ntoh32(nonce);
+		iv[1] = 1;
+	}
+#endif
+
+	/* Bytes covered by the CRC32 and the HMAC */
+	crc_length = length - ((flags & CSP_FCRC32) ? sizeof(uint32_t) : 0);
+#ifdef CSP_USE_HMAC
+	hmac_length = crc_length - ((flags & CSP_FHMAC) ? CSP_HMAC_LENGTH : 0);
+	if (flags & CSP_FHMAC)
+		csp_hmac_start(&md, node);
+#endif
+
+	/* Decrypt each chunk, then checksum and authenticate it */
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = MIN(CSP_SECURITY_CHUNK, length - offset);
+#ifdef CSP_USE_XTEA
+		if (flags & CSP_FXTEA)
+			csp_xtea_crypt_chunk(&data[offset], offset, chunk, iv, node);
+#endif
+#ifdef CSP_USE_CRC32
+		if ((flags & CSP_FCRC32) && offset < crc_length)
+			crc = csp_crc32_update(crc, &data[offset], MIN(chunk, crc_length - offset));
+#endif
+#ifdef CSP_USE_HMAC
+		if ((flags & CSP_FHMAC) && offset < hmac_length)
+			csp_sha1_process(&md, &data[offset], MIN(chunk, hmac_length - offset));
+#endif
+	}
+
+	packet->length = length;
+
+	/* Verify and strip CRC32 */
+#ifdef CSP_USE_CRC32
+	if (flags & CSP_FCRC32) {
+		crc = csp_hton32(crc);
+		if (memcmp(&data[crc_length], &crc, sizeof(crc)) != 0)
+			return CSP_ERR_CRC32;
+		packet->length = crc_length;
+	}
+#endif
+
+	/* Verify and strip HMAC */
+#ifdef CSP_USE_HMAC
+	if (flags & CSP_FHMAC) {
+		csp_hmac_finish(&md, node, hmac);
+		if (memcmp(&data[hmac_length], hmac, CSP_HMAC_LENGTH) != 0)
+			return CSP_ERR_HMAC;
+		packet->length = hmac_length;
+	}
+#endif
+
+	return CSP_ERR_NONE;
+
+}
+
+#endif // CSP_SECURITY_FUSED
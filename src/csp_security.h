@@ -0,0 +1,73 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_SECURITY_H_
+#define _CSP_SECURITY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Single pass security needs at least two of HMAC, CRC32 and XTEA */
+#if (defined(CSP_USE_HMAC) + defined(CSP_USE_CRC32) + defined(CSP_USE_XTEA)) > 1
+#define CSP_SECURITY_FUSED
+#endif
+
+#ifdef CSP_SECURITY_FUSED
+
+/**
+ * Check if the security flags of a packet are handled by the single pass
+ * functions below. That is the case when more than one of HMAC, CRC32 and
+ * XTEA is used, and all of them are compiled in.
+ * @param flags packet flags
+ * @return 1 if csp_security_append and csp_security_verify can be used, 0 otherwise
+ */
+int csp_security_fused(uint8_t flags);
+
+/**
+ * Append HMAC and CRC32 and encrypt packet in a single pass over the data.
+ * The output is identical to csp_hmac_append, csp_crc32_append and
+ * csp_xtea_encrypt with a random nonce, done one after the other.
+ * @param packet packet to secure
+ * @param flags packet flags, selects HMAC, CRC32 and XTEA
+ * @param node destination node, selects the keys
+ * @return CSP_ERR_NONE on success, or an error code
+ */
+int csp_security_append(csp_packet_t * packet, uint8_t flags, uint8_t node);
+
+/**
+ * Decrypt packet and verify CRC32 and HMAC in a single pass over the data,
+ * and strip the nonce, CRC32 and HMAC.
+ * @param packet packet to verify
+ * @param flags packet flags, selects HMAC, CRC32 and XTEA
+ * @param node source node, selects the keys
+ * @return CSP_ERR_NONE on success, CSP_ERR_CRC32 or CSP_ERR_HMAC if verification failed, CSP_ERR_INVAL if the packet is too short
+ */
+int csp_security_verify(csp_packet_t * packet, uint8_t flags, uint8_t node);
+
+#endif // CSP_SECURITY_FUSED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_SECURITY_H_
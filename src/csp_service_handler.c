@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 /* CSP includes */
 #include <csp/csp.h>
 #include <csp/csp_cmp.h>
+#include <csp/csp_transfer.h>
 #include <csp/csp_endian.h>
 #include <csp/csp_platform.h>
 
@@ -202,6 +203,13 @@ void csp_service_handler(csp_conn_t * conn, csp_packet_t * packet) {
 		break;
 	}
 
+#ifdef CSP_USE_CRC32
+	/* Object transfer, which sends its own replies */
+	case CSP_TRANSFER:
+		csp_transfer_handler(conn, packet);
+		return;
+#endif
+
 	default:
 		/* The connection was not a service-request, free the packet and return */
 		csp_buffer_free(packet);
@@ -0,0 +1,145 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+
+#include "crypto/csp_aead.h"
+#include "csp_conn.h"
+#include "csp_io.h"
+#include "csp_route.h"
+
+/* Room left in each segment for the RDP header and receive window, HMAC, CRC32
+ * and XTEA nonce, and the AEAD tag and nonce, which are appended to the data on
+ * the way out */
+#ifdef CSP_USE_AEAD
+#define CSP_STREAM_TRAILER	(20 + CSP_AEAD_OVERHEAD)
+#else
+#define CSP_STREAM_TRAILER	20
+#endif
+
+/* Return the number of data bytes to put in each segment */
+static int csp_stream_segment_size(csp_conn_t * conn) {
+
+	int segment = csp_buffer_size();
+
+	csp_iface_t * ifout = csp_route_if_flow(conn->idout, NULL);
+	if (ifout != NULL && ifout->mtu > 0)
+		if (ifout->mtu < segment)
+			segment = ifout->mtu;
+
+	return segment - CSP_STREAM_TRAILER;
+
+}
+
+int csp_stream_write(csp_conn_t * conn, const void * data, uint32_t length, uint32_t timeout) {
+
+	if (conn == NULL || (data == NULL && length > 0))
+		return CSP_ERR_INVAL;
+
+	if (!(conn->idout.flags & CSP_FRDP)) {
+		csp_debug(CSP_ERROR, "Stream requires an RDP connection\r\n");
+		return CSP_ERR_INVAL;
+	}
+
+	int segment = csp_stream_segment_size(conn);
+	if (segment <= 0)
+		return CSP_ERR_INVAL;
+
+	const uint8_t * src = data;
+	uint32_t written = 0;
+
+	while (written < length) {
+
+		uint32_t chunk = length - written;
+		if (chunk > (uint32_t) segment)
+			chunk = segment;
+
+		csp_packet_t * packet = csp_buffer_get(chunk);
+		if (packet == NULL) {
+			csp_debug(CSP_WARN, "Stream write out of buffers after %"PRIu32" bytes\r\n", written);
+			break;
+		}
+
+		memcpy(packet->data, &src[written], chunk);
+		packet->length = chunk;
+
+		/* Returns as soon as the segment is in the window */
+		if (csp_send_rdp(conn, packet, timeout) != CSP_ERR_NONE) {
+			csp_buffer_free(packet);
+			break;
+		}
+
+		written += chunk;
+
+	}
+
+	return written;
+
+}
+
+int csp_stream_read(csp_conn_t * conn, void * data, uint32_t length, uint32_t timeout) {
+
+	if (conn == NULL || (data == NULL && length > 0))
+		return CSP_ERR_INVAL;
+
+	if (!(conn->idin.flags & CSP_FRDP)) {
+		csp_debug(CSP_ERROR, "Stream requires an RDP connection\r\n");
+		return CSP_ERR_INVAL;
+	}
+
+	uint8_t * dst = data;
+	uint32_t read = 0;
+
+	while (read < length) {
+
+		/* Get the next segment, unless one is partially read */
+		if (conn->stream_rx == NULL) {
+			conn->stream_rx = csp_read(conn, timeout);
+			if (conn->stream_rx == NULL)
+				break;
+			conn->stream_rx_offset = 0;
+		}
+
+		csp_packet_t * packet = conn->stream_rx;
+		uint32_t chunk = packet->length - conn->stream_rx_offset;
+		if (chunk > length - read)
+			chunk = length - read;
+
+		memcpy(&dst[read], &packet->data[conn->stream_rx_offset], chunk);
+		conn->stream_rx_offset += chunk;
+		read += chunk;
+
+		/* Segment fully read */
+		if (conn->stream_rx_offset >= packet->length) {
+			conn->stream_rx = NULL;
+			csp_buffer_free(packet);
+		}
+
+	}
+
+	return read;
+
+}
@@ -0,0 +1,512 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_error.h>
+#include <csp/csp_transfer.h>
+
+#include "arch/csp_malloc.h"
+#include "arch/csp_queue.h"
+#include "arch/csp_semaphore.h"
+#include "arch/csp_time.h"
+
+#include "crypto/csp_aead.h"
+#include "csp_conn.h"
+#include "csp_crc32.h"
+#include "csp_io.h"
+#include "csp_route.h"
+
+#ifdef CSP_USE_CRC32
+
+/* Objects in progress on the receiver */
+#define CSP_TRANSFER_SLOTS		2
+
+/* Number of times missing chunks are sent again, before giving up */
+#define CSP_TRANSFER_ROUNDS		4
+
+/* Room left in each packet for the RDP header and receive window, HMAC, CRC32
+ * and XTEA nonce, and the AEAD tag and nonce, which are appended to the data on
+ * the way out */
+#ifdef CSP_USE_AEAD
+#define CSP_TRANSFER_TRAILER	(20 + CSP_AEAD_OVERHEAD)
+#else
+#define CSP_TRANSFER_TRAILER	20
+#endif
+
+typedef struct {
+	uint8_t * bitmap;			// Chunks stored, NULL if the slot is unused
+	uint32_t id;
+	uint32_t size;
+	uint16_t chunk_size;
+	uint32_t chunks;
+	uint32_t received;			// Number of chunks stored
+	uint32_t timestamp;			// Last activity, used to evict old transfers
+} csp_transfer_slot_t;
+
+static csp_transfer_slot_t slots[CSP_TRANSFER_SLOTS];
+static const csp_transfer_handler_t * transfer_handler = NULL;
+static csp_mutex_t transfer_lock;
+
+/* Bitmap helpers */
+static inline int csp_transfer_bit(const uint8_t * bitmap, uint32_t index) {
+	return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+static inline void csp_transfer_bit_set(uint8_t * bitmap, uint32_t index) {
+	bitmap[index / 8] |= 1 << (index % 8);
+}
+
+/* Return the largest message that fits a packet to a node, after the header */
+static uint32_t csp_transfer_msg_max(uint8_t node, uint32_t header) {
+
+	int size = csp_buffer_size();
+
+	csp_iface_t * ifout = csp_route_if(node, NULL);
+	if (ifout != NULL && ifout->mtu > 0)
+		if (ifout->mtu < size)
+			size = ifout->mtu;
+
+	size -= header + CSP_TRANSFER_TRAILER;
+
+	return (size > 0) ? size : 0;
+
+}
+
+/* Return the largest chunk that fits a packet to a node */
+static uint32_t csp_transfer_chunk_max(uint8_t node) {
+
+	return csp_transfer_msg_max(node, sizeof(struct csp_transfer_chunk));
+
+}
+
+int csp_transfer_init(void) {
+
+	if (csp_mutex_create(&transfer_lock) != CSP_MUTEX_OK) {
+		csp_debug(CSP_ERROR, "Failed to create transfer lock\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+void csp_transfer_set_handler(const csp_transfer_handler_t * handler) {
+
+	transfer_handler = handler;
+
+}
+
+/**
+ * RECEIVER
+ * The following functions handle requests on the CSP_TRANSFER port. They must be
+ * called with the transfer lock held.
+ */
+
+static csp_transfer_slot_t * csp_transfer_slot_find(uint32_t id) {
+
+	int i;
+	for (i = 0; i < CSP_TRANSFER_SLOTS; i++)
+		if (slots[i].bitmap != NULL && slots[i].id == id)
+			return &slots[i];
+
+	return NULL;
+
+}
+
+/* Return a free slot, or the one to evict: a completed transfer, else the oldest */
+static csp_transfer_slot_t * csp_transfer_slot_victim(void) {
+
+	int i;
+	csp_transfer_slot_t * victim = &slots[0];
+
+	for (i = 0; i < CSP_TRANSFER_SLOTS; i++) {
+		if (slots[i].bitmap == NULL || slots[i].received == slots[i].chunks)
+			return &slots[i];
+		if ((int32_t)(slots[i].timestamp - victim->timestamp) < 0)
+			victim = &slots[i];
+	}
+
+	return victim;
+
+}
+
+static void csp_transfer_begin(csp_packet_t * packet) {
+
+	struct csp_transfer_begin * msg = (struct csp_transfer_begin *) packet->data;
+	uint32_t id = csp_ntoh32(msg->id);
+	uint32_t size = csp_ntoh32(msg->size);
+	uint16_t chunk_size = csp_ntoh16(msg->chunk_size);
+
+	packet->length = sizeof(*msg);
+	msg->status = CSP_TRANSFER_REFUSED;
+
+	if (size == 0 || chunk_size == 0 || transfer_handler == NULL)
+		return;
+
+	/* Resume a transfer of the same object */
+	csp_transfer_slot_t * slot = csp_transfer_slot_find(id);
+	if (slot != NULL && slot->size == size && slot->chunk_size == chunk_size) {
+		csp_debug(CSP_INFO, "TRANSFER: Resuming %"PRIu32", %"PRIu32" of %"PRIu32" chunks\r\n", id, slot->received, slot->chunks);
+		slot->timestamp = csp_get_ms();
+		msg->status = CSP_TRANSFER_OK;
+		return;
+	}
+
+	uint32_t chunks = size / chunk_size + (size % chunk_size != 0);
+	if (chunks > CSP_TRANSFER_MAX_CHUNKS) {
+		csp_debug(CSP_WARN, "TRANSFER: Refusing %"PRIu32" of %"PRIu32" chunks\r\n", id, chunks);
+		return;
+	}
+
+	if (transfer_handler->begin != NULL && transfer_handler->begin(id, size) != 0)
+		return;
+
+	if (slot == NULL)
+		slot = csp_transfer_slot_victim();
+
+	uint8_t * bitmap = csp_malloc((chunks + 7) / 8);
+	if (bitmap == NULL)
+		return;
+	memset(bitmap, 0, (chunks + 7) / 8);
+
+	if (slot->bitmap != NULL)
+		csp_free(slot->bitmap);
+
+	slot->bitmap = bitmap;
+	slot->id = id;
+	slot->size = size;
+	slot->chunk_size = chunk_size;
+	slot->chunks = chunks;
+	slot->received = 0;
+	slot->timestamp = csp_get_ms();
+
+	csp_debug(CSP_INFO, "TRANSFER: Receiving %"PRIu32", %"PRIu32" bytes in %"PRIu32" chunks\r\n", id, size, chunks);
+	msg->status = CSP_TRANSFER_OK;
+
+}
+
+/* Store a chunk, return 1 if it completed the object */
+static int csp_transfer_chunk(csp_packet_t * packet, uint32_t * id, uint32_t * size) {
+
+	struct csp_transfer_chunk * msg = (struct csp_transfer_chunk *) packet->data;
+	if (packet->length < sizeof(*msg))
+		return 0;
+
+	uint32_t index = csp_ntoh32(msg->index);
+	uint32_t length = packet->length - sizeof(*msg);
+	*id = csp_ntoh32(msg->id);
+
+	csp_transfer_slot_t * slot = csp_transfer_slot_find(*id);
+	if (slot == NULL || index >= slot->chunks || csp_transfer_bit(slot->bitmap, index))
+		return 0;
+
+	/* Only the last chunk may be short */
+	uint32_t offset = index * slot->chunk_size;
+	uint32_t expected = slot->size - offset;
+	if (expected > slot->chunk_size)
+		expected = slot->chunk_size;
+	if (length != expected)
+		return 0;
+
+	if (csp_crc32_memory(msg->data, length) != csp_ntoh32(msg->crc)) {
+		csp_debug(CSP_WARN, "TRANSFER: CRC32 failed on chunk %"PRIu32"\r\n", index);
+		return 0;
+	}
+
+	if (transfer_handler->write(*id, offset, msg->data, length) != 0)
+		return 0;
+
+	csp_transfer_bit_set(slot->bitmap, index);
+	slot->timestamp = csp_get_ms();
+	slot->received++;
+
+	*size = slot->size;
+	return (slot->received == slot->chunks);
+
+}
+
+static void csp_transfer_status(csp_conn_t * conn, csp_packet_t * packet) {
+
+	struct csp_transfer_status * msg = (struct csp_transfer_status *) packet->data;
+	uint32_t first = csp_ntoh32(msg->first) & ~7UL;
+
+	packet->length = sizeof(*msg);
+	msg->first = csp_hton32(first);
+	msg->count = 0;
+
+	csp_transfer_slot_t * slot = csp_transfer_slot_find(csp_ntoh32(msg->id));
+	if (slot == NULL || first >= slot->chunks) {
+		msg->status = (slot == NULL) ? CSP_TRANSFER_UNKNOWN : CSP_TRANSFER_OK;
+		return;
+	}
+
+	/* As much of the bitmap as fits the reply on the route back, in whole bytes */
+	uint32_t count = slot->chunks - first;
+	uint32_t max = csp_transfer_msg_max(conn->idout.dst, sizeof(*msg)) * 8;
+	if (count > max)
+		count = max;
+
+	memcpy(msg->bitmap, &slot->bitmap[first / 8], (count + 7) / 8);
+	packet->length += (count + 7) / 8;
+	msg->count = csp_hton16(count);
+	msg->status = CSP_TRANSFER_OK;
+
+}
+
+void csp_transfer_handler(csp_conn_t * conn, csp_packet_t * packet) {
+
+	uint32_t id = 0, size = 0;
+	int complete = 0, reply = 1;
+
+	if (packet->length < 1 || csp_mutex_lock(&transfer_lock, 1000) != CSP_MUTEX_OK) {
+		csp_buffer_free(packet);
+		return;
+	}
+
+	switch (packet->data[0]) {
+	case CSP_TRANSFER_BEGIN:
+		if (packet->length < sizeof(struct csp_transfer_begin))
+			reply = 0;
+		else
+			csp_transfer_begin(packet);
+		break;
+	case CSP_TRANSFER_CHUNK:
+		if (transfer_handler != NULL)
+			complete = csp_transfer_chunk(packet, &id, &size);
+		reply = 0;
+		break;
+	case CSP_TRANSFER_STATUS:
+		if (packet->length < sizeof(struct csp_transfer_status))
+			reply = 0;
+		else
+			csp_transfer_status(conn, packet);
+		break;
+	default:
+		reply = 0;
+		break;
+	}
+
+	csp_mutex_unlock(&transfer_lock);
+
+	if (complete) {
+		csp_debug(CSP_INFO, "TRANSFER: Received %"PRIu32"\r\n", id);
+		if (transfer_handler->complete != NULL)
+			transfer_handler->complete(id, size);
+	}
+
+	/* Chunks are not acknowledged, the sender asks for the bitmap instead */
+	if (!reply || !csp_send(conn, packet, 0))
+		csp_buffer_free(packet);
+
+}
+
+/**
+ * SENDER
+ */
+
+/* Merge the bitmap of the receiver into ours, return 0 on success */
+static int csp_transfer_query(csp_conn_t * conn, uint32_t id, uint32_t chunks, uint8_t * bitmap,
+		struct csp_transfer_status * reply, uint32_t timeout) {
+
+	struct csp_transfer_status request;
+	uint32_t first = 0, j;
+
+	while (first < chunks) {
+
+		request.type = CSP_TRANSFER_STATUS;
+		request.status = 0;
+		request.id = csp_hton32(id);
+		request.first = csp_hton32(first);
+		request.count = 0;
+
+		int length = csp_transaction_persistent(conn, timeout, &request, sizeof(request), reply, -1);
+		if (length < (int) sizeof(*reply) || reply->status != CSP_TRANSFER_OK)
+			return -1;
+
+		uint32_t count = csp_ntoh16(reply->count);
+		if (csp_ntoh32(reply->first) != first || count == 0 || first + count > chunks
+				|| length < (int) (sizeof(*reply) + (count + 7) / 8))
+			return -1;
+
+		for (j = 0; j < (count + 7) / 8; j++)
+			bitmap[first / 8 + j] |= reply->bitmap[j];
+
+		first += count;
+
+	}
+
+	return 0;
+
+}
+
+static int csp_transfer_send_chunk(csp_conn_t * conn, uint32_t id, uint32_t index,
+		const uint8_t * data, uint32_t length, uint32_t timeout) {
+
+	csp_packet_t * packet = csp_buffer_get(sizeof(struct csp_transfer_chunk) + length);
+	if (packet == NULL)
+		return CSP_ERR_NOBUFS;
+
+	struct csp_transfer_chunk * msg = (struct csp_transfer_chunk *) packet->data;
+	msg->type = CSP_TRANSFER_CHUNK;
+	msg->id = csp_hton32(id);
+	msg->index = csp_hton32(index);
+	msg->crc = csp_hton32(csp_crc32_memory(data, length));
+	memcpy(msg->data, data, length);
+	packet->length = sizeof(*msg) + length;
+
+	/* A chunk lost after RDP queued it is sent again by RDP */
+	if (csp_send_rdp(conn, packet, timeout) != CSP_ERR_NONE) {
+		csp_buffer_free(packet);
+		return CSP_ERR_TX;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_transfer_send(uint8_t node, uint32_t id, const void * data, uint32_t size,
+		uint16_t chunk_size, int connections, uint32_t opts, uint32_t timeout) {
+
+	csp_conn_t * conns[CSP_TRANSFER_MAX_CONNS];
+	const uint8_t * src = data;
+	int ret = CSP_ERR_TIMEDOUT;
+	int i, n = 0, round;
+
+	if (data == NULL || size == 0 || connections < 1)
+		return CSP_ERR_INVAL;
+	if (connections > CSP_TRANSFER_MAX_CONNS)
+		connections = CSP_TRANSFER_MAX_CONNS;
+
+	uint32_t chunk_max = csp_transfer_chunk_max(node);
+	if (chunk_size == 0 || chunk_size > chunk_max)
+		chunk_size = chunk_max;
+	if (chunk_size == 0)
+		return CSP_ERR_INVAL;
+
+	uint32_t chunks = size / chunk_size + (size % chunk_size != 0);
+	if (chunks > CSP_TRANSFER_MAX_CHUNKS)
+		return CSP_ERR_INVAL;
+
+	uint8_t * bitmap = csp_malloc((chunks + 7) / 8);
+	struct csp_transfer_status * reply = csp_malloc(csp_buffer_size());
+	if (bitmap == NULL || reply == NULL) {
+		ret = CSP_ERR_NOMEM;
+		goto out_free;
+	}
+
+	/* Open connections, use as many as succeed */
+	for (i = 0; i < connections; i++) {
+		conns[n] = csp_connect(CSP_PRIO_NORM, node, CSP_TRANSFER, timeout, opts | CSP_O_RDP);
+		if (conns[n] != NULL)
+			n++;
+	}
+	if (n == 0)
+		goto out_free;
+
+	/* Announce the object */
+	struct csp_transfer_begin begin;
+	begin.type = CSP_TRANSFER_BEGIN;
+	begin.status = 0;
+	begin.chunk_size = csp_hton16(chunk_size);
+	begin.id = csp_hton32(id);
+	begin.size = csp_hton32(size);
+	if (csp_transaction_persistent(conns[0], timeout, &begin, sizeof(begin), &begin, sizeof(begin)) != sizeof(begin))
+		goto out;
+	if (begin.status != CSP_TRANSFER_OK) {
+		csp_debug(CSP_WARN, "TRANSFER: Node %u refused %"PRIu32"\r\n", node, id);
+		ret = CSP_ERR_INVAL;
+		goto out;
+	}
+
+	for (round = 0; round <= CSP_TRANSFER_ROUNDS; round++) {
+
+		/* Each connection is processed in order by the receiver, so the union of
+		 * the bitmaps returned on all of them covers every chunk sent so far */
+		memset(bitmap, 0, (chunks + 7) / 8);
+		for (i = 0; i < n; i++)
+			if (csp_transfer_query(conns[i], id, chunks, bitmap, reply, timeout) != 0) {
+				ret = CSP_ERR_TIMEDOUT;
+				goto out;
+			}
+
+		uint32_t index, missing = 0;
+		for (index = 0; index < chunks; index++)
+			if (!csp_transfer_bit(bitmap, index))
+				missing++;
+
+		if (missing == 0) {
+			ret = CSP_ERR_NONE;
+			goto out;
+		}
+
+		if (round == CSP_TRANSFER_ROUNDS) {
+			ret = CSP_ERR_TIMEDOUT;
+			break;
+		}
+
+		csp_debug(CSP_INFO, "TRANSFER: Sending %"PRIu32" of %"PRIu32" chunks on %d connections\r\n", missing, chunks, n);
+
+		/* Spread missing chunks over the connections */
+		i = 0;
+		for (index = 0; index < chunks; index++) {
+
+			if (csp_transfer_bit(bitmap, index))
+				continue;
+
+			uint32_t offset = index * chunk_size;
+			uint32_t length = (size - offset < chunk_size) ? size - offset : chunk_size;
+
+			/* Drop a connection that fails, and continue on the others */
+			while ((ret = csp_transfer_send_chunk(conns[i], id, index, &src[offset], length, timeout)) == CSP_ERR_TX) {
+				csp_debug(CSP_WARN, "TRANSFER: Connection %d failed\r\n", i);
+				csp_close(conns[i]);
+				conns[i] = conns[--n];
+				if (n == 0)
+					goto out;
+				i %= n;
+			}
+			if (ret != CSP_ERR_NONE)
+				goto out;
+
+			i = (i + 1) % n;
+
+		}
+
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		csp_close(conns[i]);
+out_free:
+	if (bitmap != NULL)
+		csp_free(bitmap);
+	if (reply != NULL)
+		csp_free(reply);
+	return ret;
+
+}
+
+#endif // CSP_USE_CRC32
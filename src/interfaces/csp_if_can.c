@@ -60,6 +60,7 @@ csp_iface_t csp_if_can = {
 	.name = "CAN",
 	.nexthop = csp_can_tx,
 	.mtu = 256,
+	.tx_shared = 1,
 };
 
 /** CAN header macros */
@@ -84,6 +85,9 @@ csp_iface_t csp_if_can = {
 #define CFP_MAKE_REMAIN(id)	CFP_MAKE_FIELD(id, CFP_REMAIN_SIZE, CFP_ID_SIZE)
 #define CFP_MAKE_ID(id) 	CFP_MAKE_FIELD(id, CFP_ID_SIZE, 0)
 
+/** Frame destination, with multicast packets sent to the broadcast address */
+#define CFP_PACKET_DST(packet) (((packet)->id.flags & CSP_FMCAST) ? CSP_BROADCAST_ADDR : (packet)->id.dst)
+
 /** Mask to uniquely separate connections */
 #define CFP_ID_CONN_MASK 	(CFP_MAKE_SRC((uint32_t)(1 << CFP_HOST_SIZE) - 1) \
 							| CFP_MAKE_DST((uint32_t)(1 << CFP_HOST_SIZE) - 1) \
@@ -374,7 +378,7 @@ int csp_tx_callback(can_id_t canid, can_error_t error, CSP_BASE_TYPE * task_woke
 		/* Prepare identifier */
 		can_id_t id  = 0;
 		id |= CFP_MAKE_SRC(buf->packet->id.src);
-		id |= CFP_MAKE_DST(buf->packet->id.dst);
+		id |= CFP_MAKE_DST(CFP_PACKET_DST(buf->packet));
 		id |= CFP_MAKE_ID(CFP_ID(canid));
 		id |= CFP_MAKE_TYPE(CFP_MORE);
 		id |= CFP_MAKE_REMAIN((buf->packet->length - buf->tx_count - bytes + 7) / 8);
@@ -439,7 +443,7 @@ int csp_rx_callback(can_frame_t * frame, CSP_BASE_TYPE * task_woken) {
 		case CFP_BEGIN:
 		
 			/* Discard packet if DLC is less than CSP id + CSP length fields */
-			if (frame->dlc < sizeof(csp_id_t) + sizeof(uint16_t)) {
+			if (frame->dlc < CSP_LEGACY_HEADER_LENGTH + sizeof(uint16_t)) {
 				csp_debug(CSP_WARN, "Short BEGIN frame received\r\n");
 				csp_if_can.frame++;
 				pbuf_free(buf, task_woken);
@@ -463,16 +467,15 @@ int csp_rx_callback(can_frame_t * frame, CSP_BASE_TYPE * task_woken) {
 			}
 
 			/* Copy CSP identifier and length*/
-			memcpy(&(buf->packet->id), frame->data, sizeof(csp_id_t));
-			buf->packet->id.ext = csp_ntoh32(buf->packet->id.ext);
-			memcpy(&(buf->packet->length), frame->data + sizeof(csp_id_t), sizeof(uint16_t));
+			buf->packet->id = csp_id_decode(frame->data, 0);
+			memcpy(&(buf->packet->length), frame->data + CSP_LEGACY_HEADER_LENGTH, sizeof(uint16_t));
 			buf->packet->length = csp_ntoh16(buf->packet->length);
 			
 			/* Reset RX count */
 			buf->rx_count = 0;
 			
 			/* Set offset to prevent CSP header from being copied to CSP data */
-			offset = sizeof(csp_id_t) + sizeof(uint16_t);
+			offset = CSP_LEGACY_HEADER_LENGTH + sizeof(uint16_t);
 
 			/* Set remain field - increment to include begin packet */
 			buf->remain = CFP_REMAIN(id) + 1;
@@ -542,13 +545,20 @@ int csp_can_tx(csp_packet_t * packet, uint32_t timeout) {
 		return 0;
 	}
 	
+	/* CFP addresses are 5 bits, so CAN always carries the 32-bit header */
+	uint8_t csp_id_be[CSP_LEGACY_HEADER_LENGTH];
+	if (csp_id_encode(packet->id, csp_id_be, 0) < 0) {
+		csp_debug(CSP_WARN, "CSP header does not fit CAN\r\n");
+		return 0;
+	}
+
 	/* Calculate overhead */
-	overhead = sizeof(csp_id_t) + sizeof(uint16_t);
+	overhead = sizeof(csp_id_be) + sizeof(uint16_t);
 
 	/* Create CAN identifier */
 	can_id_t id = 0;
 	id |= CFP_MAKE_SRC(packet->id.src);
-	id |= CFP_MAKE_DST(packet->id.dst);
+	id |= CFP_MAKE_DST(CFP_PACKET_DST(packet));
 	id |= CFP_MAKE_ID(ident);
 	id |= CFP_MAKE_TYPE(CFP_BEGIN);
 	id |= CFP_MAKE_REMAIN((packet->length + overhead - 1) / 8);
@@ -569,10 +579,9 @@ int csp_can_tx(csp_packet_t * packet, uint32_t timeout) {
 	bytes = (packet->length <= avail) ? packet->length : avail;
 
 	/* Copy CSP headers and data */
-	uint32_t csp_id_be = csp_hton32(packet->id.ext);
 	uint16_t csp_length_be = csp_hton16(packet->length);
 
-	memcpy(frame_buf, &csp_id_be, sizeof(csp_id_be));
+	memcpy(frame_buf, csp_id_be, sizeof(csp_id_be));
 	memcpy(frame_buf + sizeof(csp_id_be), &csp_length_be, sizeof(csp_length_be));
 	memcpy(frame_buf + overhead, packet->data, bytes);
 
@@ -585,6 +594,9 @@ int csp_can_tx(csp_packet_t * packet, uint32_t timeout) {
 	/* Send frame */
 	if (can_send(id, frame_buf, overhead + bytes, NULL) != 0) {
 		csp_debug(CSP_WARN, "Failed to send CAN frame in csp_tx_can\r\n");
+		/* Caller keeps ownership of the packet on error */
+		buf->packet = NULL;
+		pbuf_free(buf, NULL);
 		return 0;
 	}
 
@@ -594,6 +606,10 @@ int csp_can_tx(csp_packet_t * packet, uint32_t timeout) {
 
 	/* Blocking mode */
 	if (csp_bin_sem_wait(&buf->tx_sem, timeout) != CSP_SEMAPHORE_OK) {
+		csp_debug(CSP_WARN, "Timeout waiting for CAN transmit in csp_tx_can\r\n");
+		/* Caller keeps ownership of the packet on error */
+		buf->packet = NULL;
+		pbuf_free(buf, NULL);
 		csp_bin_sem_post(&buf->tx_sem);
 		return 0;
 	} else {
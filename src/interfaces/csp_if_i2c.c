@@ -34,6 +34,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define CSP_I2C_SPEED 400
 
+/** Multicast packets are sent to the I2C general call address */
+#define CSP_I2C_GENERAL_CALL 0
+
 static int csp_i2c_handle = 0;
 
 /** Interface definition */
@@ -47,18 +50,29 @@ int csp_i2c_tx(csp_packet_t * packet, uint32_t timeout) {
 	/* Cast the CSP packet buffer into an i2c frame */
 	i2c_frame_t * frame = (i2c_frame_t *) packet;
 
-	/* Insert destination node into the i2c destination field */
-	if (csp_route_get_nexthop_mac(packet->id.dst) == CSP_NODE_MAC) {
+	/* Insert destination node into the i2c destination field. The
+	 * destination of a multicast packet is a group, not a node */
+	uint8_t mac = csp_route_get_nexthop_mac_id(packet->id);
+	if (packet->id.flags & CSP_FMCAST) {
+		frame->dest = CSP_I2C_GENERAL_CALL;
+	} else if (mac == CSP_NODE_MAC) {
 		frame->dest = packet->id.dst;
 	} else {
-		frame->dest = csp_route_get_nexthop_mac(packet->id.dst);
+		frame->dest = mac;
 	}
 
-	/* Save the outgoing id in the buffer */
-	packet->id.ext = csp_hton32(packet->id.ext);
+	/* Save the outgoing id in the buffer, and move the data right
+	 * behind it if the header is shorter than the id field */
+	uint8_t id[CSP_HEADER_LENGTH];
+	int idlen = csp_id_encode(packet->id, id, csp_if_i2c.ext_header);
+	if (idlen < 0)
+		return CSP_ERR_INVAL;
+	if (idlen != sizeof(packet->id))
+		memmove((uint8_t *) &packet->id + idlen, packet->data, packet->length);
+	memcpy(&packet->id, id, idlen);
 
 	/* Add the CSP header to the I2C length field */
-	frame->len += sizeof(packet->id);
+	frame->len += idlen;
 	frame->len_rx = 0;
 
 	/* Some I2C drivers support X number of retries
@@ -89,18 +103,24 @@ void csp_i2c_rx(i2c_frame_t * frame, void * pxTaskWoken) {
 	if (frame == NULL)
 		return;
 
-	if ((frame->len < 4) || (frame->len > I2C_MTU)) {
+	int idlen = csp_id_length(csp_if_i2c.ext_header);
+
+	if ((frame->len < idlen) || (frame->len > I2C_MTU)) {
 		csp_if_i2c.frame++;
 		csp_buffer_free(frame);
 		return;
 	}
 
 	/* Strip the CSP header off the length field before converting to CSP packet */
-	frame->len -= sizeof(csp_id_t);
+	frame->len -= idlen;
 
-	/* Convert the packet from network to host order */
+	/* Convert the packet from network to host order, and move the data
+	 * behind the id field if the header is shorter */
 	packet = (csp_packet_t *) frame;
-	packet->id.ext = csp_ntoh32(packet->id.ext);
+	csp_id_t id = csp_id_decode((uint8_t *) &packet->id, csp_if_i2c.ext_header);
+	if (idlen != sizeof(packet->id))
+		memmove(packet->data, (uint8_t *) &packet->id + idlen, packet->length);
+	packet->id = id;
 
 	/* Receive the packet in CSP */
 	csp_new_packet(packet, &csp_if_i2c, pxTaskWoken);
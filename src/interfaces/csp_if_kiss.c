@@ -60,6 +60,7 @@ csp_iface_t csp_if_kiss = {
 	.name = "KISS",
 	.nexthop = csp_kiss_tx,
 	.mtu = 256,
+	.tx_shared = 1,
 };
 
 static int usart_handle;
@@ -94,54 +95,85 @@ static void kiss_crc_gentab(void) {
 }
 
 /**
- * Generate CRC32
+ * Update running CRC32
+ * @param crc current crc value, start with 0xFFFFFFFF
  * @param block pointer to data
  * @param length length of data
- * @return uint32_t crc32
+ * @return uint32_t updated crc value
  */
-static uint32_t kiss_crc(unsigned char *block, unsigned int length) {
-	uint32_t crc;
+static uint32_t kiss_crc_update(uint32_t crc, unsigned char *block, unsigned int length) {
 	int i;
 
-	crc = 0xFFFFFFFF;
 	for (i = 0; i < length; i++)
 		crc = ((crc >> 8) & 0x00FFFFFF) ^ kiss_crc_tab[(crc ^ *block++) & (uint32_t) 0xFF];
-	return (crc ^ 0xFFFFFFFF);
+	return crc;
+}
+
+/**
+ * Generate CRC32
+ * @param block pointer to data
+ * @param length length of data
+ * @return uint32_t crc32
+ */
+static uint32_t kiss_crc(unsigned char *block, unsigned int length) {
+	return (kiss_crc_update(0xFFFFFFFF, block, length) ^ 0xFFFFFFFF);
 }
 #endif // KISS_CRC32
 
-/* Send a CSP packet over the KISS RS232 protocol */
+/**
+ * Append bytes to the transmit buffer, escaping FEND and FESC
+ * @param txbuf transmit buffer
+ * @param txbufin current transmit buffer index
+ * @param block pointer to data
+ * @param length length of data
+ * @return new transmit buffer index
+ */
+static int kiss_escape(char * txbuf, int txbufin, unsigned char * block, unsigned int length) {
+	int i;
+
+	for (i = 0; i < length; i++) {
+		if (block[i] == FEND) {
+			txbuf[txbufin++] = FESC;
+			txbuf[txbufin++] = TFEND;
+		} else if (block[i] == FESC) {
+			txbuf[txbufin++] = FESC;
+			txbuf[txbufin++] = TFESC;
+		} else {
+			txbuf[txbufin++] = block[i];
+		}
+	}
+	return txbufin;
+}
+
+/* Send a CSP packet over the KISS RS232 protocol
+ * The packet is not modified, so it may be shared with the transport layer */
 int csp_kiss_tx(csp_packet_t * packet, uint32_t timeout) {
 
-	int i, txbufin = 0;
-	char txbuf[csp_if_kiss.mtu * 2];
+	int txbufin = 0;
+	char txbuf[(csp_if_kiss.mtu + CSP_HEADER_LENGTH + sizeof(uint32_t)) * 2 + 3];
+
+	/* Get the outgoing id in network byte order */
+	uint8_t id[CSP_HEADER_LENGTH];
+	int idlen = csp_id_encode(packet->id, id, csp_if_kiss.ext_header);
+	if (idlen < 0) {
+		csp_buffer_free(packet);
+		return 1;
+	}
 
-	/* Save the outgoing id in the buffer */
-	packet->id.ext = csp_hton32(packet->id.ext);
-	packet->length += sizeof(packet->id.ext);
+	txbuf[txbufin++] = FEND;
+	txbuf[txbufin++] = TNC_DATA;
+	txbufin = kiss_escape(txbuf, txbufin, id, idlen);
+	txbufin = kiss_escape(txbuf, txbufin, packet->data, packet->length);
 
 	/* Add CRC32 checksum */
 #if defined(KISS_CRC32)
-	uint32_t crc = kiss_crc((unsigned char *)&packet->id.ext, packet->length);
+	uint32_t crc = kiss_crc_update(0xFFFFFFFF, id, idlen);
+	crc = kiss_crc_update(crc, packet->data, packet->length) ^ 0xFFFFFFFF;
 	crc = csp_hton32(crc);
-	memcpy(((char *)&packet->id.ext) + packet->length, &crc, sizeof(crc));
-	packet->length += sizeof(crc);
+	txbufin = kiss_escape(txbuf, txbufin, (unsigned char *) &crc, sizeof(crc));
 #endif
 
 	txbuf[txbufin++] = FEND;
-	txbuf[txbufin++] = TNC_DATA;
-	for (i = 0; i < packet->length; i++) {
-		if (((unsigned char *) &packet->id.ext)[i] == FEND) {
-			((unsigned char *) &packet->id.ext)[i] = TFEND;
-			txbuf[txbufin++] = FESC;
-		} else if (((unsigned char *) &packet->id.ext)[i] == FESC) {
-			((unsigned char *) &packet->id.ext)[i] = TFESC;
-			txbuf[txbufin++] = FESC;
-		}
-		txbuf[txbufin++] = ((unsigned char *) &packet->id.ext)[i];
-
-	}
-	txbuf[txbufin++] = FEND;
 
 	usart_putstr(usart_handle, txbuf, txbufin);
 
@@ -175,7 +207,8 @@ void csp_kiss_rx(uint8_t * buf, int len, void * pxTaskWoken) {
 				if (packet == NULL)
 					continue;
 				mode = KISS_MODE_STARTED;
-				cbuf = (unsigned char *) &packet->id.ext;
+				/* The header is received in front of the data */
+				cbuf = packet->data - csp_id_length(csp_if_kiss.ext_header);
 				first = 1;
 			} else {
 				/* If the char was not part of a kiss frame, send back to usart driver */
@@ -214,18 +247,21 @@ void csp_kiss_rx(uint8_t * buf, int len, void * pxTaskWoken) {
 
 		if (mode == KISS_MODE_ENDED) {
 
+			int idlen = csp_id_length(csp_if_kiss.ext_header);
+			unsigned char * header = packet->data - idlen;
+
 			packet->length = length;
 
 			csp_if_kiss.frame++;
 
-			if (packet->length >= CSP_HEADER_LENGTH
-					&& packet->length <= csp_if_kiss.mtu + CSP_HEADER_LENGTH) {
+			if (packet->length >= idlen
+					&& packet->length <= csp_if_kiss.mtu + idlen) {
 
 #if defined(KISS_CRC32)
 				uint32_t crc_remote;
-				memcpy(&crc_remote, ((unsigned char *) &packet->id.ext) + packet->length - sizeof(crc_remote), sizeof(crc_remote));
+				memcpy(&crc_remote, header + packet->length - sizeof(crc_remote), sizeof(crc_remote));
 				crc_remote = csp_ntoh32(crc_remote);
-				uint32_t crc_local = kiss_crc((unsigned char *) &packet->id.ext, packet->length - sizeof(crc_remote));
+				uint32_t crc_local = kiss_crc(header, packet->length - sizeof(crc_remote));
 
 				if (crc_remote != crc_local) {
 					csp_debug(CSP_WARN, "CRC remote 0x%08X, local 0x%08X\r\n", crc_remote, crc_local);
@@ -240,10 +276,10 @@ void csp_kiss_rx(uint8_t * buf, int len, void * pxTaskWoken) {
 #endif
 
 				/* Strip the CSP header off the length field before converting to CSP packet */
-				packet->length -= CSP_HEADER_LENGTH;
+				packet->length -= idlen;
 
 				/* Convert the packet from network to host order */
-				packet->id.ext = csp_ntoh32(packet->id.ext);
+				packet->id = csp_id_decode(header, csp_if_kiss.ext_header);
 
 				/* Send back into CSP, notice calling from task so last argument must be NULL! */
 				csp_new_packet(packet, &csp_if_kiss, pxTaskWoken);
@@ -40,6 +40,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "../csp_port.h"
 #include "../csp_conn.h"
 #include "../csp_io.h"
+#include "../csp_route.h"
 #include "csp_transport.h"
 
 #ifdef CSP_USE_RDP
@@ -49,6 +50,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define RDP_EAK 0x04
 #define RDP_RST	0x08
 
+/* Protocol features, offered in the SYN options and accepted in the SYN/ACK.
+ * Peers that do not send the feature option support none of them. */
+#define RDP_FEAT_WINDOW	0x01	// Segments carry the receive window of the sender
+#define RDP_FEATURES	(RDP_FEAT_WINDOW)
+
+/* Sequence numbers are 16 bit and compared with wrapping arithmetic. Valid sequence
+ * and acknowledgement numbers span up to four windows, which must fit in half the
+ * sequence space for the comparisons to be unambiguous. */
+#if (CSP_RDP_MAX_WINDOW * 4) >= 32768
+#error "CSP_RDP_MAX_WINDOW is too large for 16 bit RDP sequence numbers"
+#endif
+
 static uint32_t csp_rdp_window_size = 4;
 static uint32_t csp_rdp_conn_timeout = 10000;
 static uint32_t csp_rdp_packet_timeout = 1000;
@@ -74,7 +87,8 @@ typedef struct __attribute__((__packed__)) {
 		uint8_t flags;
 		struct __attribute__((__packed__)) {
 #if defined(CSP_BIG_ENDIAN) && !defined(CSP_LITTLE_ENDIAN)
-			unsigned int res : 4;
+			unsigned int res : 3;
+			unsigned int win : 1;
 			unsigned int syn : 1;
 			unsigned int ack : 1;
 			unsigned int eak : 1;
@@ -84,7 +98,8 @@ typedef struct __attribute__((__packed__)) {
 			unsigned int eak : 1;
 			unsigned int ack : 1;
 			unsigned int syn : 1;
-			unsigned int res : 4;
+			unsigned int win : 1;
+			unsigned int res : 3;
 #else
   #error "Must define one of CSP_BIG_ENDIAN or CSP_LITTLE_ENDIAN in csp_platform.h"
 #endif
@@ -94,6 +109,9 @@ typedef struct __attribute__((__packed__)) {
 	uint16_t ack_nr;
 } rdp_header_t;
 
+/* The receive window is placed just before the header, when the WIN flag is set */
+typedef uint16_t rdp_window_t;
+
 /**
  * RDP Headers:
  * The following functions are helper functions that handles the extra RDP
@@ -149,6 +167,160 @@ static inline int csp_rdp_time_after(uint32_t time, uint32_t cmp) {
 	return csp_rdp_time_before(cmp, time);
 }
 
+/**
+ * RETRANSMIT QUEUE REFERENCES
+ * A packet kept in the retransmit queue is shared with the outgoing interface
+ * when possible, instead of being copied. This requires that the interface
+ * does not modify the packet, and that no security trailers are appended or
+ * encryption applied in place by csp_send_direct.
+ */
+static int csp_rdp_tx_shared(csp_conn_t * conn) {
+
+	if (conn->idout.flags & (CSP_FHMAC | CSP_FXTEA | CSP_FCRC32 | CSP_FAEAD))
+		return 0;
+
+	csp_iface_t * ifout = csp_route_if_flow(conn->idout, NULL);
+	if (ifout == NULL)
+		return 0;
+
+	return ifout->tx_shared;
+
+}
+
+/**
+ * Get a second reference to a packet, either by increasing the reference
+ * count of a shared packet or by cloning the packet.
+ * @return pointer to packet reference or NULL if out of buffers
+ */
+static csp_packet_t * csp_rdp_tx_ref(csp_conn_t * conn, csp_packet_t * packet) {
+
+	if (csp_rdp_tx_shared(conn)) {
+		csp_buffer_refc_inc(packet);
+		return packet;
+	}
+
+	return csp_buffer_clone(packet);
+
+}
+
+/**
+ * WINDOW SIZE
+ * The window size is negotiated at connect time. Both ends limit the window to
+ * the compile time ceiling. Without flow control, the window is also limited to
+ * what the connection RX queue can absorb while still acknowledging a full window.
+ */
+static uint32_t csp_rdp_window_limit(uint32_t window_size, uint32_t features) {
+
+	uint32_t limit = CSP_RDP_MAX_WINDOW;
+	if (!(features & RDP_FEAT_WINDOW) && limit > CSP_RX_QUEUE_LENGTH / 2)
+		limit = CSP_RX_QUEUE_LENGTH / 2;
+
+	if (window_size > limit)
+		window_size = limit;
+	if (window_size < 1)
+		window_size = 1;
+
+	return window_size;
+
+}
+
+/**
+ * RDP QUEUES
+ * The retransmit and out-of-sequence queues are created when a connection
+ * is opened, sized to the window of that connection, and removed on close.
+ */
+static int csp_rdp_queues_create(csp_conn_t * conn) {
+
+	/* Already created, e.g. when retrying a connect */
+	if (conn->rdp.tx_queue != NULL)
+		return CSP_ERR_NONE;
+
+	csp_debug(CSP_BUFFER, "RDP: Creating RDP queues for conn %p, window %"PRIu32"\r\n", conn, conn->rdp.window_size);
+
+	/* Create TX queue */
+	conn->rdp.tx_queue = csp_queue_create(conn->rdp.window_size, sizeof(csp_packet_t *));
+	if (conn->rdp.tx_queue == NULL) {
+		csp_debug(CSP_ERROR, "Failed to create TX queue for conn\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	/* Create RX queue */
+	conn->rdp.rx_queue = csp_queue_create(conn->rdp.window_size * 2, sizeof(csp_packet_t *));
+	if (conn->rdp.rx_queue == NULL) {
+		csp_debug(CSP_ERROR, "Failed to create RX queue for conn\r\n");
+		csp_queue_remove(conn->rdp.tx_queue);
+		conn->rdp.tx_queue = NULL;
+		return CSP_ERR_NOMEM;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+/**
+ * FLOW CONTROL
+ * When both ends support it, every segment carries the number of segments its
+ * sender can accept beyond the acknowledged sequence number. Data is then
+ * acknowledged as it arrives, and the peer stops sending when the advertised
+ * window is used up, instead of waiting for acknowledgements to be withheld.
+ */
+
+/* Return the number of segments the connection RX queues can take */
+static uint16_t csp_rdp_rcv_window(csp_conn_t * conn) {
+
+	int prio, free, window = conn->rdp.window_size;
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		free = CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]);
+		if (free < window)
+			window = free;
+	}
+
+	return (window > 0) ? window : 0;
+
+}
+
+/* Return 1 if both the send window and the window of the peer allow another segment */
+static inline int csp_rdp_window_open(csp_conn_t * conn) {
+
+	uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una;
+	if (in_flight >= conn->rdp.window_size)
+		return 0;
+	if ((conn->rdp.features & RDP_FEAT_WINDOW) && in_flight >= conn->rdp.snd_wnd)
+		return 0;
+
+	return 1;
+
+}
+
+/* Append the RDP header, preceded by the current receive window if the peer reads it */
+static rdp_header_t * csp_rdp_header_add_window(csp_conn_t * conn, csp_packet_t * packet) {
+
+	if (!(conn->rdp.features & RDP_FEAT_WINDOW))
+		return csp_rdp_header_add(packet);
+
+	conn->rdp.rcv_wnd = csp_rdp_rcv_window(conn);
+	rdp_window_t window = csp_hton16(conn->rdp.rcv_wnd);
+	memcpy(&packet->data[packet->length], &window, sizeof(window));
+	packet->length += sizeof(window);
+
+	rdp_header_t * header = csp_rdp_header_add(packet);
+	header->win = 1;
+	return header;
+
+}
+
+/* Update the receive window of a segment that is retransmitted */
+static void csp_rdp_window_refresh(csp_conn_t * conn, rdp_header_t * header) {
+
+	if (!header->win)
+		return;
+
+	conn->rdp.rcv_wnd = csp_rdp_rcv_window(conn);
+	rdp_window_t window = csp_hton16(conn->rdp.rcv_wnd);
+	memcpy((uint8_t *) header - sizeof(window), &window, sizeof(window));
+
+}
+
 /**
  * CONTROL MESSAGES
  * The following function is used to send empty messages,
@@ -165,7 +337,7 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 	}
 
 	/* Add RDP header */
-	rdp_header_t * header = csp_rdp_header_add(packet);
+	rdp_header_t * header = csp_rdp_header_add_window(conn, packet);
 	header->seq_nr = csp_hton16(seq_nr);
 	header->ack_nr = csp_hton16(ack_nr);
 	header->ack = (flags & RDP_ACK) ? 1 : 0;
@@ -175,7 +347,7 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 
 	/* Send copy to tx_queue, before sending packet to IF */
 	if (flags & RDP_SYN) {
-		rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
+		rdp_packet_t * rdp_packet = (rdp_packet_t *) csp_rdp_tx_ref(conn, packet);
 		if (rdp_packet == NULL) return CSP_ERR_NOMEM;
 		rdp_packet->timestamp = csp_get_ms();
 		if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK)
@@ -248,18 +420,38 @@ static int csp_rdp_send_syn(csp_conn_t * conn) {
 	if (packet == NULL) return CSP_ERR_NOMEM;
 
 	/* Generate contents */
-	packet->data32[0] = csp_hton32(csp_rdp_window_size);
+	packet->data32[0] = csp_hton32(conn->rdp.window_size);
 	packet->data32[1] = csp_hton32(csp_rdp_conn_timeout);
 	packet->data32[2] = csp_hton32(csp_rdp_packet_timeout);
 	packet->data32[3] = csp_hton32(csp_rdp_delayed_acks);
 	packet->data32[4] = csp_hton32(csp_rdp_ack_timeout);
 	packet->data32[5] = csp_hton32(csp_rdp_ack_delay_count);
-	packet->length = 6 * sizeof(uint32_t);
+	packet->data32[6] = csp_hton32(RDP_FEATURES);
+	packet->length = 7 * sizeof(uint32_t);
 
 	return csp_rdp_send_cmp(conn, packet, RDP_SYN, conn->rdp.snd_iss, 0);
 
 }
 
+/**
+ * SYN/ACK Packet
+ * The following function sends a SYN/ACK packet, carrying the accepted window size and features
+ */
+static int csp_rdp_send_synack(csp_conn_t * conn) {
+
+	/* Allocate message */
+	csp_packet_t * packet = csp_buffer_get(20);
+	if (packet == NULL) return CSP_ERR_NOMEM;
+
+	/* Generate contents */
+	packet->data32[0] = csp_hton32(conn->rdp.window_size);
+	packet->data32[1] = csp_hton32(conn->rdp.features);
+	packet->length = 2 * sizeof(uint32_t);
+
+	return csp_rdp_send_cmp(conn, packet, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+
+}
+
 static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet) {
 
 	/* If a socket is set, this message is the first in a new connection
@@ -409,13 +601,47 @@ static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet) {
 
 }
 
+/* Free acknowledged segments from the retransmit queue */
+static void csp_rdp_tx_queue_purge(csp_conn_t * conn) {
+
+	int i, count;
+	rdp_packet_t * packet;
+
+	count = csp_queue_size(conn->rdp.tx_queue);
+	for (i = 0; i < count; i++) {
+
+		if ((csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) || packet == NULL)
+			break;
+
+		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+		if (csp_rdp_seq_before(csp_ntoh16(header->seq_nr), conn->rdp.snd_una)) {
+			csp_buffer_free(packet);
+			continue;
+		}
+
+		csp_queue_enqueue_isr(conn->rdp.tx_queue, &packet, &pdTrue);
+
+	}
+
+}
+
+/* Record that an outgoing segment carried the ACK, so no separate ACK is needed */
+static inline void csp_rdp_ack_piggybacked(csp_conn_t * conn, uint16_t ack_nr) {
+
+	if (conn->rdp.rcv_lsa != ack_nr) {
+		conn->rdp.rcv_lsa = ack_nr;
+		conn->rdp.ack_timestamp = csp_get_ms();
+	}
+
+}
+
 static inline int csp_rdp_should_ack(csp_conn_t * conn) {
 
 	/* If delayed ACKs are not used, always ACK */
 	if (!conn->rdp.delayed_acks)
 		return 1;
 
-	/* ACK if time since last ACK is greater than ACK timeout */
+	/* ACK if the oldest unacknowledged segment has waited longer than ACK timeout */
 	uint32_t time_now = csp_get_ms();
 	if (csp_rdp_time_after(time_now, conn->rdp.ack_timestamp + conn->rdp.ack_timeout))
 		return 1;
@@ -430,10 +656,8 @@ static inline int csp_rdp_should_ack(csp_conn_t * conn) {
 
 void csp_rdp_flush_all(csp_conn_t * conn) {
 
-	if ((conn == NULL) || conn->rdp.tx_queue == NULL) {
-		csp_debug(CSP_ERROR, "Null pointer passed to rdp flush all\r\n");
+	if ((conn == NULL) || conn->rdp.tx_queue == NULL)
 		return;
-	}
 
 	rdp_packet_t * packet;
 
@@ -457,11 +681,24 @@ void csp_rdp_flush_all(csp_conn_t * conn) {
 
 int csp_rdp_check_ack(csp_conn_t * conn) {
 
+	/* With flow control, segments are acknowledged as usual, and a window update is
+	 * sent as soon as half a window has been freed after advertising less than that */
+	if (conn->rdp.features & RDP_FEAT_WINDOW) {
+		uint16_t half = (conn->rdp.window_size + 1) / 2;
+		if (conn->rdp.state == RDP_OPEN && conn->rdp.rcv_wnd < half && csp_rdp_rcv_window(conn) >= half) {
+			csp_debug(CSP_PROTOCOL, "RDP: Window opened, sending update\r\n");
+			csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+		} else if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur && csp_rdp_should_ack(conn)) {
+			csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+		}
+		return CSP_ERR_NONE;
+	}
+
 	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur) {
 		/* Check all RX queues for spare capacity */
 		int prio, avail = 1;
 		for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
-			if (CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]) <= (int32_t)conn->rdp.window_size) {
+			if (CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]) <= (int)conn->rdp.window_size) {
 				avail = 0;
 				break;
 			}
@@ -511,6 +748,10 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 		return;
 	}
 
+	/* No queues yet, connection is not open */
+	if (conn->rdp.tx_queue == NULL)
+		return;
+
 	/**
 	 * MESSAGE TIMEOUT:
 	 * Check each outgoing message for TX timeout
@@ -534,19 +775,25 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 			continue;
 		}
 
-		/* Check timestamp and retransmit if needed */
-		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.packet_timeout)) {
+		/* Check timestamp and retransmit if needed. A shared packet that is still
+		 * referenced by the interface has not finished transmitting yet. */
+		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.packet_timeout)
+				&& csp_buffer_refc(packet) == 1) {
 			csp_debug(CSP_PROTOCOL, "TX Element timed out, retransmitting seq %u\r\n", csp_ntoh16(header->seq_nr));
 
-			/* Update to latest outgoing ACK */
-			header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+			/* Update to latest outgoing ACK and receive window */
+			uint16_t ack_nr = conn->rdp.rcv_cur;
+			header->ack_nr = csp_hton16(ack_nr);
+			csp_rdp_window_refresh(conn, header);
 
-			/* Send copy to tx_queue */
+			/* Keep packet in tx_queue and send a reference */
 			packet->timestamp = csp_get_ms();
-			csp_packet_t * new_packet = csp_buffer_clone(packet);
+			csp_packet_t * new_packet = csp_rdp_tx_ref(conn, (csp_packet_t *) packet);
 			if (csp_send_direct(conn->idout, new_packet, 0) != CSP_ERR_NONE) {
 				csp_debug(CSP_WARN, "Retransmission failed\r\n");
 				csp_buffer_free(new_packet);
+			} else {
+				csp_rdp_ack_piggybacked(conn, ack_nr);
 			}
 
 		}
@@ -562,18 +809,50 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 	 */
 	csp_rdp_check_ack(conn);
 
+	/**
+	 * ZERO WINDOW PROBE:
+	 * When the peer has closed its window and everything sent is acknowledged, a lost
+	 * window update would never be repeated. Probe with the last sequence number sent,
+	 * which the peer answers with an EACK carrying its current window.
+	 */
+	if (conn->rdp.state == RDP_OPEN && (conn->rdp.features & RDP_FEAT_WINDOW)
+			&& conn->rdp.snd_wnd == 0 && conn->rdp.snd_nxt == conn->rdp.snd_una
+			&& csp_rdp_time_after(time_now, conn->rdp.probe_timestamp + conn->rdp.packet_timeout)) {
+		csp_debug(CSP_PROTOCOL, "RDP: Zero window, probing peer\r\n");
+		conn->rdp.probe_timestamp = time_now;
+		csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt - 1, conn->rdp.rcv_cur);
+	}
+
 	/* Wake user task if TX queue is ready for more data */
 	if (conn->rdp.state == RDP_OPEN)
 		if (csp_queue_size(conn->rdp.tx_queue) < (int)conn->rdp.window_size)
-			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
+			if (csp_rdp_window_open(conn))
 				csp_bin_sem_post(&conn->rdp.tx_wait);
 
 }
 
 void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
-	/* Get RX header and convert to host byte-order */
+	/* Get RX header */
 	rdp_header_t * rx_header = csp_rdp_header_ref(packet);
+
+	/* Strip the receive window of the peer, so the header is the last field again */
+	uint16_t rx_window = 0;
+	if (rx_header->win) {
+		if (packet->length < sizeof(rdp_header_t) + sizeof(rdp_window_t)) {
+			csp_debug(CSP_ERROR, "RDP: Too short for receive window\r\n");
+			goto discard_open;
+		}
+		rdp_window_t window;
+		uint8_t * window_ptr = (uint8_t *) rx_header - sizeof(window);
+		memcpy(&window, window_ptr, sizeof(window));
+		rx_window = csp_ntoh16(window);
+		memmove(window_ptr, rx_header, sizeof(rdp_header_t));
+		packet->length -= sizeof(window);
+		rx_header = csp_rdp_header_ref(packet);
+	}
+
+	/* Convert to host byte-order */
 	rx_header->ack_nr = csp_ntoh16(rx_header->ack_nr);
 	rx_header->seq_nr = csp_ntoh16(rx_header->seq_nr);
 
@@ -640,8 +919,13 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.rcv_irs = rx_header->seq_nr;
 		conn->rdp.rcv_lsa = rx_header->seq_nr;
 
+		/* Accept the features offered by the peer, that are also supported here */
+		conn->rdp.features = 0;
+		if (packet->length >= sizeof(rdp_header_t) + 7 * sizeof(uint32_t))
+			conn->rdp.features = csp_ntoh32(packet->data32[6]) & RDP_FEATURES;
+
 		/* Store RDP options */
-		conn->rdp.window_size 		= csp_ntoh32(packet->data32[0]);
+		conn->rdp.window_size 		= csp_rdp_window_limit(csp_ntoh32(packet->data32[0]), conn->rdp.features);
 		conn->rdp.conn_timeout 		= csp_ntoh32(packet->data32[1]);
 		conn->rdp.packet_timeout 	= csp_ntoh32(packet->data32[2]);
 		conn->rdp.delayed_acks 		= csp_ntoh32(packet->data32[3]);
@@ -651,12 +935,21 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 				conn->rdp.window_size, conn->rdp.conn_timeout, conn->rdp.packet_timeout);
 		csp_debug(CSP_PROTOCOL, "RDP: Delayed acks: %u, ack timeout %u, ack each %u packet\r\n",
 				conn->rdp.delayed_acks, conn->rdp.ack_timeout, conn->rdp.ack_delay_count);
+		conn->rdp.snd_wnd = conn->rdp.window_size;
+		conn->rdp.rcv_wnd = conn->rdp.window_size;
+		conn->rdp.probe_timestamp = csp_get_ms();
+
+		/* Create queues for the accepted window */
+		if (csp_rdp_queues_create(conn) != CSP_ERR_NONE) {
+			csp_rdp_send_cmp(conn, NULL, RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+			goto discard_close;
+		}
 
 		/* Connection accepted */
 		conn->rdp.state = RDP_SYN_RCVD;
 
 		/* Send SYN/ACK */
-		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+		csp_rdp_send_synack(conn);
 
 		goto discard_open;
 
@@ -678,7 +971,23 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			conn->rdp.ack_timestamp = csp_get_ms();
 			conn->rdp.state = RDP_OPEN;
 
-			csp_debug(CSP_PROTOCOL, "RDP: NP: Connection OPEN\r\n");
+			/* Use the features accepted by the peer */
+			conn->rdp.features = 0;
+			if (packet->length >= sizeof(rdp_header_t) + 2 * sizeof(uint32_t))
+				conn->rdp.features = csp_ntoh32(packet->data32[1]) & RDP_FEATURES;
+
+			/* Use the window accepted by the peer, if it is smaller than requested */
+			uint32_t window_size = conn->rdp.window_size;
+			if (packet->length >= sizeof(rdp_header_t) + sizeof(uint32_t))
+				window_size = csp_ntoh32(packet->data32[0]);
+			window_size = csp_rdp_window_limit(window_size, conn->rdp.features);
+			if (window_size < conn->rdp.window_size)
+				conn->rdp.window_size = window_size;
+
+			conn->rdp.snd_wnd = rx_header->win ? rx_window : conn->rdp.window_size;
+			conn->rdp.rcv_wnd = conn->rdp.window_size;
+
+			csp_debug(CSP_PROTOCOL, "RDP: NP: Connection OPEN, window %"PRIu32"\r\n", conn->rdp.window_size);
 
 			/* Send ACK */
 			if (conn->rdp.delayed_acks == 0)
@@ -737,7 +1046,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 					rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + 1 + conn->rdp.window_size * 2);
 			/* If duplicate SYN received, send another SYN/ACK */
 			if (conn->rdp.state == RDP_SYN_RCVD)
-				csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+				csp_rdp_send_synack(conn);
 			/* If duplicate data packet received, send EACK back */
 			if (conn->rdp.state == RDP_OPEN)
 				csp_rdp_send_eack(conn);
@@ -762,9 +1071,21 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			conn->rdp.state = RDP_OPEN;
 		}
 
+		/* Store the window of the peer, unless the ACK is older than the last one */
+		if (rx_header->win && !csp_rdp_seq_before(rx_header->ack_nr + 1, conn->rdp.snd_una))
+			conn->rdp.snd_wnd = rx_window;
+
 		/* Store current ack'ed sequence number */
+		uint16_t snd_una = conn->rdp.snd_una;
 		conn->rdp.snd_una = rx_header->ack_nr + 1;
 
+		/* Free what was acknowledged and wake the sender as soon as the window opens */
+		if (conn->rdp.state == RDP_OPEN && conn->rdp.snd_una != snd_una) {
+			csp_rdp_tx_queue_purge(conn);
+			if (csp_rdp_window_open(conn))
+				csp_bin_sem_post(&conn->rdp.tx_wait);
+		}
+
 		/* We have an EACK */
 		if (rx_header->eak) {
 			if (packet->length > sizeof(rdp_header_t))
@@ -793,6 +1114,10 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		if (!csp_rdp_receive_data(conn, packet))
 			goto discard_open;
 
+		/* Start the delayed ACK timer, if everything was acknowledged until now */
+		if (conn->rdp.rcv_lsa == conn->rdp.rcv_cur)
+			conn->rdp.ack_timestamp = csp_get_ms();
+
 		/* Update last received packet */
 		conn->rdp.rcv_cur = seq_nr;
 
@@ -800,10 +1125,11 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		int rxq = csp_conn_get_rxq(packet->id.pri);
 		int rx_queue_size = csp_queue_size(conn->rx_queue[rxq]);
 
-		/* Only ACK the message if there is room for a full window in the RX buffer.
+		/* With flow control the peer is limited by the advertised window. Otherwise,
+		 * only ACK the message if there is room for a full window in the RX buffer.
 		 * Unacknowledged segments are ACKed by csp_rdp_check_timeouts when the buffer is
 		 * no longer full. */
-		if (rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH) {
+		if ((conn->rdp.features & RDP_FEAT_WINDOW) || rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH) {
 			if (csp_rdp_should_ack(conn))
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 		} else {
@@ -868,13 +1194,17 @@ int csp_rdp_connect(csp_conn_t * conn, uint32_t timeout) {
 
 	int retry = 1;
 
-	conn->rdp.window_size	 = csp_rdp_window_size;
+	conn->rdp.window_size	 = csp_rdp_window_limit(csp_rdp_window_size, RDP_FEATURES);
 	conn->rdp.conn_timeout	= csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout  = csp_rdp_packet_timeout;
 	conn->rdp.delayed_acks	= csp_rdp_delayed_acks;
 	conn->rdp.ack_timeout 	  = csp_rdp_ack_timeout;
 	conn->rdp.ack_delay_count = csp_rdp_ack_delay_count;
 	conn->rdp.ack_timestamp   = csp_get_ms();
+	conn->rdp.probe_timestamp = csp_get_ms();
+	conn->rdp.features		= 0;
+	conn->rdp.snd_wnd		= conn->rdp.window_size;
+	conn->rdp.rcv_wnd		= conn->rdp.window_size;
 
 retry:
 	csp_debug(CSP_PROTOCOL, "RDP: Active connect, conn state %u\r\n", conn->rdp.state);
@@ -884,6 +1214,10 @@ retry:
 		return CSP_ERR_ALREADY;
 	}
 
+	/* Create queues for the requested window */
+	if (csp_rdp_queues_create(conn) != CSP_ERR_NONE)
+		goto error;
+
 	/* Randomize ISS */
 	srand(csp_get_ms());
 	conn->rdp.snd_iss = (uint16_t)rand();
@@ -931,7 +1265,7 @@ error:
 
 }
 
-int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
+int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout, uint16_t * ack_nr) {
 
 	if (conn->rdp.state != RDP_OPEN) {
 		csp_debug(CSP_ERROR, "RDP: ERROR cannot send, connection reset by peer!\r\n");
@@ -939,24 +1273,28 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 	}
 
 	/* If TX window is full, wait here */
-	uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una + 1;
-	if (in_flight > conn->rdp.window_size) {
+	while (!csp_rdp_window_open(conn)) {
 		csp_debug(CSP_PROTOCOL, "RDP: Waiting for window update before sending seq %u\r\n", conn->rdp.snd_nxt);
 		csp_bin_sem_wait(&conn->rdp.tx_wait, 0);
 		if ((csp_bin_sem_wait(&conn->rdp.tx_wait, timeout)) != CSP_SEMAPHORE_OK) {
 			csp_debug(CSP_ERROR, "Timeout during send\r\n");
 			return CSP_ERR_TIMEDOUT;
 		}
+		if (conn->rdp.state != RDP_OPEN) {
+			csp_debug(CSP_ERROR, "RDP: ERROR cannot send, connection reset by peer!\r\n");
+			return CSP_ERR_RESET;
+		}
 	}
 
-	/* Add RDP header */
-	rdp_header_t * tx_header = csp_rdp_header_add(packet);
-	tx_header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+	/* Add RDP header, acknowledging everything received so far */
+	*ack_nr = conn->rdp.rcv_cur;
+	rdp_header_t * tx_header = csp_rdp_header_add_window(conn, packet);
+	tx_header->ack_nr = csp_hton16(*ack_nr);
 	tx_header->seq_nr = csp_hton16(conn->rdp.snd_nxt);
 	tx_header->ack = 1;
 
-	/* Send copy to tx_queue */
-	rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
+	/* Keep a reference in tx_queue, the packet itself is sent by csp_send */
+	rdp_packet_t * rdp_packet = (rdp_packet_t *) csp_rdp_tx_ref(conn, packet);
 	if (rdp_packet == NULL) {
 		csp_debug(CSP_ERROR, "Failed to allocate packet buffer\r\n");
 		return CSP_ERR_NOMEM;
@@ -981,39 +1319,51 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 }
 
-int csp_rdp_allocate(csp_conn_t * conn) {
+void csp_rdp_sent(csp_conn_t * conn, uint16_t ack_nr) {
+
+	/* Pending delayed ACKs rode on the segment */
+	csp_rdp_ack_piggybacked(conn, ack_nr);
+
+}
 
-	csp_debug(CSP_BUFFER, "RDP: Creating RDP queues for conn %p\r\n", conn);
+int csp_rdp_allocate(csp_conn_t * conn) {
 
 	/* Set initial state */
 	conn->rdp.state = RDP_CLOSED;
 	conn->rdp.conn_timeout = csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout = csp_rdp_packet_timeout;
 
+	/* Queues are created when the connection is opened */
+	conn->rdp.tx_queue = NULL;
+	conn->rdp.rx_queue = NULL;
+
 	/* Create a binary semaphore to wait on for tasks */
 	if (csp_bin_sem_create(&conn->rdp.tx_wait) != CSP_SEMAPHORE_OK) {
 		csp_debug(CSP_ERROR, "Failed to initialize semaphore\r\n");
 		return CSP_ERR_NOMEM;
 	}
 
-	/* Create TX queue */
-	conn->rdp.tx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW, sizeof(csp_packet_t *));
-	if (conn->rdp.tx_queue == NULL) {
-		csp_debug(CSP_ERROR, "Failed to create TX queue for conn\r\n");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		return CSP_ERR_NOMEM;
-	}
+	return CSP_ERR_NONE;
 
-	/* Create RX queue */
-	conn->rdp.rx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW * 2, sizeof(csp_packet_t *));
-	if (conn->rdp.rx_queue == NULL) {
-		csp_debug(CSP_ERROR, "Failed to create RX queue for conn\r\n");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		csp_queue_remove(conn->rdp.tx_queue);
-		return CSP_ERR_NOMEM;
-	}
+}
 
-	return CSP_ERR_NONE;
+/**
+ * Flush and remove the RDP queues of a connection
+ * @note This function may only be called from csp_close
+ */
+void csp_rdp_release(csp_conn_t * conn) {
+
+	if (conn->rdp.tx_queue == NULL)
+		return;
+
+	csp_rdp_flush_all(conn);
+
+	csp_debug(CSP_BUFFER, "RDP: Removing RDP queues for conn %p\r\n", conn);
+
+	csp_queue_remove(conn->rdp.tx_queue);
+	csp_queue_remove(conn->rdp.rx_queue);
+	conn->rdp.tx_queue = NULL;
+	conn->rdp.rx_queue = NULL;
 
 }
 
@@ -1082,8 +1432,8 @@ void csp_rdp_conn_print(csp_conn_t * conn) {
 	if (conn == NULL)
 		return;
 
-	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32"\r\n",
-			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size);
+	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32", peer win %"PRIu16"\r\n",
+			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size, conn->rdp.snd_wnd);
 
 }
 #endif
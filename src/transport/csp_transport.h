@@ -34,10 +34,12 @@ int csp_rdp_connect(csp_conn_t * conn, uint32_t timeout);
 int csp_rdp_allocate(csp_conn_t * conn);
 int csp_rdp_close(csp_conn_t * conn);
 void csp_rdp_conn_print(csp_conn_t * conn);
-int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout);
+int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout, uint16_t * ack_nr);
+void csp_rdp_sent(csp_conn_t * conn, uint16_t ack_nr);
 int csp_rdp_check_ack(csp_conn_t * conn);
 void csp_rdp_check_timeouts(csp_conn_t * conn);
 void csp_rdp_flush_all(csp_conn_t * conn);
+void csp_rdp_release(csp_conn_t * conn);
 
 #ifdef __cplusplus
 } /* extern "C" */